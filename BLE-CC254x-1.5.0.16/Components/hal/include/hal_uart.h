@@ -231,6 +231,12 @@ extern uint16 Hal_UART_RxBufLen ( uint8 port );
  */
 extern uint16 Hal_UART_TxBufLen ( uint8 port );
 
+/*
+ * Access the Rx buffer in place, then release the bytes that were used
+ */
+extern uint16 Hal_UART_RxSpan ( uint8 port, uint8 **buf );
+extern void Hal_UART_RxConsume ( uint8 port, uint16 len );
+
 /*
  * This enable/disable flow control
  */
@@ -259,6 +259,10 @@ static uint16 HalUARTReadISR(uint8 *buf, uint16 len);
 static uint16 HalUARTWriteISR(uint8 *buf, uint16 len);
 static void HalUARTPollISR(void);
 static uint16 HalUARTRxAvailISR(void);
+#ifdef BLUEBASIC_MEM
+static uint16 HalUARTRxSpanISR(uint8 **buf);
+static void HalUARTRxConsumeISR(uint16 len);
+#endif
 static uint8 HalUARTBusyISR(void);
 static void HalUARTSuspendISR(void);
 static void HalUARTResumeISR(void);
@@ -366,6 +370,48 @@ static uint16 HalUARTReadISR(uint8 *buf, uint16 len)
   return cnt;
 }
 
+#ifdef BLUEBASIC_MEM
+/*****************************************************************************
+ * @fn      HalUARTRxSpanISR
+ *
+ * @brief   Give access to received bytes in place, without copying them
+ *
+ * @param   buf  - set to the first unread byte in the Rx buffer
+ *
+ * @return  number of unread bytes up to the end of the Rx buffer
+ *****************************************************************************/
+static uint16 HalUARTRxSpanISR(uint8 **buf)
+{
+  rxIdx_t tail = isrCfg.rxTail;
+
+  *buf = isrCfg.rxBuf + isrCfg.rxHead;
+  if (tail >= isrCfg.rxHead)
+  {
+    return tail - isrCfg.rxHead;
+  }
+  return HAL_UART_ISR_RX_MAX - isrCfg.rxHead;
+}
+
+/*****************************************************************************
+ * @fn      HalUARTRxConsumeISR
+ *
+ * @brief   Release bytes handed out by HalUARTRxSpanISR()
+ *
+ * @param   len  - number of bytes processed, at most the span length
+ *
+ * @return  none
+ *****************************************************************************/
+static void HalUARTRxConsumeISR(uint16 len)
+{
+  len += isrCfg.rxHead;
+  if (len >= HAL_UART_ISR_RX_MAX)
+  {
+    len -= HAL_UART_ISR_RX_MAX;
+  }
+  isrCfg.rxHead = len;
+}
+#endif // BLUEBASIC_MEM
+
 /******************************************************************************
  * @fn      HalUARTWriteISR
  *
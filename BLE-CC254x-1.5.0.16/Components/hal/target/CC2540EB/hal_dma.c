@@ -82,14 +82,16 @@ void HalDmaInit( void )
   HAL_DMA_SET_ADDR_DESC1234( dmaCh1234 );
 #if (HAL_UART_DMA || \
    ((defined HAL_UART_SPI) && (HAL_UART_SPI != 0)) || \
-   ((defined HAL_IRGEN) && (HAL_IRGEN == TRUE)))
+   ((defined HAL_IRGEN) && (HAL_IRGEN == TRUE)) || \
+   (defined BLUEBASIC))
   DMAIE = 1;
 #endif
 }
 
 #if (HAL_UART_DMA || \
    ((defined HAL_UART_SPI) && (HAL_UART_SPI != 0)) || \
-   ((defined HAL_IRGEN) && (HAL_IRGEN == TRUE)))
+   ((defined HAL_IRGEN) && (HAL_IRGEN == TRUE)) || \
+   (defined BLUEBASIC))
 /******************************************************************************
  * @fn      HalDMAInit
  *
@@ -123,6 +125,12 @@ HAL_ISR_FUNCTION( halDmaIsr, DMA_VECTOR )
   }
 #endif
 
+#ifdef BLUEBASIC
+  // SPI array transfers
+  extern void bb_dmaisr(void);
+  bb_dmaisr();
+#endif
+
   CLEAR_SLEEP_MODE();
   HAL_EXIT_ISR();
 
@@ -421,6 +421,44 @@ uint16 Hal_UART_TxBufLen( uint8 port )
   return 0;
 }
 
+#ifdef BLUEBASIC_MEM
+/**************************************************************************************************
+ * @fn      Hal_UART_RxSpan()
+ *
+ * @brief   Point at the received bytes without copying them. Only ISR driven ports keep
+ *          plain bytes in their Rx buffer; DMA and SPI ports always report an empty span.
+ *
+ * @param   port - UART port
+ *          buf  - set to the first unread byte
+ *
+ * @return  number of contiguous bytes at buf, release them with Hal_UART_RxConsume()
+ **************************************************************************************************/
+uint16 Hal_UART_RxSpan( uint8 port, uint8 **buf )
+{
+#if (HAL_UART_ISR == 1)
+  if (port == HAL_UART_PORT_0)  return HalUARTRxSpanISR(buf);
+#endif
+#if (HAL_UART_ISR == 2)
+  if (port == HAL_UART_PORT_1)  return HalUARTRxSpanISR(buf);
+#endif
+  (void) port;
+  (void) buf;
+  return 0;
+}
+
+void Hal_UART_RxConsume( uint8 port, uint16 len )
+{
+#if (HAL_UART_ISR == 1)
+  if (port == HAL_UART_PORT_0)  HalUARTRxConsumeISR(len);
+#endif
+#if (HAL_UART_ISR == 2)
+  if (port == HAL_UART_PORT_1)  HalUARTRxConsumeISR(len);
+#endif
+  (void) port;
+  (void) len;
+}
+#endif // BLUEBASIC_MEM
+
 void HalUARTIsrDMA(void)
 {
 #if (HAL_UART_DMA && HAL_UART_SPI)  // When both are defined, port is run-time choice.
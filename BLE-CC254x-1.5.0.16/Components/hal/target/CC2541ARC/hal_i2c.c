@@ -210,11 +210,11 @@ static uint8 i2cTxBuf[HAL_I2C_BUF_MAX+1];
 
 static volatile i2cLen_t i2cRxLen, i2cTxLen;
 
-#if HAL_I2C_MASTER
 /**************************************************************************************************
  * @fn          i2cMstStrt
  *
- * @brief       Attempt to send an I2C bus START and Slave Address as an I2C bus Master.
+ * @brief       Attempt to send an I2C bus START, or a repeated START, and Slave Address as an
+ *              I2C bus Master.
  *
  * input parameters
  *
@@ -231,7 +231,7 @@ static uint8 i2cMstStrt(uint8 address, uint8 RD_WRn)
 {
   I2C_STRT();
 
-  if (I2CSTAT == mstStarted)
+  if (I2CSTAT == mstStarted || I2CSTAT == mstRepStart)
   {
     address <<= 1;
     I2C_WRITE(address | RD_WRn);
@@ -241,36 +241,51 @@ static uint8 i2cMstStrt(uint8 address, uint8 RD_WRn)
 }
 
 /**************************************************************************************************
- * @fn          HalI2CInit
+ * @fn          i2cMstTx
  *
- * @brief       Initialize the I2C bus as a Master.
+ * @brief       Write bytes to the addressed Slave as an I2C bus Master.
  *
  * input parameters
  *
- * @param       clockRate - I2C clock rate.
+ * @param       len - Number of bytes to write.
+ * @param       pBuf - Pointer to the data buffer to write.
  *
  * output parameters
  *
  * None.
  *
- * @return      None.
+ * @return      The number of bytes successfully written.
  */
-void HalI2CInit(i2cClock_t clockRate)
+static i2cLen_t i2cMstTx(i2cLen_t len, uint8 *pBuf)
 {
-  I2C_WRAPPER_DISABLE();
-  I2CADDR = 0; // no multi master support at this time
-  I2C_CLOCK_RATE(clockRate);
-  I2C_ENABLE();
+  for (i2cLen_t cnt = 0; cnt < len; cnt++)
+  {
+    I2C_WRITE(*pBuf++);
+
+    if (I2CSTAT != mstDataAckW)
+    {
+      if (I2CSTAT == mstDataNackW)
+      {
+        len = cnt + 1;
+      }
+      else
+      {
+        len = cnt;
+      }
+      break;
+    }
+  }
+
+  return len;
 }
 
 /**************************************************************************************************
- * @fn          HalI2CRead
+ * @fn          i2cMstRx
  *
- * @brief       Read from the I2C bus as a Master.
+ * @brief       Read bytes from the addressed Slave as an I2C bus Master.
  *
  * input parameters
  *
- * @param       address - I2C address of the slave device we're attempting to read from
  * @param       len - Number of bytes to read.
  * @param       pBuf - Pointer to the data buffer to put read bytes.
  *
@@ -280,14 +295,9 @@ void HalI2CInit(i2cClock_t clockRate)
  *
  * @return      The number of bytes successfully read.
  */
-i2cLen_t HalI2CRead(uint8 address, i2cLen_t len, uint8 *pBuf)
+static i2cLen_t i2cMstRx(i2cLen_t len, uint8 *pBuf)
 {
-  uint8 cnt = 0;
-
-  if (i2cMstStrt(address, I2C_MST_RD_BIT) != mstAddrAckR)
-  {
-    len = 0;
-  }
+  i2cLen_t cnt = 0;
 
   // All bytes are ACK'd except for the last one which is NACK'd. If only
   // 1 byte is being read, a single NACK will be sent. Thus, we only want
@@ -321,54 +331,139 @@ i2cLen_t HalI2CRead(uint8 address, i2cLen_t len, uint8 *pBuf)
     }
   }
 
-  I2C_STOP();
   return cnt;
 }
 
 /**************************************************************************************************
- * @fn          HalI2CWrite
+ * @fn          HalI2CTransfer
  *
- * @brief       Write to the I2C bus as a Master.
+ * @brief       Write to and then read from a Slave as an I2C bus Master, in one transaction.
+ *              The read follows a repeated START, so a register address can be written and the
+ *              registers from there read in one burst. In a Slave build the bus is briefly
+ *              mastered, with the Slave ISR held off.
  *
  * input parameters
  *
- * @param       address - I2C address of the slave device we're attempting to write to
- * @param       len - Number of bytes to write.
- * @param       pBuf - Pointer to the data buffer to write.
+ * @param       address - I2C address of the slave device.
+ * @param       wlen - Number of bytes to write, or 0 to only read.
+ * @param       wBuf - Pointer to the data buffer to write.
+ * @param       rlen - Number of bytes to read, or 0 to only write.
+ * @param       rBuf - Pointer to the data buffer to put read bytes.
  *
  * output parameters
  *
  * None.
  *
- * @return      The number of bytes successfully written.
+ * @return      The number of bytes successfully read, or written if there was no read.
  */
-i2cLen_t HalI2CWrite(uint8 address, i2cLen_t len, uint8 *pBuf)
+i2cLen_t HalI2CTransfer(uint8 address, i2cLen_t wlen, uint8 *wBuf, i2cLen_t rlen, uint8 *rBuf)
 {
-  if (i2cMstStrt(address, 0) != mstAddrAckW)
+  i2cLen_t cnt = 0;
+#if HAL_I2C_SLAVE
+  const uint8 intEnabled = I2C_INT_ENABLED();
+
+  I2C_INT_DISABLE();
+#endif
+
+  if (wlen || !rlen)
   {
-    len = 0;
+    if (i2cMstStrt(address, 0) == mstAddrAckW)
+    {
+      cnt = i2cMstTx(wlen, wBuf);
+    }
+    if (cnt != wlen)
+    {
+      rlen = 0;
+    }
   }
-
-  for (i2cLen_t cnt = 0; cnt < len; cnt++)
+  if (rlen)
   {
-    I2C_WRITE(*pBuf++);
-
-    if (I2CSTAT != mstDataAckW)
+    cnt = 0;
+    if (i2cMstStrt(address, I2C_MST_RD_BIT) == mstAddrAckR)
     {
-      if (I2CSTAT == mstDataNackW)
-      {
-        len = cnt + 1;
-      }
-      else
-      {
-        len = cnt;
-      }
-      break;
+      cnt = i2cMstRx(rlen, rBuf);
     }
   }
 
   I2C_STOP();
-  return len;
+  // Ack when next addressed as a Slave
+  I2C_SET_ACK();
+
+#if HAL_I2C_SLAVE
+  if (intEnabled)
+  {
+    I2C_INT_ENABLE();
+  }
+#endif
+  return cnt;
+}
+
+#if HAL_I2C_MASTER
+/**************************************************************************************************
+ * @fn          HalI2CInit
+ *
+ * @brief       Initialize the I2C bus as a Master.
+ *
+ * input parameters
+ *
+ * @param       clockRate - I2C clock rate.
+ *
+ * output parameters
+ *
+ * None.
+ *
+ * @return      None.
+ */
+void HalI2CInit(i2cClock_t clockRate)
+{
+  I2C_WRAPPER_DISABLE();
+  I2CADDR = 0; // no multi master support at this time
+  I2C_CLOCK_RATE(clockRate);
+  I2C_ENABLE();
+}
+
+/**************************************************************************************************
+ * @fn          HalI2CRead
+ *
+ * @brief       Read from the I2C bus as a Master.
+ *
+ * input parameters
+ *
+ * @param       address - I2C address of the slave device we're attempting to read from
+ * @param       len - Number of bytes to read.
+ * @param       pBuf - Pointer to the data buffer to put read bytes.
+ *
+ * output parameters
+ *
+ * None.
+ *
+ * @return      The number of bytes successfully read.
+ */
+i2cLen_t HalI2CRead(uint8 address, i2cLen_t len, uint8 *pBuf)
+{
+  return HalI2CTransfer(address, 0, NULL, len, pBuf);
+}
+
+/**************************************************************************************************
+ * @fn          HalI2CWrite
+ *
+ * @brief       Write to the I2C bus as a Master.
+ *
+ * input parameters
+ *
+ * @param       address - I2C address of the slave device we're attempting to write to
+ * @param       len - Number of bytes to write.
+ * @param       pBuf - Pointer to the data buffer to write.
+ *
+ * output parameters
+ *
+ * None.
+ *
+ * @return      The number of bytes successfully written.
+ */
+i2cLen_t HalI2CWrite(uint8 address, i2cLen_t len, uint8 *pBuf)
+{
+  return HalI2CTransfer(address, len, pBuf, 0, NULL);
 }
 
 #else // if HAL_I2C_SLAVE
@@ -501,6 +596,32 @@ void HalI2CInit(uint8 address, i2cCallback_t i2cCallback)
   I2C_INT_ENABLE();
 }
 
+/**************************************************************************************************
+ * @fn          HalI2CMasterInit
+ *
+ * @brief       Enable Master transfers in a Slave build, keeping the Slave address if it is set.
+ *
+ * input parameters
+ *
+ * @param       clockRate - I2C clock rate.
+ *
+ * output parameters
+ *
+ * None.
+ *
+ * @return      None.
+ */
+void HalI2CMasterInit(i2cClock_t clockRate)
+{
+  if (!(I2CCFG & I2C_ENS1))
+  {
+    I2C_WRAPPER_DISABLE();
+    I2CADDR = 0;
+  }
+  I2C_CLOCK_RATE(clockRate);
+  I2C_ENABLE();
+}
+
 /**************************************************************************************************
  * @fn          HalI2CRead
  *
@@ -100,7 +100,6 @@ typedef uint8  i2cLen_t;
 typedef uint16 i2cLen_t;
 #endif
 
-#if HAL_I2C_MASTER
 typedef enum {
   i2cClock_123KHZ = 0x00,
   i2cClock_144KHZ = 0x01,
@@ -110,7 +109,8 @@ typedef enum {
   i2cClock_267KHZ = 0x81,
   i2cClock_533KHZ = 0x82
 } i2cClock_t;
-#else // if HAL_I2C_SLAVE
+
+#if HAL_I2C_SLAVE
 /**************************************************************************************************
  * @fn          i2cCallback_t
  *
@@ -144,12 +144,14 @@ i2cLen_t HalI2CRead(uint8 address, i2cLen_t len, uint8 *pBuf);
 i2cLen_t HalI2CWrite(uint8 address, i2cLen_t len, uint8 *pBuf);
 #else
 void HalI2CInit(uint8 address, i2cCallback_t i2cCallback);
+void HalI2CMasterInit(i2cClock_t clockRate);
 i2cLen_t HalI2CRead(i2cLen_t len, uint8 *pBuf);
 i2cLen_t HalI2CWrite(i2cLen_t len, uint8 *pBuf);
 #if HAL_I2C_POLLED
 void HalI2CPoll(void);
 #endif
 #endif
+i2cLen_t HalI2CTransfer(uint8 address, i2cLen_t wlen, uint8 *wBuf, i2cLen_t rlen, uint8 *rBuf);
 uint8 HalI2CReady2Sleep(void);
 void HalI2CEnterSleep(void);
 void HalI2CExitSleep(void);
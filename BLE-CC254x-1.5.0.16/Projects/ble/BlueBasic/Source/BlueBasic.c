@@ -152,12 +152,18 @@ uint8 blueBasic_TaskID;   // Task ID for internal task/event processing
 /*********************************************************************
  * EXTERNAL VARIABLES
  */
+extern uint8 ble_adtimer;
+extern uint8 ble_adrotate_timer;
+#if !defined(ENABLE_WIRE) || ENABLE_WIRE
+extern uint8 wire_timer;
+extern uint16 wire_timer_line;
+#endif
 
 /*********************************************************************
  * EXTERNAL FUNCTIONS
  */
 extern void ble_connection_status(uint16 connHandle, uint8 changeType, int8 rssi);
-extern void ble_init_ccc(void);
+extern void ble_init_ccc(uint16 connHandle);
 
 /*********************************************************************
  * LOCAL VARIABLES
@@ -189,10 +195,14 @@ static gattCharCfg_t *serviceChangedCharCfg = &serviceChanged;
 #if ENABLE_BLE_CONSOLE
 unsigned char ble_console_enabled;
 
+// Console output is buffered for several full notifications, so each connection event
+// can send as many as the controller has buffers for.
+#define IO_WRITE_NOTIFICATIONS 4
+
 static struct
 {
   //uint8 write[128];
-  uint8 write[(ATT_MTU_SIZE - 3)*1 + 1]; // MTU payload + 1 byte = 21 bytes
+  uint8 write[(ATT_MTU_SIZE - 3)*IO_WRITE_NOTIFICATIONS + 1]; // MTU payloads + 1 byte = 81 bytes
   uint8* writein;
   uint8* writeout;
 } io;
@@ -513,6 +523,30 @@ uint16 BlueBasic_ProcessEvent( uint8 task_id, uint16 events )
       VOID osal_msg_deallocate( pMsg );
     }
 
+#if OS_SPI_DMA
+    // A finished SPI DMA transfer raises this event without a message. Like the timer
+    // and pin handlers, its GOSUB waits until the interpreter is neither blocked,
+    // running nor yielded.
+    if (interpreter_spi_complete())
+    {
+#if ENABLE_YIELD
+      if (bluebasic_block_execution || bluebasic_yield_linenum)
+#else
+      if (bluebasic_block_execution)
+#endif
+      {
+        return events; // keep events spinning
+      }
+      SEMAPHORE_YIELD_WAIT();
+      interpreter_spi_run();
+      SEMAPHORE_YIELD_SIGNAL();
+    }
+#endif
+#if OS_ADC_SCAN
+    // .. and so does each block of ADC samples
+    interpreter_adc_scan();
+#endif
+
     // return unprocessed events
     return (events ^ SYS_EVENT_MSG);
   }
@@ -568,17 +602,41 @@ uint16 BlueBasic_ProcessEvent( uint8 task_id, uint16 events )
   }
   
 #ifdef FEATURE_SAMPLING
-  if ( sampling.map &&
+  if ( sampling.active && (sampling.map || sampling.power) &&
       events & (BLUEBASIC_EVENT_TIMER << sampling.timer) )
   {
     interpreter_sampling();
     return  events ^ (BLUEBASIC_EVENT_TIMER << sampling.timer);
   }
 #endif      
+
+  // Advertising fields are refreshed natively, without running the interpreter
+  if ( ble_adtimer < OS_MAX_TIMER &&
+      events & (BLUEBASIC_EVENT_TIMER << ble_adtimer) )
+  {
+    interpreter_advert_update();
+    return events ^ (BLUEBASIC_EVENT_TIMER << ble_adtimer);
+  }
+  if ( ble_adrotate_timer < OS_MAX_TIMER &&
+      events & (BLUEBASIC_EVENT_TIMER << ble_adrotate_timer) )
+  {
+    interpreter_advert_rotate();
+    return events ^ (BLUEBASIC_EVENT_TIMER << ble_adrotate_timer);
+  }
+
+#if !defined(ENABLE_WIRE) || ENABLE_WIRE
+  // Compiled WIRE sequences are run natively too
+  if ( wire_timer < OS_MAX_TIMER &&
+      events & (BLUEBASIC_EVENT_TIMER << wire_timer) )
+  {
+    interpreter_wire(wire_timer_line);
+    return events ^ (BLUEBASIC_EVENT_TIMER << wire_timer);
+  }
+#endif
   
-#if ENABLE_BLE_CONSOLE
   if ( events & BLUEBASIC_CONNECTION_EVENT )
   {
+#if ENABLE_BLE_CONSOLE
     while (io.writein != io.writeout)
     {
       uint8* save = io.writeout;
@@ -592,10 +650,31 @@ uint16 BlueBasic_ProcessEvent( uint8 task_id, uint16 events )
         return events;
       }
     }
+#endif
+    // Coalesced notifications and streams still sending are woken by the next connection event
+    interpreter_notify();
+    // The GOSUB of a finished stream waits, like the timer and pin handlers, until the
+    // interpreter is neither blocked, running nor yielded
+    if (interpreter_stream_complete())
+    {
+#if ENABLE_YIELD
+      if (bluebasic_block_execution || bluebasic_yield_linenum)
+#else
+      if (bluebasic_block_execution)
+#endif
+      {
+        return events; // keep events spinning
+      }
+      SEMAPHORE_YIELD_WAIT();
+      interpreter_stream_run();
+      SEMAPHORE_YIELD_SIGNAL();
+    }
     // when empty clear the event
     return ( events ^ BLUEBASIC_CONNECTION_EVENT );
   }
 
+#if ENABLE_BLE_CONSOLE
+
   if ( events & BLUEBASIC_INPUT_AVAILABLE )
   {
     interpreter_loop();
@@ -781,7 +860,7 @@ uint16 BlueBasic_ProcessEvent( uint8 task_id, uint16 events )
   }
 #endif  
 
-#ifdef HAL_I2C         
+#if HAL_I2C         
   if ( events & BLUEBASIC_EVENT_I2C )
   {
     if (i2c[0].onread && i2c[0].available_bytes)
@@ -822,6 +901,13 @@ static void blueBasic_HandleConnStatusCB(uint16 connHandle, uint8 changeType)
       }
     }
     ble_console_enabled = 0;
+    // Nobody is left to finish an upload
+    if (interpreter_load(NULL, 0))
+    {
+      interpreter_load_abort();
+      SEMAPHORE_INPUT_WAIT();
+      osal_set_event(blueBasic_TaskID, BLUEBASIC_INPUT_AVAILABLE);
+    }
   done:;
   }
 #endif
@@ -909,7 +995,8 @@ static void bluebasic_StateNotificationCB( gaprole_States_t newState )
     timeSlice = YIELD_TIMEOUT_MS_NORMAL;
     SEMAPHORE_CONN_SIGNAL();
     SEMAPHORE_READ_SIGNAL();
-    ble_init_ccc();
+    // The peripheral role has a single link, so nobody is left
+    ble_init_ccc(INVALID_CONNHANDLE);
 #ifdef PLUS_BROADCASTER
     {
       uint8 advertEnabled = TRUE;
@@ -997,6 +1084,62 @@ uint8 ble_console_write(uint8 ch)
   return 1;
 }
 
+//
+// Write a block to the console, copying as much as fits at a time rather than a byte at a time.
+//
+void ble_console_write_buffer(const uint8* buf, uint8 len)
+{
+  uint8 space;
+
+#ifdef DEBUG_SERIAL
+  for (space = 0; space < len; space++)
+  {
+    DEBUG_OUT(buf[space]);   //echo console output
+  }
+#endif
+  if (!ble_console_enabled)
+  {
+    return;
+  }
+  while (len)
+  {
+    // write buffer is full, so we run osal to get it empty
+    while (io.writein - io.writeout + 1 == 0 || io.writein - io.writeout + 1 == sizeof(io.write))
+    {
+      osal_run_system();
+    }
+
+    // write buffer empty, so we flag an event for the following block
+    if (io.writein == io.writeout)
+    {
+      osal_set_event( blueBasic_TaskID, BLUEBASIC_CONNECTION_EVENT );
+    }
+
+    // Free space up to the end of the ring, keeping one byte between in and out
+    if (io.writeout > io.writein)
+    {
+      space = io.writeout - io.writein - 1;
+    }
+    else
+    {
+      space = &io.write[sizeof(io.write)] - io.writein - (io.writeout == io.write);
+    }
+    if (space > len)
+    {
+      space = len;
+    }
+    len -= space;
+    for (; space; space--)
+    {
+      *io.writein++ = *buf++;
+    }
+    if (io.writein == &io.write[sizeof(io.write)])
+    {
+      io.writein = io.write;
+    }
+  }
+}
+
 #if ( HOST_CONFIG & OBSERVER_CFG )
 static uint8 blueBasic_deviceFound( gapObserverRoleEvent_t *pEvent )
 {
@@ -1013,6 +1156,10 @@ static uint8 blueBasic_deviceFound( gapObserverRoleEvent_t *pEvent )
                                 pEvent->deviceInfo.pEvtData);
       }
       break;
+
+    case GAP_DEVICE_DISCOVERY_EVENT:
+      interpreter_discoverycomplete();
+      break;
       
     default:
       break;
@@ -1075,10 +1222,19 @@ static bStatus_t consoleProfile_WriteAttrCB(uint16 connHandle, gattAttribute_t *
     // 128-bit UUID
     if (osal_memcmp(pAttr->type.uuid, outputUUID, ATT_UUID_SIZE))
     {
-      for (i = 0; i < len; i++)
+      // A program upload takes the input as binary frames, written to flash from the task
+      if (interpreter_load(pValue, len))
       {
-        OS_type(pValue[i]);
-      }  
+        SEMAPHORE_INPUT_WAIT();
+        osal_set_event(blueBasic_TaskID, BLUEBASIC_INPUT_AVAILABLE);
+      }
+      else
+      {
+        for (i = 0; i < len; i++)
+        {
+          OS_type(pValue[i]);
+        }
+      }
     }
     else
     {
@@ -1159,7 +1315,7 @@ HAL_ISR_FUNCTION(port1Isr, P1INT_VECTOR)
   HAL_EXIT_ISR();
 }
 
-#ifdef HAL_I2C    
+#if HAL_I2C    
 // port2Isr conflicts with the i2c interrupt handler from hal_i2c
 // so we simply modify it as a function call.
 // the hal_i2c isr function should call here to support port 2 interrupts
@@ -1170,7 +1326,7 @@ HAL_ISR_FUNCTION(port2Isr, P2INT_VECTOR)
 {
   unsigned char status;
 
-#ifndef HAL_I2C
+#if !HAL_I2C
   HAL_ENTER_ISR();
 #endif
   status = P2IFG;
@@ -1189,7 +1345,7 @@ HAL_ISR_FUNCTION(port2Isr, P2INT_VECTOR)
     }
 #endif    
   }
-#ifndef HAL_I2C
+#if !HAL_I2C
   HAL_EXIT_ISR();
 #endif
 }
@@ -80,6 +80,30 @@ extern void printnum(signed char fieldsize, VAR_TYPE num);
 //
 
 static void flashstore_invalidate(unsigned short* mem);
+static void flashstore_compactpage(unsigned char selected, unsigned short occupied, unsigned short available, unsigned char* tempmemstart, unsigned char* tempmemend);
+
+//
+// Label table:
+//  Program lines starting with @<name> are labels. Every use of a name is tokenized to the
+//  same id, so the table holds each id's name and the index entry of its label line. It is
+//  rebuilt in one pass whenever the line index changes, and jumps to a label go straight to
+//  the line. The first label that is defined twice or has no id is remembered, so the program
+//  can be refused before a jump goes astray.
+//
+static unsigned short** labels[FLASHSTORE_NRLABELS];
+static unsigned char* labelnames[FLASHSTORE_NRLABELS];
+static unsigned short labelpending; // Ids given to a line that hasn't been stored
+static unsigned short** badlabel;
+static unsigned char badlabelerror;
+
+static void flashstore_labels(void);
+
+#ifdef FEATURE_FILESTORE
+static void filestore_format(void);
+static unsigned char filestore_add(unsigned char* item);
+static unsigned char filestore_delete(unsigned long specialid);
+static unsigned char* filestore_find(unsigned long specialid);
+#endif
 
 //
 // Heapsort
@@ -204,6 +228,7 @@ unsigned char** flashstore_init(unsigned char** startmem)
 
   // We now have a set of program lines, indexed from "startmem" to "mem" which we need to sort
   flashpage_heapsort();
+  flashstore_labels();
   
   return (unsigned char**)lineindexend;
 }
@@ -255,6 +280,24 @@ static signed char flashstore_findspace(unsigned char len)
   return age == 0xFFFFFFFF ? -1 : spg;
 }
 
+//
+// Write a line to the flash store without updating the line index. A program is bulk loaded
+// this way, in line order, and the index is built once by flashstore_init() at the end.
+//
+unsigned char flashstore_appendline(unsigned char* line)
+{
+  unsigned char len = FLASHSTORE_PADDEDSIZE(line[sizeof(unsigned short)]);
+  signed char pg = flashstore_findspace(len);
+  if (pg == -1)
+  {
+    return 0;
+  }
+  unsigned short* mem = (unsigned short*)(FLASHSTORE_PAGEBASE(pg) + FLASHSTORE_PAGESIZE - orderedpages[pg].free);
+  OS_flashstore_write(FLASHSTORE_FADDR(mem), line, FLASHSTORE_WORDS(len));
+  orderedpages[pg].free -= len;
+  return 1;
+}
+
 //
 // Add a new line to the flash store, returning the total number of lines.
 //
@@ -307,6 +350,7 @@ unsigned char** flashstore_addline(unsigned char* line)
       }
       lineindexend++;
     }
+    flashstore_labels();
     return (unsigned char**)lineindexend;
   }
   else
@@ -318,6 +362,12 @@ unsigned char** flashstore_addline(unsigned char* line)
 
 unsigned char flashstore_addspecial(unsigned char* item)
 {
+#ifdef FEATURE_FILESTORE
+  if (FS_IS_FILE_SPECIAL(*(unsigned long*)(item + FLASHSPECIAL_ITEM_ID)))
+  {
+    return filestore_add(item);
+  }
+#endif
   *(unsigned short*)item = FLASHID_SPECIAL;
   unsigned char len = FLASHSTORE_PADDEDSIZE(item[sizeof(unsigned short)]);
   // Find space for the new line in the youngest page
@@ -343,6 +393,12 @@ unsigned char flashstore_addspecial(unsigned char* item)
 
 unsigned char flashstore_deletespecial(unsigned long specialid)
 {
+#ifdef FEATURE_FILESTORE
+  if (FS_IS_FILE_SPECIAL(specialid))
+  {
+    return filestore_delete(specialid);
+  }
+#endif
   unsigned char* ptr = flashstore_findspecial(specialid);
   if (ptr)
   {
@@ -356,10 +412,20 @@ unsigned char flashstore_deletespecial(unsigned long specialid)
   return 0;
 }
 
+//
+// Find a special. File records kept in the file store come back as a copy in RAM, which
+// the next find replaces, so callers use them before looking for another.
+//
 unsigned char* flashstore_findspecial(unsigned long specialid)
 {
   const unsigned char* page;
   unsigned char pnr = 0;
+#ifdef FEATURE_FILESTORE
+  if (FS_IS_FILE_SPECIAL(specialid))
+  {
+    return filestore_find(specialid);
+  }
+#endif
   for (page = flashstore; pnr < FLASHSTORE_NRPAGES; page += FLASHSTORE_PAGESIZE, pnr++)
   {
     const unsigned char* ptr;
@@ -402,6 +468,232 @@ unsigned char* flashstore_findspecial(unsigned long specialid)
   return NULL;
 }
 
+#ifdef FEATURE_FILESTORE
+//
+// File store structure:
+//  <magic:4><item>...<FLASHID_FREE:2>
+//  The items are file records in the flash item format. FRAM is written a byte at a time, so
+//  there are no pages, ages or compaction: a deleted record is marked invalid and becomes a
+//  hole, which a later record of the same size fills (or a smaller one, leaving a hole behind).
+//  Neighbouring holes are joined as they are passed, and holes at the end return to free space.
+//
+#define FILESTORE_MAGIC       0x53464242 // BBFS
+#define FILESTORE_FIRST       sizeof(unsigned long)
+#define FILESTORE_ITEMHDR     (sizeof(unsigned short) + sizeof(unsigned char))
+
+static struct
+{
+  unsigned long end;  // The FLASHID_FREE after the last item
+  unsigned long hole; // No holes before this
+  unsigned long last; // The last item found, where the next search starts
+  unsigned char item[255]; // What find returns
+} filestore;
+
+static void filestore_setid(unsigned long addr, unsigned short id)
+{
+  OS_filestore_write(addr, (unsigned char*)&id, sizeof(id));
+}
+
+static void filestore_sethole(unsigned long addr, unsigned char len)
+{
+  unsigned char hdr[FILESTORE_ITEMHDR];
+
+  *(unsigned short*)hdr = FLASHID_INVALID;
+  hdr[sizeof(unsigned short)] = len;
+  OS_filestore_write(addr, hdr, sizeof(hdr));
+}
+
+static void filestore_format(void)
+{
+  const unsigned long magic = FILESTORE_MAGIC;
+
+  filestore_setid(FILESTORE_FIRST, FLASHID_FREE);
+  OS_filestore_write(0, (const unsigned char*)&magic, sizeof(magic));
+  filestore.end = FILESTORE_FIRST;
+  filestore.hole = FILESTORE_FIRST;
+  filestore.last = FILESTORE_FIRST;
+}
+
+//
+// Find the end of the items and the first hole. A store we don't recognise is formatted.
+//  Called once when the interpreter powers up, since the store doesn't change under us.
+//
+void filestore_init(void)
+{
+  unsigned long addr;
+
+  OS_filestore_init();
+  OS_filestore_read(0, filestore.item, sizeof(unsigned long));
+  if (*(unsigned long*)filestore.item != FILESTORE_MAGIC)
+  {
+    filestore_format();
+    return;
+  }
+  filestore.hole = 0;
+  for (addr = FILESTORE_FIRST; ; addr += filestore.item[sizeof(unsigned short)])
+  {
+    OS_filestore_read(addr, filestore.item, FILESTORE_ITEMHDR);
+    const unsigned short id = *(unsigned short*)filestore.item;
+    if (id == FLASHID_FREE)
+    {
+      break;
+    }
+    if ((id != FLASHID_SPECIAL && id != FLASHID_INVALID) ||
+        filestore.item[sizeof(unsigned short)] < FILESTORE_ITEMHDR ||
+        addr + filestore.item[sizeof(unsigned short)] + sizeof(unsigned short) > FILESTORE_LEN)
+    {
+      // Corrupted
+      filestore_format();
+      return;
+    }
+    if (id == FLASHID_INVALID && !filestore.hole)
+    {
+      filestore.hole = addr;
+    }
+    KEEP_ALIVE();
+  }
+  filestore.end = addr;
+  filestore.last = FILESTORE_FIRST;
+  if (!filestore.hole)
+  {
+    filestore.hole = addr;
+  }
+}
+
+//
+// Find a record and copy it to RAM. The copy is good until the next call.
+//  The search starts at the last record found, so reading a file in order finds each
+//  record straight away.
+//
+static unsigned char* filestore_find(unsigned long specialid)
+{
+  unsigned long addr = filestore.last;
+  unsigned long stop = filestore.end;
+  unsigned char pass = 2;
+
+  for (;;)
+  {
+    if (addr >= stop)
+    {
+      if (!--pass)
+      {
+        return NULL;
+      }
+      stop = filestore.last;
+      addr = FILESTORE_FIRST;
+      continue;
+    }
+    OS_filestore_read(addr, filestore.item, FLASHSPECIAL_DATA_OFFSET);
+    if (*(unsigned short*)filestore.item == FLASHID_SPECIAL &&
+        *(unsigned long*)(filestore.item + FLASHSPECIAL_ITEM_ID) == specialid)
+    {
+      filestore.last = addr;
+      OS_filestore_read(addr, filestore.item, filestore.item[FLASHSPECIAL_DATA_LEN]);
+      return filestore.item;
+    }
+    addr += filestore.item[FLASHSPECIAL_DATA_LEN];
+  }
+}
+
+static unsigned char filestore_delete(unsigned long specialid)
+{
+  if (!filestore_find(specialid))
+  {
+    return 0;
+  }
+  const unsigned long addr = filestore.last;
+  if (addr + filestore.item[FLASHSPECIAL_DATA_LEN] == filestore.end)
+  {
+    filestore_setid(addr, FLASHID_FREE);
+    filestore.end = addr;
+  }
+  else
+  {
+    filestore_setid(addr, FLASHID_INVALID);
+  }
+  if (addr < filestore.hole)
+  {
+    filestore.hole = addr;
+  }
+  return 1;
+}
+
+//
+// Put the record in the first hole it fits, or after the last item.
+//
+static unsigned char filestore_add(unsigned char* item)
+{
+  const unsigned char len = item[FLASHSPECIAL_DATA_LEN];
+  unsigned long addr;
+  unsigned long hole = 0;
+
+  *(unsigned short*)item = FLASHID_SPECIAL;
+  for (addr = filestore.hole; addr < filestore.end; addr += filestore.item[sizeof(unsigned short)])
+  {
+    OS_filestore_read(addr, filestore.item, FILESTORE_ITEMHDR);
+    if (*(unsigned short*)filestore.item != FLASHID_INVALID)
+    {
+      continue;
+    }
+
+    // Join the holes which follow
+    unsigned char size = filestore.item[sizeof(unsigned short)];
+    unsigned long next;
+    for (next = addr + size; next < filestore.end; next += filestore.item[sizeof(unsigned short)])
+    {
+      OS_filestore_read(next, filestore.item, FILESTORE_ITEMHDR);
+      if (*(unsigned short*)filestore.item != FLASHID_INVALID ||
+          size + filestore.item[sizeof(unsigned short)] > 255)
+      {
+        break;
+      }
+      size += filestore.item[sizeof(unsigned short)];
+      filestore_sethole(addr, size);
+    }
+    if (filestore.last > addr && filestore.last < next)
+    {
+      filestore.last = addr;
+    }
+    if (next >= filestore.end)
+    {
+      // Holes at the end are free space
+      filestore_setid(addr, FLASHID_FREE);
+      filestore.end = addr;
+      break;
+    }
+
+    if (size == len || size >= len + FILESTORE_ITEMHDR)
+    {
+      if (size != len)
+      {
+        filestore_sethole(addr + len, size - len);
+      }
+      OS_filestore_write(addr + sizeof(unsigned short), item + sizeof(unsigned short), len - sizeof(unsigned short));
+      filestore_setid(addr, FLASHID_SPECIAL);
+      filestore.hole = (hole ? hole : addr);
+      return 1;
+    }
+    if (!hole)
+    {
+      hole = addr;
+    }
+    filestore.item[sizeof(unsigned short)] = size;
+    KEEP_ALIVE();
+  }
+  filestore.hole = (hole ? hole : filestore.end);
+
+  addr = filestore.end;
+  if (addr + len + sizeof(unsigned short) > FILESTORE_LEN)
+  {
+    return 0;
+  }
+  filestore_setid(addr + len, FLASHID_FREE);
+  OS_filestore_write(addr, item, len);
+  filestore.end = addr + len;
+  return 1;
+}
+#endif
+
 //
 // Remove the line from the flash store.
 //
@@ -419,6 +711,7 @@ unsigned char** flashstore_deleteline(unsigned short id)
       } else {
         OS_memcpy(oldlineptr, oldlineptr + 1, sizeof(unsigned short*) * (lineindexend - oldlineptr));
       }
+      flashstore_labels();
     }
   }
   return (unsigned char**)lineindexend;
@@ -448,9 +741,173 @@ unsigned char** flashstore_deleteall(void)
   }
 
   lineindexend = lineindexstart;
+  flashstore_labels();
+#ifdef FEATURE_FILESTORE
+  filestore_format();
+#endif
   return (unsigned char**)lineindexend;
 }
 
+//
+// Do two label names match?
+//
+static unsigned char flashstore_labelmatch(unsigned char* a, unsigned char* b)
+{
+  for (; *a == *b && FLASHSTORE_LABEL_CHAR(*a); a++, b++)
+    ;
+  return !FLASHSTORE_LABEL_CHAR(*a) && !FLASHSTORE_LABEL_CHAR(*b);
+}
+
+//
+// Note the first label error and its line.
+//
+static void flashstore_badlabel(unsigned char error, unsigned short** line)
+{
+  if (!badlabelerror)
+  {
+    badlabelerror = error;
+    badlabel = line;
+  }
+}
+
+//
+// Rebuild the label table from the label ids in the program lines.
+//
+static void flashstore_labels(void)
+{
+  unsigned short** line;
+
+  OS_memset(labels, 0, sizeof(labels));
+  OS_memset(labelnames, 0, sizeof(labelnames));
+  labelpending = 0;
+  badlabelerror = FLASHSTORE_LABELS_OK;
+  for (line = lineindexstart; line < lineindexend; line++)
+  {
+    unsigned char* start = (unsigned char*)*line + sizeof(unsigned short) + sizeof(unsigned char);
+    unsigned char* ptr;
+    for (ptr = start; *ptr != '\n'; ptr++)
+    {
+      const unsigned char c = *ptr;
+      if (c == FLASHSTORE_TOKEN_OPERAND)
+      {
+        ptr++;
+      }
+      else if (c == '"' || c == '\'')
+      {
+        while (ptr[1] != c && ptr[1] != '\n')
+        {
+          ptr++;
+        }
+        if (ptr[1] == c)
+        {
+          ptr++;
+        }
+      }
+      else if (c == FLASHSTORE_LABEL)
+      {
+        flashstore_badlabel(FLASHSTORE_LABELS_FULL, line);
+      }
+      else if (FLASHSTORE_IS_LABEL(c))
+      {
+        const unsigned char id = FLASHSTORE_LABEL_ID(c);
+        if (!labelnames[id])
+        {
+          labelnames[id] = ptr + 1;
+        }
+        else if (!flashstore_labelmatch(labelnames[id], ptr + 1))
+        {
+          // Two names with one id, from lines tokenized elsewhere
+          flashstore_badlabel(FLASHSTORE_LABELS_DUPLICATE, line);
+        }
+        if (ptr == start)
+        {
+          if (labels[id])
+          {
+            flashstore_badlabel(FLASHSTORE_LABELS_DUPLICATE, line);
+          }
+          else
+          {
+            labels[id] = line;
+          }
+        }
+      }
+    }
+  }
+}
+
+//
+// Give the label name, which follows the '@', its id. A new name takes the first free id
+// and keeps it until the line is stored or flashstore_labelsreset() is called.
+//  Returns FLASHSTORE_NRLABELS if every id is taken.
+//
+unsigned char flashstore_labelid(unsigned char* name)
+{
+  unsigned char id;
+  unsigned char free = FLASHSTORE_NRLABELS;
+  for (id = 0; id < FLASHSTORE_NRLABELS; id++)
+  {
+    if (!labelnames[id])
+    {
+      if (free == FLASHSTORE_NRLABELS)
+      {
+        free = id;
+      }
+    }
+    else if (flashstore_labelmatch(labelnames[id], name))
+    {
+      return id;
+    }
+  }
+  if (free < FLASHSTORE_NRLABELS)
+  {
+    labelnames[free] = name;
+    labelpending |= 1 << free;
+  }
+  return free;
+}
+
+//
+// Forget the ids given to a line that wasn't stored.
+//
+void flashstore_labelsreset(void)
+{
+  unsigned char id;
+  for (id = 0; labelpending; id++, labelpending >>= 1)
+  {
+    if (labelpending & 1)
+    {
+      labelnames[id] = 0;
+    }
+  }
+}
+
+//
+// Find the line with the given label id.
+//  Returns the end of the line index if the label isn't defined.
+//
+unsigned char** flashstore_labelline(unsigned char id)
+{
+  if (id < FLASHSTORE_NRLABELS && labels[id])
+  {
+    return (unsigned char**)labels[id];
+  }
+  return (unsigned char**)lineindexend;
+}
+
+//
+// Are all labels usable? If not, line is set to the first label line that is defined
+// twice or didn't get an id.
+//  Returns FLASHSTORE_LABELS_OK, FLASHSTORE_LABELS_DUPLICATE or FLASHSTORE_LABELS_FULL.
+//
+unsigned char flashstore_labelerror(unsigned char*** line)
+{
+  if (badlabelerror && line)
+  {
+    *line = (unsigned char**)badlabel;
+  }
+  return badlabelerror;
+}
+
 //
 // How much space is free?
 //
@@ -469,12 +926,25 @@ unsigned int flashstore_freemem(void)
   return free;
 }
 
-void flashstore_compact(unsigned char len, unsigned char* tempmemstart, unsigned char* tempmemend)
+//
+// How much temporary memory is available for compacting a page.
+//
+static unsigned short flashstore_tempmem(unsigned char* tempmemstart, unsigned char* tempmemend)
 {
   unsigned short available =
     ( (tempmemend - tempmemstart)  // free heap
      + ((unsigned char*)lineindexend - (unsigned char*)lineindexstart) ); // optional index
   //  & (unsigned short)(FLASHSTORE_PAGESIZE - 1);  // limit to page size
+  if (available > FLASHSTORE_PAGESIZE)
+  {
+    available = FLASHSTORE_PAGESIZE;
+  }
+  return available;
+}
+
+void flashstore_compact(unsigned char len, unsigned char* tempmemstart, unsigned char* tempmemend)
+{
+  unsigned short available = flashstore_tempmem(tempmemstart, tempmemend);
   // Find the lowest age page which this will fit in.
   static unsigned char pg;
   static unsigned char selected;
@@ -483,10 +953,6 @@ void flashstore_compact(unsigned char len, unsigned char* tempmemstart, unsigned
   age = 0xFFFFFFFF;
   selected = 0;
   len = FLASHSTORE_PADDEDSIZE(len);
-  if (available > FLASHSTORE_PAGESIZE)
-  {
-    available = FLASHSTORE_PAGESIZE;
-  }
   for (pg = 0; pg < FLASHSTORE_NRPAGES; pg++)
   {
     flashpage_age cage = *(flashpage_age*)FLASHSTORE_PAGEBASE(pg);
@@ -503,7 +969,33 @@ void flashstore_compact(unsigned char len, unsigned char* tempmemstart, unsigned
   // Need at least FLASHSTORE_PAGESIZE
   if ( (occupied > available) || (age == 0xFFFFFFFF) )
     return;
-    
+
+  flashstore_compactpage(selected, occupied, available, tempmemstart, tempmemend);
+}
+
+//
+// Compact every page holding invalidated items.
+//
+void flashstore_compactall(unsigned char* tempmemstart, unsigned char* tempmemend)
+{
+  unsigned short available = flashstore_tempmem(tempmemstart, tempmemend);
+  static unsigned char pg;
+  for (pg = 0; pg < FLASHSTORE_NRPAGES; pg++)
+  {
+    unsigned short occupied = FLASHSTORE_PAGESIZE - orderedpages[pg].free - orderedpages[pg].waste;
+    if (orderedpages[pg].waste && occupied <= available)
+    {
+      flashstore_compactpage(pg, occupied, available, tempmemstart, tempmemend);
+    }
+    KEEP_ALIVE();
+  }
+}
+
+//
+// Compact the selected page, using the temporary memory to hold the items which are kept.
+//
+static void flashstore_compactpage(unsigned char selected, unsigned short occupied, unsigned short available, unsigned char* tempmemstart, unsigned char* tempmemend)
+{
   // close access to the flash store
   static halIntState_t intState;
   HAL_ENTER_CRITICAL_SECTION(intState);
@@ -584,6 +1076,9 @@ void flashstore_compact(unsigned char len, unsigned char* tempmemstart, unsigned
     // We corrupted memory, so we need to reinitialize
     flashstore_init((unsigned char**)lineindexstart);
   }
+  // Anything pointing into the page must follow it
+  flashstore_labels();
+  interpreter_flashmoved();
 exit:
   HAL_EXIT_CRITICAL_SECTION(intState); 
 }
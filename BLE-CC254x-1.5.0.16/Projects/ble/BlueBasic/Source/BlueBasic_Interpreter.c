@@ -78,6 +78,9 @@ enum
   ERROR_BADPIN,
   ERROR_DIRECT,
   ERROR_EOF,
+  ERROR_CRC,
+  ERROR_LABELTWICE,
+  ERROR_LABELS,
 };
 
 #if ENABLE_BLE_CONSOLE
@@ -92,6 +95,9 @@ static const char* const error_msgs[] =
   "Bad pin",
   "Not in direct",
   "End of file",
+  "Bad CRC",
+  "Duplicate label",
+  "Too many labels",
 };
 #endif
 
@@ -148,7 +154,7 @@ enum
   // Keywords
   //
 
-  KW_CONSTANT = 0x80,
+  KW_CONSTANT = FLASHSTORE_TOKEN_OPERAND,
   KW_LIST,
   KW_MEM,
   KW_NEW,
@@ -194,12 +200,12 @@ enum
   // Keyword spacers - to add main keywords later without messing up the numbering below
   //
 
-  KW_SPACE0, // 169
-  KW_SPACE1,
-  KW_SPACE2,
-  KW_SPACE3,
-  KW_SPACE4,
-  KW_SPACE5,
+  KW_FILL,   // 169
+  KW_COPY,
+  KW_PACK,
+  BLE_FILTER,
+  KW_LOAD,
+  KW_VEDIRECT,
   KW_SPACE6,
   KW_SPACE7, // 176
 
@@ -227,10 +233,10 @@ enum
   OP_RSHIFT,
   OP_UMINUS,
   
-  OP_SPACE0,
-  OP_SPACE1,
-  OP_SPACE2,
-  OP_SPACE3,
+  FUNC_CRC,  // take the operator spacers
+  FUNC_FIND,
+  FUNC_VAL,
+  FUNC_STR,
   
   // -----------------------
   // Functions
@@ -251,8 +257,8 @@ enum
   FUNC_TEMP,
 //  FUNC_SPACE0,
 //  FUNC_SPACE1,
-  FUNC_SPACE2,
-  FUNC_SPACE3,
+  FUNC_SUM,
+  FUNC_CMP,
   
   // -----------------------
 
@@ -341,6 +347,19 @@ enum
   CO_AVDD,
   CO_DEFAULT_PASSCODE,
   CO_BONDING_ENABLED,
+  CO_WORD,
+  CO_SPACE0, // 0x20 is WS_SPACE which the tokenizer would swallow
+  CO_LONG,
+  CO_RSSI,
+  CO_ADTYPE,
+  CO_ADDRESS,
+  CO_BATCH,
+  CO_STREAM,
+  CO_CHANGED,
+  CO_EVERY,
+  CO_EVENT,
+  CO_UPDATE,
+  CO_ROTATE,
 };
 
 // Constant map (so far all constants are <= 16 bits)
@@ -376,6 +395,19 @@ static const unsigned short constantmap[] =
   CO_AVDD,
   BLE_DEFAULT_PASSCODE,
   BLE_BONDING_ENABLED,
+  CO_WORD,
+  0,
+  CO_LONG,
+  CO_RSSI,
+  CO_ADTYPE,
+  CO_ADDRESS,
+  CO_BATCH,
+  CO_STREAM,
+  CO_CHANGED,
+  CO_EVERY,
+  CO_EVENT,
+  CO_UPDATE,
+  CO_ROTATE,
 };
 
 //
@@ -491,13 +523,26 @@ typedef struct
   // .... bytes ...
 } variable_frame;
 
+// A DIM view carries no bytes of its own but looks into another array
 typedef struct
+{
+  unsigned char* data;
+  unsigned short size;
+} dim_view;
+
+typedef struct service_frame
 {
   frame_header header;
   gattAttribute_t* attrs;
   LINENUM connect;
+  unsigned char* cache; // Flash copy of the UUIDs and descriptions in use, or NULL
+  LINENUM line; // of the GATT SERVICE, which identifies the copy
+  struct service_frame* next;
 } service_frame;
 
+// The registered services, in the order they were built, so we needn't search the heap
+static service_frame* ble_services;
+
 // Frame types
 enum
 {
@@ -505,7 +550,9 @@ enum
   FRAME_FOR_FLAG,
   FRAME_VARIABLE_FLAG,
   FRAME_EVENT_FLAG,
-  FRAME_SERVICE_FLAG
+  FRAME_SERVICE_FLAG,
+  FRAME_SAMPLING_FLAG,
+  FRAME_SCAN_FLAG
 };
 
 // Stack clean up return types
@@ -523,8 +570,14 @@ enum
 enum
 {
   VAR_INT = 1,
-  VAR_DIM_BYTE
+  VAR_DIM_BYTE,
+  VAR_DIM_WORD,
+  VAR_DIM_LONG
 };
+// Variable type modifiers (DIMs only)
+#define VAR_DIM_TYPE_MASK 0x0F
+#define VAR_DIM_MSB       0x10 // Elements are stored most significant byte first
+#define VAR_DIM_VIEW      0x20 // Elements live in another array (see dim_view)
 
 static __data unsigned char** lineptr;
 static __data unsigned char* txtpos;
@@ -537,6 +590,15 @@ __data unsigned char* heap; // Access in flashstore
 
 #if ENABLE_BLE_CONSOLE
 static unsigned char* list_line;
+static struct
+{
+  unsigned char active;
+  unsigned char end; // Set to finish the upload with 'error'
+  unsigned char error;
+  unsigned short got;
+  unsigned short size;
+  LINENUM last; // Line number last written, so lines can only ascend
+} load;
 #endif
 static unsigned char** program_start;
 static LINENUM linenum;
@@ -553,6 +615,13 @@ unsigned short timeSlice = 20;
 #define VARIABLE_INT_GET(F)     (*VARIABLE_INT_ADDR(F))
 #define VARIABLE_INT_SET(F,V)   (*VARIABLE_INT_ADDR(F) = (V))
 
+#define VARIABLE_IS_DIM(F)      ((F)->type != VAR_INT)
+#define VARIABLE_DIM_SHIFT(F)   (((F)->type & VAR_DIM_TYPE_MASK) - VAR_DIM_BYTE)
+#define VARIABLE_DIM_WIDTH(F)   (1 << VARIABLE_DIM_SHIFT(F))
+#define VARIABLE_DIM_DATA(F)    ((F)->type & VAR_DIM_VIEW ? ((dim_view*)((F) + 1))->data : (unsigned char*)((F) + 1))
+#define VARIABLE_DIM_SIZE(F)    ((F)->type & VAR_DIM_VIEW ? ((dim_view*)((F) + 1))->size : (F)->header.frame_size - sizeof(variable_frame))
+#define VARIABLE_DIM_COUNT(F)   (VARIABLE_DIM_SIZE(F) >> VARIABLE_DIM_SHIFT(F))
+
 #define VARIABLE_IS_EXTENDED(F)  (vname = (F) - 'A', (*(variables_begin + VAR_COUNT * VAR_SIZE + (vname >> 3)) & (1 << (vname & 7))))
 #define VARIABLE_SAVE(V) \
   do { \
@@ -617,12 +686,65 @@ static unsigned char PERCFG;
 #if !defined(ENABLE_SPI) || ENABLE_SPI
 static unsigned char spiChannel;
 static unsigned char spiWordsize;
+#if OS_SPI_DMA
+static struct
+{
+  unsigned short line;  // GOSUB when the transfer completes, or 0
+  unsigned short done;  // GOSUB of a completed transfer waiting to run, or 0
+  unsigned char pin;    // The chip select to release
+} spiDma;
+static unsigned char dim_is_scoped(unsigned char* ptr);
+#endif
 #endif
 static unsigned char analogReference;
+#if OS_ADC_SCAN
+static struct
+{
+  unsigned char map;
+  unsigned char channels; // In the sequence, AIN0 to the highest in the map
+  unsigned char decimate; // Samples per channel in a block
+  short* buffer;          // Two blocks, or NULL when not scanning
+  struct
+  {
+    short mean;
+    short min;
+    short max;
+    short rms;
+  } snapshot[8];
+} adcScan;
+// The heap frame holding the blocks, kept for reuse when ANALOG SCAN runs again
+static frame_header* adcScanFrame;
+static void adc_scan_stop(void);
+#endif
+#ifdef FEATURE_SAMPLING
+// The heap frame holding the sampling windows, kept for reuse when ANALOG TIMER runs again
+static frame_header* samplingFrame;
+static void sampling_reset(void);
+
+static struct
+{
+  unsigned char vchannel;
+  unsigned char ichannel;
+  unsigned char window;   // Samples per window
+  unsigned char count;
+  unsigned short vscale;  // mV and mA at the ADC's full scale
+  unsigned short iscale;
+  int32 vsum;
+  int32 isum;
+  int32 psum;
+  int32 mv;               // Means of the last window
+  int32 ma;
+  int32 mw;
+  uint32 mwh[2];          // Energy and charge, in and out
+  uint32 mah[2];
+  uint32 frac[4];         // What is left over of each, in mW ms or mA ms
+} power;
+#endif
 static unsigned char analogResolution = 0x30; // 14-bits
 #if HAL_I2C_SLAVE
 static unsigned char i2cScl;
 static unsigned char i2cSda;
+static unsigned char i2cHardware; // Master on the i2c hardware rather than the pins
 #endif
 
 static VAR_TYPE pin_read(unsigned char major, unsigned char minor);
@@ -631,9 +753,51 @@ static unsigned char pin_parse(void);
 static void pin_wire(unsigned char* start, unsigned char* end);
 #if !defined(ENABLE_WIRE) || ENABLE_WIRE
 static void pin_wire_parse(void);
+static unsigned char pin_wire_cached(void);
+static void pin_wire_cache(void);
+static VAR_TYPE pin_wire_expression(void);
+static unsigned char* pin_wire_address(variable_frame** vframe);
+static void pin_wire_variable(unsigned char name, variable_frame* vframe);
+static unsigned char pin_parse_literal(void);
 static unsigned char pinParseCurrent;
 static unsigned char* pinParsePtr;
 static unsigned char* pinParseReadAddr;
+
+//
+// Compiled WIRE cache. A WIRE ... END statement whose operands are all literals is kept once
+// parsed, so later runs go straight to pin_wire(). The arrays it stores into are checked
+// to still be the same ones before the cached operations are used.
+//
+#define WIRE_CACHE_ENTRIES  4
+#define WIRE_CACHE_SIZE     64
+#define WIRE_CACHE_VARS     2
+
+typedef struct
+{
+  LINENUM line;         // 0 if unused
+  unsigned char offset; // of the statement in the line
+  unsigned char end;    // offset to continue at, after the END
+  unsigned char start;  // of the operations in wire_cache.ops
+  unsigned char len;
+  struct
+  {
+    unsigned char name;
+    variable_frame* frame;
+    unsigned short size;
+  } vars[WIRE_CACHE_VARS];
+} wire_cache_entry;
+
+static struct
+{
+  wire_cache_entry entry[WIRE_CACHE_ENTRIES];
+  unsigned char used;
+  unsigned char ops[WIRE_CACHE_SIZE];
+} wire_cache;
+
+static wire_cache_entry* pinParseEntry; // Where the parse is cached, or NULL
+static unsigned char pinParseVars;
+unsigned char wire_timer = OS_MAX_TIMER;
+LINENUM wire_timer_line;
 #endif
 
 static VAR_TYPE expression(unsigned char mode);
@@ -644,6 +808,40 @@ unsigned char  ble_adbuf[31];
 unsigned char* ble_adptr;
 unsigned char  ble_isadvert;
 
+//
+// Advertising and scan response fields bound to variables. These are refreshed in place
+// by ADVERT UPDATE, or natively by its timer, rather than rebuilding the whole payload.
+//
+#define BLE_ADFIELD_SCANRSP 0x80
+#define BLE_ADFIELDS        4
+static struct
+{
+  unsigned char var;
+  unsigned char offset; // | BLE_ADFIELD_SCANRSP for the scan response
+  unsigned char width;
+} ble_adfields[BLE_ADFIELDS];
+static unsigned char ble_adlen[2]; // Advert and scan response lengths
+unsigned char ble_adtimer = OS_MAX_TIMER;
+
+//
+// Advertising rotation. Prebuilt advert and scan response payloads, held in arrays, are
+// put on air in turn for their dwell times by a native timer.
+//
+#define BLE_ADROTATE  4
+static struct
+{
+  struct
+  {
+    unsigned char advert;   // Array names
+    unsigned char scanrsp;  // or 0
+    unsigned short dwell;   // ms
+  } entry[BLE_ADROTATE];
+  unsigned char count;
+  unsigned char next;
+  unsigned char turns;      // Array counting the turns each entry had on air, or 0
+} ble_adrotate;
+unsigned char ble_adrotate_timer = OS_MAX_TIMER;
+
 typedef struct gatt_variable_ref
 {
   unsigned char var;
@@ -651,16 +849,64 @@ typedef struct gatt_variable_ref
   gattCharCfg_t* cfg;
   LINENUM read;
   LINENUM write;
+  unsigned char policy;
+  unsigned char dirty;
+  unsigned char unsent; // Nothing notified yet, so sent is not valid
+  unsigned short interval;
+  unsigned short last;
+  VAR_TYPE sent; // Value, or CRC-32 of an array, last notified
 } gatt_variable_ref;
 
+// When assignments are notified
+enum
+{
+  NOTIFY_IMMEDIATE = 0,
+  NOTIFY_CHANGED,   // Only when the value differs from the last one sent
+  NOTIFY_EVERY,     // The latest value, at most once per interval
+  NOTIFY_EVENT      // The latest value, at the end of a connection event
+};
+
+// Number of coalesced notifications waiting to be sent
+static unsigned char ble_dirty;
+
 #define INVALID_CONNHANDLE 0xFFFF
 
 static short find_quoted_string(void);
 static char ble_build_service(void);
+static unsigned long ble_service_hash(unsigned char* entries, unsigned short* bytes);
+static void ble_cache_service(gattAttribute_t* attributes, short count, unsigned long hash, unsigned char entries, unsigned short bytes);
+static unsigned char* ble_cache_next(unsigned char* cached, unsigned char* end);
+static void ble_forget_service(LINENUM id);
+
+// Layout of the flash special caching a service: the key of its lines, the number
+// and total length of the cached entries, then the entries themselves.
+#define GATTCACHE_HASH      FLASHSPECIAL_DATA_OFFSET
+#define GATTCACHE_ENTRIES   (GATTCACHE_HASH + sizeof(unsigned long))
+#define GATTCACHE_BYTES     (GATTCACHE_ENTRIES + 1)
+#define GATTCACHE_DATA      (GATTCACHE_BYTES + 1)
 static char ble_get_uuid(void);
 static unsigned char ble_read_callback(unsigned short handle, gattAttribute_t* attr, unsigned char* value, unsigned char* len, unsigned short offset, unsigned char maxlen, uint8 method);
 static unsigned char ble_write_callback(unsigned short handle, gattAttribute_t* attr, unsigned char* value, unsigned char len, unsigned short offset, uint8 method);
 static void ble_notify_assign(gatt_variable_ref* vref);
+static unsigned char ble_stream_start(void);
+static void ble_stream_stop(void);
+static void ble_notify_pace(void);
+
+//
+// Notification stream. A GATT array is sent as a sequence of MTU sized notifications,
+// paced by the connection events, after which the completion handler is run from the task.
+//
+static struct
+{
+  gatt_variable_ref* vref;
+  unsigned short handle;
+  unsigned short offset;
+  unsigned short end;
+  unsigned char chunk;
+  unsigned char sent; // Connections (by CCC index) which have the current chunk
+  LINENUM complete;
+  LINENUM done; // GOSUB of a finished stream waiting to run, or 0
+} ble_stream;
 
 #ifdef TARGET_CC254X
 
@@ -685,6 +931,55 @@ static unsigned short servicecount;
 static unsigned char ble_uuid[16];
 static unsigned char ble_uuid_len;
 
+#if ( HOST_CONFIG & OBSERVER_CFG )
+//
+// Scan filter, checked for each advertising report before the ONDISCOVER handler is run.
+//
+#define SCAN_FILTER_ADDRESSES   4
+#define SCAN_FILTER_SEEN        8
+
+#define SCAN_FILTER_RSSI        0x01
+#define SCAN_FILTER_ADTYPE      0x02
+#define SCAN_FILTER_ADVALUE     0x04
+
+static struct
+{
+  unsigned char flags;
+  signed char rssi;
+  unsigned char adtype;
+  unsigned short advalue;
+  unsigned char nraddresses;
+  unsigned char addresses[SCAN_FILTER_ADDRESSES][B_ADDR_LEN];
+  unsigned short window;
+  unsigned char nrseen;
+  struct
+  {
+    unsigned char address[B_ADDR_LEN];
+    unsigned short time;
+  } seen[SCAN_FILTER_SEEN]; // Most recently seen first
+} scan_filter;
+
+static unsigned char scan_filter_set(void);
+static unsigned char scan_filter_match(unsigned char* address, signed char rssi, unsigned char len, unsigned char* data);
+
+//
+// Batched scanning. Reports are collected in a byte array as fixed size entries:
+//  <address:6><rssi:1><addrtype:1><eventtype:1><datalen:1><data, truncated>
+// and the ONDISCOVER handler runs once, with N entries, when the array is full or the scan ends.
+//
+#define SCAN_BATCH_HEADER       10
+#define SCAN_BATCH_ENTRY        16
+
+static struct
+{
+  unsigned char name;
+  unsigned char size;
+  unsigned short count;
+} scan_batch;
+
+static unsigned char scan_batch_set(void);
+#endif
+
 static const gattServiceCBs_t ble_service_callbacks =
 {
   ble_read_callback,
@@ -743,6 +1038,7 @@ static void tokenize(void)
   
   writepos = txtpos;
   scanpos = txtpos;
+  flashstore_labelsreset();
   for (;;)
   {
     readpos = scanpos;
@@ -772,6 +1068,26 @@ static void tokenize(void)
         scanpos = readpos;
         break;
       }
+      else if (c == FLASHSTORE_LABEL)
+      {
+        // Copy labels as they are so keywords inside the names aren't tokenized,
+        // then swap the '@' for the label's id
+        unsigned char* label = writepos;
+        do
+        {
+          *writepos++ = c;
+          c = *++readpos;
+        } while (FLASHSTORE_LABEL_CHAR(c));
+        // End the copied name so it can be matched (this is behind readpos, or is c already)
+        *writepos = c;
+        c = flashstore_labelid(label + 1);
+        if (c < FLASHSTORE_NRLABELS)
+        {
+          *label = FLASHSTORE_LABEL_TOKEN(c);
+        }
+        scanpos = readpos;
+        break;
+      }
       else if (c == NL)
       {
         *writepos = NL;
@@ -941,11 +1257,12 @@ static unsigned char print_quoted_string(void)
   else
   {
     // Print the characters
-    for (; i; i--)
+    for (; i > 255; i -= 255, txtpos += 255)
     {
-      OS_putchar(*txtpos++);
+      OS_putbuffer((const char*)txtpos, 255);
     }
-    txtpos++;
+    OS_putbuffer((const char*)txtpos, i);
+    txtpos += i + 1;
 
     return 1;
   }
@@ -960,10 +1277,11 @@ static unsigned char print_quoted_string(void)
 #else
 void printmsg(const char *msg)
 {
-  while (*msg != 0)
-  {
-    OS_putchar(*msg++);
-  }
+  unsigned char len;
+
+  for (len = 0; msg[len] != 0; len++)
+    ;
+  OS_putbuffer(msg, len);
   OS_putchar(NL);
 }
 #endif
@@ -976,6 +1294,183 @@ static unsigned char** findlineptr(void)
   return (unsigned char**)flashstore_findclosest(linenum);
 }
 
+//
+// Skip over a label name.
+//
+static void skip_label(void)
+{
+  while (FLASHSTORE_LABEL_CHAR(*txtpos))
+  {
+    txtpos++;
+  }
+}
+
+//
+// Parse a jump target, either @<label> or a line number expression, and return the pointer
+// to its line. A label goes straight to its line by its id.
+//
+static unsigned char** parse_lineptr(void)
+{
+  unsigned char** line;
+
+  if (!FLASHSTORE_IS_LABEL(*txtpos))
+  {
+    linenum = expression(EXPR_NORMAL);
+    return findlineptr();
+  }
+  line = flashstore_labelline(FLASHSTORE_LABEL_ID(*txtpos++));
+  if (line >= program_end)
+  {
+    error_num = ERROR_EXPRESSION;
+  }
+  skip_label();
+  return line;
+}
+
+#if ENABLE_BLE_CONSOLE
+//
+// Check that every label can be found. If not, line points at the offending line.
+//
+static unsigned char label_error(unsigned char*** line)
+{
+  switch (flashstore_labelerror(line))
+  {
+    case FLASHSTORE_LABELS_DUPLICATE:
+      return ERROR_LABELTWICE;
+    case FLASHSTORE_LABELS_FULL:
+      return ERROR_LABELS;
+    default:
+      return ERROR_OK;
+  }
+}
+#endif
+
+#if ENABLE_BLE_CONSOLE
+//
+// Rewrite one program line for PACK, giving it its new number and renumbering the
+// targets of GOTO and GOSUB. The original line numbers are in ids. Unless write is set
+// the line is only built in buf, to check it before anything is changed.
+//  Returns 0 if the line didn't fit or a target has no valid line number.
+//
+static unsigned char pack_line(LINENUM* ids, unsigned short count, unsigned short idx, LINENUM start, LINENUM step, unsigned char* buf, unsigned char write)
+{
+  unsigned char* src = *(unsigned char**)flashstore_findclosest(ids[idx]) + sizeof(LINENUM) + sizeof(char);
+  unsigned char* dst = buf + sizeof(LINENUM) + sizeof(char);
+  unsigned char* end = buf + 255;
+  const unsigned char renumber = (start && *src != KW_REM && *src != KW_SLASHSLASH);
+  const LINENUM id = (start ? start + idx * step : ids[idx]);
+  unsigned char** newend;
+  unsigned char c;
+
+  do
+  {
+    c = *src++;
+    if (dst == end)
+    {
+      return 0;
+    }
+    *dst++ = c;
+    if (c == SQUOTE || c == DQUOTE)
+    {
+      const unsigned char delim = c;
+      do
+      {
+        if (dst == end)
+        {
+          return 0;
+        }
+        *dst++ = c = *src++;
+      } while (c != delim && c != NL);
+    }
+    else if (c == KW_CONSTANT)
+    {
+      *dst++ = *src++;
+    }
+    else if (renumber && (c == KW_GOTO || c == KW_GOSUB))
+    {
+      if (*src == WS_SPACE)
+      {
+        *dst++ = *src++;
+      }
+      if (*src >= '0' && *src <= '9')
+      {
+        // Map the target onto the line it finds, numbered afresh
+        unsigned char digits[5];
+        unsigned char nr = 0;
+        unsigned short k = 0;
+        unsigned short max = count;
+        unsigned long target = 0;
+        while (*src >= '0' && *src <= '9')
+        {
+          target = target * 10 + *src++ - '0';
+        }
+        while (k < max)
+        {
+          unsigned short mid = k + (max - k) / 2;
+          if (ids[mid] < target)
+          {
+            k = mid + 1;
+          }
+          else
+          {
+            max = mid;
+          }
+        }
+        target = start + (unsigned long)k * step;
+        if (target >= FLASHID_SPECIAL)
+        {
+          return 0;
+        }
+        do
+        {
+          digits[nr++] = '0' + target % 10;
+          target /= 10;
+        } while (target);
+        if (end - dst < nr)
+        {
+          return 0;
+        }
+        while (nr)
+        {
+          *dst++ = digits[--nr];
+        }
+      }
+    }
+  } while (c != NL);
+
+  *(LINENUM*)buf = id;
+  buf[sizeof(LINENUM)] = dst - buf;
+  if (!write)
+  {
+    return 1;
+  }
+
+  if (id != ids[idx])
+  {
+    ble_forget_service(ids[idx]);
+  }
+  SEMAPHORE_FLASH_WAIT();
+  newend = flashstore_addline(buf);
+  if (!newend)
+  {
+    flashstore_compact(buf[sizeof(LINENUM)], heap + sizeof(unsigned char*), buf);
+    newend = flashstore_addline(buf);
+  }
+  if (newend && id != ids[idx])
+  {
+    newend = flashstore_deleteline(ids[idx]);
+  }
+  SEMAPHORE_FLASH_SIGNAL();
+  if (!newend)
+  {
+    return 0;
+  }
+  program_end = newend;
+  heap = (unsigned char*)program_end;
+  return 1;
+}
+#endif
+
 #if !ENABLE_BLE_CONSOLE
 #define printline(a,b)
 #else
@@ -1000,7 +1495,11 @@ static void printline(unsigned char nindent, unsigned char indent)
   }
   for (unsigned char c = *list_line++; c != NL; c = *list_line++)
   {
-    if (c < 0x80)
+    if (FLASHSTORE_IS_LABEL(c))
+    {
+      OS_putchar(FLASHSTORE_LABEL);
+    }
+    else if (c < 0x80)
     {
       OS_putchar(c);
     }
@@ -1039,10 +1538,10 @@ static void printline(unsigned char nindent, unsigned char indent)
             {
               OS_putchar(WS_SPACE);
             }
-            for (c = *begin++; c < 0x80; c = *begin++)
-            {
-              OS_putchar(c);
-            }
+            for (ptr = begin; *ptr < 0x80; ptr++)
+              ;
+            OS_putbuffer((const char*)begin, ptr - begin);
+            begin = ptr + 1;
             if (*list_line != '(' && *list_line != ',' && begin[-1] != FUNC_HEX)
             {
               OS_putchar(WS_SPACE);
@@ -1116,9 +1615,9 @@ static unsigned char* get_variable_frame(char name, variable_frame** frame)
 
   if (VARIABLE_IS_EXTENDED(name))
   {
-    unsigned char* ptr = *(unsigned char**)VARIABLE_INT_ADDR(name);
-    *frame = (variable_frame*)ptr;
-    return ptr + sizeof(variable_frame);
+    variable_frame* f = *(variable_frame**)VARIABLE_INT_ADDR(name);
+    *frame = f;
+    return VARIABLE_DIM_DATA(f);
   }
   else
   {
@@ -1127,6 +1626,35 @@ static unsigned char* get_variable_frame(char name, variable_frame** frame)
   }
 }
 
+#if ENABLE_BLE_CONSOLE
+//
+// Print a byte array as text, up to the first zero.
+//  Returns 0 if the variable is not a byte array.
+//
+static unsigned char print_array_string(unsigned char name)
+{
+  variable_frame* frame;
+  unsigned char* ptr = get_variable_frame(name, &frame);
+  unsigned short len;
+
+  if (!VARIABLE_IS_DIM(frame) || VARIABLE_DIM_WIDTH(frame) != 1)
+  {
+    return 0;
+  }
+  unsigned char* end = ptr;
+  for (len = VARIABLE_DIM_SIZE(frame); len && *end; len--)
+  {
+    end++;
+  }
+  for (; end - ptr > 255; ptr += 255)
+  {
+    OS_putbuffer((const char*)ptr, 255);
+  }
+  OS_putbuffer((const char*)ptr, end - ptr);
+  return 1;
+}
+#endif
+
 //
 // Parse the variable name and return a pointer to its memory and its size.
 //
@@ -1142,7 +1670,7 @@ static unsigned char* parse_variable_address(variable_frame** vframe)
   }
   txtpos++;
   unsigned char* ptr = get_variable_frame(name, vframe);
-  if ((*vframe)->type == VAR_DIM_BYTE)
+  if (VARIABLE_IS_DIM(*vframe))
   {
     VAR_TYPE index;   
 #if defined(FEATURE_LAZY_INDEX) && FEATURE_LAZY_INDEX
@@ -1158,88 +1686,389 @@ static unsigned char* parse_variable_address(variable_frame** vframe)
     {
       index = expression(EXPR_BRACES);
     }
-    if (error_num || index < 0 || index >= (*vframe)->header.frame_size - sizeof(variable_frame))
+    if (error_num || index < 0 || index >= VARIABLE_DIM_COUNT(*vframe))
     {
 #if defined(FEATURE_LAZY_INDEX) && FEATURE_LAZY_INDEX
       txtpos = otxtpos;
 #endif
       return NULL;
     }      
-    ptr += index;
+    ptr += index << VARIABLE_DIM_SHIFT(*vframe);
   }
   return ptr;
 }
 
 //
-// Create an array
+// Parse an array name with an optional index and return the address of that element,
+// or the start of the array when there is no index. Returns NULL if it's not an array.
 //
-static void create_dim(unsigned char name, VAR_TYPE size, unsigned char* data)
+static unsigned char* parse_array_address(variable_frame** vframe)
 {
-  variable_frame* f;
-  CHECK_SP_OOM(sizeof(variable_frame) + size, qoom);
-  f = (variable_frame*)sp;
-  f->header.frame_type = FRAME_VARIABLE_FLAG;
-  f->header.frame_size = sizeof(variable_frame) + size;
-  f->type = VAR_DIM_BYTE;
-  f->name = name;
-  f->ble = NULL;
-  VARIABLE_SAVE(f);
-  if (data)
+  ignore_blanks();
+
+  const unsigned char name = *txtpos;
+
+  if (name < 'A' || name > 'Z')
   {
-    OS_memcpy(sp + sizeof(variable_frame), data, size);
+    return NULL;
   }
-  else
+  if (txtpos[1] == '(' || (txtpos[1] >= '0' && txtpos[1] <= '9'))
   {
-    OS_memset(sp + sizeof(variable_frame), 0, size);
+    unsigned char* ptr = parse_variable_address(vframe);
+    return ptr && VARIABLE_IS_DIM(*vframe) ? ptr : NULL;
   }
-  return;
-qoom:
-  error_num = ERROR_OOM;
-  return;
+  txtpos++;
+  unsigned char* ptr = get_variable_frame(name, vframe);
+  return VARIABLE_IS_DIM(*vframe) ? ptr : NULL;
 }
 
 //
-// Clean the heap and stack
+// Load an array element. Words and longs are assembled a byte at a time in the
+// array's byte order, so they need no alignment and views can sit at any offset.
 //
-static void clean_memory(void)
+static VAR_TYPE variable_dim_get(variable_frame* frame, unsigned char* ptr)
 {
-  // Use the 'lineptr' to track if we've done this before (so we dont keep doing it)
-  if (!lineptr)
+  unsigned char width = VARIABLE_DIM_WIDTH(frame);
+  uint32_t v = 0;
+
+  if (frame->type & VAR_DIM_MSB)
   {
-    return;
+    while (width--)
+    {
+      v = (v << 8) | *ptr++;
+    }
   }
-  lineptr = NULL;
-  
-#if HAL_UART  
-  // Stop serial interfaces
-  for (unsigned char i = OS_MAX_SERIAL; i--; )
+  else
   {
-    OS_serial_close(i);
+    ptr += width;
+    while (width--)
+    {
+      v = (v << 8) | *--ptr;
+    }
   }
-#endif
+  if ((frame->type & VAR_DIM_TYPE_MASK) == VAR_DIM_LONG)
+  {
+    return (int32_t)v;
+  }
+  return v;
+}
 
-#if HAL_I2C_SLAVE  
-  // Stop i2c interface
-  OS_i2c_close(0);
-#endif
-  
-  // Reset variables to 0 and remove all types
-  OS_memset(variables_begin, 0, VAR_COUNT * VAR_SIZE + 4);
-  
-  // Reset file handles
-  OS_memset(files, 0, sizeof(files));
-  
-  // Stop timers
-  for (unsigned char i = 0; i < OS_MAX_TIMER; i++)
+//
+// Store an array element, truncating the value to the element size.
+//
+static void variable_dim_set(variable_frame* frame, unsigned char* ptr, VAR_TYPE val)
+{
+  unsigned char width = VARIABLE_DIM_WIDTH(frame);
+
+  if (frame->type & VAR_DIM_MSB)
   {
-    OS_timer_stop(i);
+    ptr += width;
+    while (width--)
+    {
+      *--ptr = val;
+      val >>= 8;
+    }
   }
-  
-#ifdef FEATURE_SAMPLING
-  sampling.map = 0;  // switch sampling off
-  sampling.mode = 0;  // set default mode
+  else
+  {
+    while (width--)
+    {
+      *ptr++ = val;
+      val >>= 8;
+    }
+  }
+}
+
+//
+// Continue a CRC-16 (Modbus) over the bytes. Start with 0xFFFF.
+//
+static unsigned short crc16(unsigned short crc, const unsigned char* ptr, unsigned short len)
+{
+  unsigned char bit;
+
+  for (; len; len--)
+  {
+    crc ^= *ptr++;
+    for (bit = 8; bit; bit--)
+    {
+      crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+    }
+  }
+  return crc;
+}
+
+//
+// Array functions, args holds the queued arguments:
+//  SUM(<array>, <index>, <count>) - sum of the elements
+//  CRC(<array>, <index>, <count>, 8|16) - CRC-8 (Dallas/Maxim 1-Wire) or CRC-16 (Modbus) over the bytes
+//  CMP(<array>, <array>, <count>) - compare the bytes of the first count elements, 0 when equal
+//  FIND(<array>, <index>, <count>, <value>) - index of the first element equal to value, or -1
+// Byte arrays only, treated as text:
+//  VAL(<array>, <index>, <count>) - the decimal number at the start of the text
+//  STR(<array>, <index>, <value>) - store value as decimal text, returns the number of characters
+//
+static VAR_TYPE array_function(unsigned char op, VAR_TYPE* args)
+{
+  variable_frame* frame;
+  unsigned char* ptr = get_variable_frame((unsigned char)args[0], &frame);
+  unsigned short len;
+  VAR_TYPE v = 0;
+
+  if (!VARIABLE_IS_DIM(frame) || ((op == FUNC_VAL || op == FUNC_STR) && VARIABLE_DIM_WIDTH(frame) != 1))
+  {
+    goto error;
+  }
+  if (op == FUNC_STR)
+  {
+    // Three digits for every byte is enough, and a sign
+    unsigned char buf[3 * sizeof(VAR_TYPE) + 1];
+    unsigned char* str = buf + sizeof(buf);
+    unsigned VAR_TYPE num = args[2] < 0 ? -(unsigned VAR_TYPE)args[2] : args[2];
+
+    do
+    {
+      *--str = '0' + num % 10;
+      num /= 10;
+    } while (num);
+    if (args[2] < 0)
+    {
+      *--str = '-';
+    }
+    v = buf + sizeof(buf) - str;
+    if (args[1] < 0 || args[1] + v > VARIABLE_DIM_COUNT(frame))
+    {
+      goto error;
+    }
+    OS_memcpy(ptr + args[1], str, v);
+    if (frame->ble)
+    {
+      ble_notify_assign(frame->ble);
+    }
+    return v;
+  }
+  if (op == FUNC_CMP)
+  {
+    variable_frame* frame2;
+    unsigned char* ptr2 = get_variable_frame((unsigned char)args[1], &frame2);
+    if (!VARIABLE_IS_DIM(frame2) || args[2] < 0 || args[2] > VARIABLE_DIM_COUNT(frame))
+    {
+      goto error;
+    }
+    len = args[2] << VARIABLE_DIM_SHIFT(frame);
+    if (len > VARIABLE_DIM_SIZE(frame2))
+    {
+      goto error;
+    }
+    for (; len && !v; len--)
+    {
+      v = *ptr++ - *ptr2++;
+    }
+    return v;
+  }
+
+  if (args[1] < 0 || args[2] < 0 || args[1] + args[2] > VARIABLE_DIM_COUNT(frame))
+  {
+    goto error;
+  }
+  ptr += args[1] << VARIABLE_DIM_SHIFT(frame);
+  len = args[2];
+  if (op == FUNC_SUM)
+  {
+    for (; len; len--)
+    {
+      v += variable_dim_get(frame, ptr);
+      ptr += VARIABLE_DIM_WIDTH(frame);
+    }
+  }
+  else if (op == FUNC_FIND)
+  {
+    for (v = args[1]; len; len--, v++)
+    {
+      if (variable_dim_get(frame, ptr) == args[3])
+      {
+        return v;
+      }
+      ptr += VARIABLE_DIM_WIDTH(frame);
+    }
+    v = -1;
+  }
+  else if (op == FUNC_VAL)
+  {
+    // Borrow the text pointer so parse_int can read the array
+    unsigned char* otxtpos = txtpos;
+    const unsigned char negative = (len && *ptr == '-');
+    unsigned char digits;
+
+    txtpos = ptr + negative;
+    len -= negative;
+    for (digits = 0; digits < len && digits < 255 && txtpos[digits] >= '0' && txtpos[digits] <= '9'; digits++)
+      ;
+    v = parse_int(digits, 10);
+    if (negative)
+    {
+      v = -v;
+    }
+    txtpos = otxtpos;
+  }
+  else
+  {
+    unsigned char bit;
+    len <<= VARIABLE_DIM_SHIFT(frame);
+    if (args[3] == 8)
+    {
+      for (; len; len--)
+      {
+        v ^= *ptr++;
+        for (bit = 8; bit; bit--)
+        {
+          v = (v & 1 ? (v >> 1) ^ 0x8C : v >> 1);
+        }
+      }
+    }
+    else if (args[3] == 16)
+    {
+      v = crc16(0xFFFF, ptr, len);
+    }
+    else
+    {
+      goto error;
+    }
+  }
+  return v;
+error:
+  error_num = ERROR_EXPRESSION;
+  return 0;
+}
+
+//
+// Create an array (size is in bytes)
+//
+static void create_dim(unsigned char name, unsigned char type, VAR_TYPE size, unsigned char* data)
+{
+  variable_frame* f;
+  CHECK_SP_OOM(sizeof(variable_frame) + size, qoom);
+  f = (variable_frame*)sp;
+  f->header.frame_type = FRAME_VARIABLE_FLAG;
+  f->header.frame_size = sizeof(variable_frame) + size;
+  f->type = type;
+  f->name = name;
+  f->ble = NULL;
+  VARIABLE_SAVE(f);
+  if (data)
+  {
+    OS_memcpy(sp + sizeof(variable_frame), data, size);
+  }
+  else
+  {
+    OS_memset(sp + sizeof(variable_frame), 0, size);
+  }
+  return;
+qoom:
+  error_num = ERROR_OOM;
+  return;
+}
+
+//
+// Clean the heap and stack
+//
+static void clean_memory(void)
+{
+  // Use the 'lineptr' to track if we've done this before (so we dont keep doing it)
+  if (!lineptr)
+  {
+    return;
+  }
+  lineptr = NULL;
+  
+#if ENABLE_BLE_CONSOLE
+  // Stop an upload, keeping what was written
+  if (load.active)
+  {
+    load.active = 0;
+    load.end = 0;
+    program_end = flashstore_init(program_start);
+  }
+#endif
+
+#if HAL_UART  
+  // Stop serial interfaces
+  for (unsigned char i = OS_MAX_SERIAL; i--; )
+  {
+    OS_serial_close(i);
+  }
+#endif
+
+#if HAL_I2C_SLAVE  
+  // Stop i2c interface and forget which master was chosen
+  OS_i2c_close(0);
+  i2cHardware = 0;
+#endif
+  
+  // Reset variables to 0 and remove all types
+  OS_memset(variables_begin, 0, VAR_COUNT * VAR_SIZE + 4);
+  
+  // Reset file handles
+  OS_memset(files, 0, sizeof(files));
+
+  // Stop streaming and forget pending notifications
+  ble_dirty = 0;
+  ble_stream_stop();
+  ble_stream.done = 0;
+
+#if ( HOST_CONFIG & OBSERVER_CFG )
+  // Remove the scan filter and batching
+  OS_memset(&scan_filter, 0, sizeof(scan_filter));
+  scan_batch.name = 0;
+#endif
+  
+  // Stop timers
+  for (unsigned char i = 0; i < OS_MAX_TIMER; i++)
+  {
+    OS_timer_stop(i);
+  }
+  
+#ifdef FEATURE_SAMPLING
+  sampling.map = 0;  // switch sampling off
+  sampling.mode = 0;  // set default mode
+  sampling.power = 0;
+  sampling.active = 0;
+  OS_memset(sampling.window, 0, sizeof(sampling.window));
+  samplingFrame = NULL;
+#if OS_ADC_SCAN
+  adc_scan_stop();
+  adcScanFrame = NULL;
 #endif
+#endif
+  
+  // Forget a payload an error left half built, and unbind the advertising fields
+  ble_adptr = NULL;
+  OS_memset(ble_adfields, 0, sizeof(ble_adfields));
+  OS_memset(ble_adlen, 0, sizeof(ble_adlen));
+  ble_adtimer = OS_MAX_TIMER;
+  ble_adrotate.count = 0;
+  ble_adrotate_timer = OS_MAX_TIMER;
   
+#if !defined(ENABLE_WIRE) || ENABLE_WIRE
+  // Forget the compiled WIRE sequences
+  OS_memset(&wire_cache, 0, sizeof(wire_cache));
+  wire_timer = OS_MAX_TIMER;
+#endif
+
+#if OS_SPI_DMA
+  // Stop a SPI transfer before its array goes, and release its chip select
+  if (OS_spi_dma_busy)
+  {
+    OS_spi_dma_abort();
+    if (spiDma.line)
+    {
+      unsigned char pin = spiDma.pin;
+      pin_wire(&pin, &pin + 1);
+    }
+  }
+  spiDma.line = 0;
+  spiDma.done = 0;
+#endif
+
 #if ENABLE_YIELD  
   // Stop pending yield event
   OS_yield(0);
@@ -1262,6 +2091,7 @@ static void clean_memory(void)
     }
     ptr += ((frame_header*)ptr)->frame_size;
   }
+  ble_services = NULL;
   heap = (unsigned char*)program_end;
   SET_MIN_MEMORY(sp - heap);
 }
@@ -1405,7 +2235,7 @@ static VAR_TYPE expression(unsigned char mode)
           variable_frame* frame;
           unsigned char* ptr = get_variable_frame(op, &frame);
           
-          if (frame->type == VAR_DIM_BYTE)
+          if (VARIABLE_IS_DIM(frame))
           {
             if (stackptr + 1 >= stackend)
             {
@@ -1417,14 +2247,13 @@ static VAR_TYPE expression(unsigned char mode)
               unsigned char* otxtpos = txtpos;
               VAR_TYPE index = parse_int(255, 10);
               error_num = ERROR_OK;
-              if (index < 0 || index >= frame->header.frame_size - sizeof(variable_frame))
+              if (index < 0 || index >= VARIABLE_DIM_COUNT(frame))
               {
                 txtpos = otxtpos;
                 error_num = ERROR_EXPRESSION;
                 goto expr_error;
               }
-              ptr += index;
-              *queueptr++ = *ptr;
+              *queueptr++ = variable_dim_get(frame, ptr + (index << VARIABLE_DIM_SHIFT(frame)));
               lastop = 0;
               break;
             }
@@ -1442,6 +2271,22 @@ static VAR_TYPE expression(unsigned char mode)
             lastop = 0;
           }
         }
+        else if (FLASHSTORE_IS_LABEL(op))
+        {
+          // A label evaluates to its line number (for TIMER, ONREAD, etc.)
+          unsigned char** line = flashstore_labelline(FLASHSTORE_LABEL_ID(op));
+          if (line >= program_end)
+          {
+            goto expr_error;
+          }
+          if (queueptr == queueend)
+          {
+            goto expr_oom;
+          }
+          *queueptr++ = *(LINENUM*)*line;
+          skip_label();
+          lastop = 0;
+        }
         else
         {
           txtpos--;
@@ -1560,11 +2405,11 @@ static VAR_TYPE expression(unsigned char mode)
           variable_frame* frame;
           txtpos += 2;
           get_variable_frame(ch, &frame);
-          if (frame->type != VAR_DIM_BYTE)
+          if (!VARIABLE_IS_DIM(frame))
           {
             goto expr_error;
           }
-          *queueptr++ = frame->header.frame_size - sizeof(variable_frame);
+          *queueptr++ = VARIABLE_DIM_COUNT(frame);
         }
         lastop = 0;
         break;
@@ -1580,6 +2425,41 @@ static VAR_TYPE expression(unsigned char mode)
         lastop = 1;
         break;
 
+      case FUNC_SUM:
+      case FUNC_CRC:
+      case FUNC_CMP:
+      case FUNC_FIND:
+      case FUNC_VAL:
+      case FUNC_STR:
+      {
+        // The array names are queued as the first arguments
+        unsigned char arrays = (op == FUNC_CMP ? 2 : 1);
+        if (*txtpos++ != '(')
+        {
+          goto expr_error;
+        }
+        if (stackptr + 2 > stackend || queueptr + arrays > queueend)
+        {
+          goto expr_oom;
+        }
+        (stackptr++)->op = op;
+        stackptr->depth = queueptr - queue;
+        (stackptr++)->op = '(';
+        for (; arrays; arrays--)
+        {
+          ignore_blanks();
+          const unsigned char ch = *txtpos;
+          if (ch < 'A' || ch > 'Z' || txtpos[1] != ',')
+          {
+            goto expr_error;
+          }
+          *queueptr++ = ch;
+          txtpos += 2;
+        }
+        lastop = 1;
+        break;
+      }
+
       case FUNC_MILLIS:
       case FUNC_BATTERY:
       case FUNC_ABS:
@@ -1628,7 +2508,7 @@ static VAR_TYPE expression(unsigned char mode)
             goto expr_error;
           }
         }
-        lastop = 0;
+        lastop = 1;
         break;
 
       case ')':
@@ -1704,6 +2584,7 @@ static VAR_TYPE expression(unsigned char mode)
                   if (files[top].filename >= 'A')
 #endif
                 {
+                  // A file record may be a copy good only until the next find, so use it straight away
                   unsigned char* special = flashstore_findspecial(FS_MAKE_FILE_SPECIAL(files[top].filename, files[top].record));
                   if (special)
                   {
@@ -1789,11 +2670,11 @@ static VAR_TYPE expression(unsigned char mode)
                 {
                   variable_frame* frame;
                   unsigned char* ptr = get_variable_frame(op, &frame);
-                  if (frame->type != VAR_DIM_BYTE || top < 0 || top >= frame->header.frame_size - sizeof(variable_frame))
+                  if (!VARIABLE_IS_DIM(frame) || top < 0 || top >= VARIABLE_DIM_COUNT(frame))
                   {
                     goto expr_error;
                   }
-                  queueptr[-1] = ptr[top];
+                  queueptr[-1] = variable_dim_get(frame, ptr + (top << VARIABLE_DIM_SHIFT(frame)));
                 }
                 else
                 {
@@ -1802,18 +2683,28 @@ static VAR_TYPE expression(unsigned char mode)
                 break;
             }
           }
-          else if (depth == 2)
+          else if (depth == 2 && op == FUNC_POW)
           {
             double base = (double)(queueptr[-2]) / 0x10000;
             double exp  = (double)(queueptr[-1]) / 0x10000;
             (--queueptr)[-1] = (VAR_TYPE)(pow(base, exp) * 0x10000);
           }            
+          else if (depth == (op == FUNC_CRC || op == FUNC_FIND ? 4 : 3) &&
+                   (op == FUNC_SUM || op == FUNC_CRC || op == FUNC_CMP || op == FUNC_FIND || op == FUNC_VAL || op == FUNC_STR))
+          {
+            queueptr -= depth - 1;
+            queueptr[-1] = array_function(op, queueptr - 1);
+            if (error_num)
+            {
+              goto expr_error;
+            }
+          }
           else
           {
             goto expr_error;
           }
-          lastop = 1;
         }
+        lastop = 0;
         break;
       }
 
@@ -1911,6 +2802,9 @@ void interpreter_init()
   OS_memset(program_start, 0, kRamSize);
   variables_begin = (unsigned char*)program_start + kRamSize - VAR_COUNT * VAR_SIZE - 4; // 4 bytes = 32 bits of flags
   sp = variables_begin;
+#ifdef FEATURE_FILESTORE
+  filestore_init();
+#endif
   program_end = flashstore_init(program_start);
   heap = (unsigned char*)program_end;
   SET_MIN_MEMORY(sp - heap);
@@ -1948,7 +2842,7 @@ bool interpreter_setup(void)
 #endif  
   if (flashstore_findspecial(FLASHSPECIAL_AUTORUN))
   {
-    if (program_end > program_start)
+    if (program_end > program_start && !flashstore_labelerror(NULL))
     {
       OS_timer_start(DELAY_TIMER, OS_AUTORUN_TIMEOUT, 0, *(LINENUM*)*program_start);
       return TRUE;
@@ -1961,46 +2855,177 @@ bool interpreter_setup(void)
 //
 // Run the main interpreter while we have new commands to execute
 //
-void interpreter_loop(void)
+#if ENABLE_BLE_CONSOLE
+//
+// Program upload, started by LOAD. The console input is taken as binary frames:
+//  <size:2> <lines:size> <crc:2>
+// little endian, with a CRC-16 (Modbus) over the lines. Each line is as held in flash,
+// <linenum:2> <len:1> <tokens> NL, and the lines are in ascending order. Each frame is collected in
+// free memory, checked, written to flash and acknowledged with OK. A frame of size 0 ends
+// the upload and the line index is built. Labels must already carry their ids, one id per
+// name, or RUN refuses the program.
+//  Called as the input arrives, so this only collects it; interpreter_load_run() does the
+// writing from the task. Returns 0 when not uploading, so the input is typed as usual.
+//
+unsigned char interpreter_load(const unsigned char* data, unsigned char len)
 {
-  while (OS_prompt_available())
+  if (!load.active)
   {
-    interpreter_run(0, 0);
-    OS_prompt_buffer(heap + sizeof(LINENUM), sp);
+    return 0;
+  }
+  for (; len && !load.end; len--)
+  {
+    if (heap + load.got >= sp)
+    {
+      load.error = ERROR_OOM;
+      load.end = 1;
+      break;
+    }
+    heap[load.got++] = *data++;
   }
+  return 1;
 }
-#endif
 
 //
-// The main interpreter engine
+// End an upload, when the console goes away mid-way. The lines written so far are
+// indexed by interpreter_load_run().
 //
-unsigned char interpreter_run(LINENUM gofrom, unsigned char canreturn)
+void interpreter_load_abort(void)
 {
-#if defined ENABLE_YIELD && ENABLE_YIELD 
-  if (canreturn & INTERPRETER_CAN_YIELD)
+  if (load.active)
   {
-    yield_time = OS_get_millis();
+    load.error = ERROR_GENERAL;
+    load.end = 1;
   }
-#endif  
-  error_num = ERROR_OK;
+}
 
-  if (gofrom)
-  {
-    event_frame *f;
+//
+// Write the frames collected so far to flash.
+//
+void interpreter_load_run(void)
+{
+  unsigned char* ptr;
+  unsigned char* end;
+  unsigned short size;
+  unsigned short crc;
+  unsigned char bit;
 
-    linenum = gofrom;
-    if (canreturn & INTERPRETER_CAN_RETURN)
+  while (load.active && !load.end)
+  {
+    if (load.got < sizeof(unsigned short))
     {
-      CHECK_SP_OOM(sizeof(event_frame), qoom);
-      f = (event_frame *)sp;
-      f->header.frame_type = FRAME_EVENT_FLAG;
-      f->header.frame_size = sizeof(event_frame);
+      return;
     }
-    lineptr = findlineptr();
-    txtpos = *lineptr + sizeof(LINENUM) + sizeof(char);
-    if (lineptr >= program_end)
+    size = heap[0] | (heap[1] << 8);
+    if (!size)
     {
-      goto print_error_or_ok;
+      load.error = ERROR_OK;
+      break;
+    }
+    if (load.got < size + 2 * sizeof(unsigned short))
+    {
+      return;
+    }
+
+    // Have the frame
+    end = heap + sizeof(unsigned short) + size;
+    crc = crc16(0xFFFF, heap + sizeof(unsigned short), size);
+    if (crc != (end[0] | (end[1] << 8)))
+    {
+      load.error = ERROR_CRC;
+      break;
+    }
+    for (ptr = heap + sizeof(unsigned short); ptr < end; ptr += ptr[sizeof(LINENUM)])
+    {
+      if (ptr[sizeof(LINENUM)] < sizeof(LINENUM) + 2 * sizeof(char) || ptr + ptr[sizeof(LINENUM)] > end ||
+          ptr[ptr[sizeof(LINENUM)] - 1] != NL || *(LINENUM*)ptr <= load.last || *(LINENUM*)ptr >= FLASHID_SPECIAL)
+      {
+        load.error = ERROR_GENERAL;
+        goto done;
+      }
+      SEMAPHORE_FLASH_WAIT();
+      bit = flashstore_appendline(ptr);
+      SEMAPHORE_FLASH_SIGNAL();
+      if (!bit)
+      {
+        load.error = ERROR_TOOBIG;
+        goto done;
+      }
+      load.last = *(LINENUM*)ptr;
+    }
+
+    // Drop the frame before acknowledging it, as the next may arrive while we print
+    size += 2 * sizeof(unsigned short);
+    load.got -= size;
+    for (ptr = heap; ptr < heap + load.got; ptr++)
+    {
+      *ptr = ptr[size];
+    }
+    printmsg(error_msgs[ERROR_OK]);
+  }
+  if (!load.active)
+  {
+    return;
+  }
+
+done:
+  // Finished or failed, so index what was written
+  load.active = 0;
+  load.end = 0;
+  program_end = flashstore_init(program_start);
+  heap = (unsigned char*)program_end;
+  OS_prompt_buffer(heap + sizeof(LINENUM), sp);
+  printmsg(error_msgs[load.error]);
+}
+#endif
+
+void interpreter_loop(void)
+{
+#if ENABLE_BLE_CONSOLE
+  if (load.active)
+  {
+    interpreter_load_run();
+    return;
+  }
+#endif
+  while (OS_prompt_available())
+  {
+    interpreter_run(0, 0);
+    OS_prompt_buffer(heap + sizeof(LINENUM), sp);
+  }
+}
+#endif
+
+//
+// The main interpreter engine
+//
+unsigned char interpreter_run(LINENUM gofrom, unsigned char canreturn)
+{
+#if defined ENABLE_YIELD && ENABLE_YIELD 
+  if (canreturn & INTERPRETER_CAN_YIELD)
+  {
+    yield_time = OS_get_millis();
+  }
+#endif  
+  error_num = ERROR_OK;
+
+  if (gofrom)
+  {
+    event_frame *f;
+
+    linenum = gofrom;
+    if (canreturn & INTERPRETER_CAN_RETURN)
+    {
+      CHECK_SP_OOM(sizeof(event_frame), qoom);
+      f = (event_frame *)sp;
+      f->header.frame_type = FRAME_EVENT_FLAG;
+      f->header.frame_size = sizeof(event_frame);
+    }
+    lineptr = findlineptr();
+    txtpos = *lineptr + sizeof(LINENUM) + sizeof(char);
+    if (lineptr >= program_end)
+    {
+      goto print_error_or_ok;
     }
     goto interperate;
   }
@@ -2051,6 +3076,7 @@ unsigned char interpreter_run(LINENUM gofrom, unsigned char canreturn)
     *((LINENUM*)txtpos) = linenum;
     txtpos[sizeof(LINENUM)] = linelen;
     
+    ble_forget_service(linenum);
     if (txtpos[sizeof(LINENUM) + sizeof(char)] == NL) // If the line has no txt, it was just a delete
     {
       program_end = flashstore_deleteline(linenum);
@@ -2075,6 +3101,16 @@ unsigned char interpreter_run(LINENUM gofrom, unsigned char canreturn)
       program_end = newend;
     }
     heap = (unsigned char*)program_end;
+    {
+      unsigned char** badline;
+      error_num = label_error(&badline);
+      if (error_num)
+      {
+        // Show the label's line with the error
+        lineptr = badline;
+        goto print_error_or_ok;
+      }
+    }
   }
 #endif
 
@@ -2126,7 +3162,20 @@ run_next_statement:
   switch (*txtpos++)
   {
     default:
-      if (*--txtpos < 0x80)
+      txtpos--;
+      if (FLASHSTORE_IS_LABEL(*txtpos))
+      {
+        // Label line, run whatever follows the name
+        txtpos++;
+        skip_label();
+        ignore_blanks();
+        if (*txtpos == NL)
+        {
+          goto run_next_statement;
+        }
+        goto interperate;
+      }
+      if (*txtpos < 0x80)
       {
         goto assignment;
       }
@@ -2136,6 +3185,10 @@ run_next_statement:
 #if ENABLE_BLE_CONSOLE      
     case KW_LIST:
       goto list;
+    case KW_PACK:
+      goto cmd_pack;
+    case KW_LOAD:
+      goto cmd_load;
 #endif
     case KW_MEM:
       goto mem;
@@ -2150,6 +3203,15 @@ run_next_statement:
       goto print_error_or_ok;
     case KW_RUN:
       clean_memory();
+      {
+        unsigned char** badline;
+        error_num = label_error(&badline);
+        if (error_num)
+        {
+          lineptr = badline;
+          goto print_error_or_ok;
+        }
+      }
       lineptr = program_start;
       if (lineptr >= program_end)
       {
@@ -2165,18 +3227,7 @@ run_next_statement:
     case KW_ELSE:
       goto cmd_else;
     case KW_GOTO:
-      linenum = expression(EXPR_NORMAL);
-      if (error_num || *txtpos != NL)
-      {
-        GOTO_QWHAT;
-      }
-      lineptr = findlineptr();
-      if (lineptr >= program_end)
-      {
-        goto print_error_or_ok;
-      }
-      txtpos = *lineptr + sizeof(LINENUM) + sizeof(char);
-      goto interperate;
+      goto cmd_goto;
     case KW_GOSUB:
       goto cmd_gosub;
     case KW_RETURN:
@@ -2251,6 +3302,14 @@ run_next_statement:
       goto cmd_read;
     case KW_WRITE:
       goto cmd_write;
+    case KW_FILL:
+      goto cmd_fill;
+    case KW_COPY:
+      goto cmd_copy;
+#if defined(PROCESS_MPPT) && MPPT_MODE_HEX
+    case KW_VEDIRECT:
+      goto cmd_vedirect;
+#endif
   }
   GOTO_QWHAT;
 
@@ -2481,11 +3540,28 @@ forloop:
     goto run_next_statement;
   }
 
+cmd_goto:
+  {
+    unsigned char** line = parse_lineptr();
+
+    if (error_num || *txtpos != NL)
+    {
+      GOTO_QWHAT;
+    }
+    lineptr = line;
+    if (lineptr >= program_end)
+    {
+      goto print_error_or_ok;
+    }
+    txtpos = *lineptr + sizeof(LINENUM) + sizeof(char);
+    goto interperate;
+  }
+
 cmd_gosub:
   {
     gosub_frame *f;
+    unsigned char** line = parse_lineptr();
 
-    linenum = expression(EXPR_NORMAL);
     if (error_num || *txtpos != NL)
     {
       GOTO_QWHAT;
@@ -2495,7 +3571,7 @@ cmd_gosub:
     f->header.frame_type = FRAME_GOSUB_FLAG;
     f->header.frame_size = sizeof(gosub_frame);
     f->line = lineptr;
-    lineptr = findlineptr();
+    lineptr = line;
     if (lineptr >= program_end)
     {
       goto print_error_or_ok;
@@ -2568,7 +3644,7 @@ assignment:
     unsigned char* ptr;
 
     ptr = parse_variable_address(&frame);
-    if (*txtpos != OP_EQ || (ptr == NULL && (frame == NULL || frame->type != VAR_DIM_BYTE)))
+    if (*txtpos != OP_EQ || (ptr == NULL && (frame == NULL || !VARIABLE_IS_DIM(frame))))
     {
       GOTO_QWHAT;
     }
@@ -2581,9 +3657,9 @@ assignment:
       {
         GOTO_QWHAT;
       }
-      if (frame->type == VAR_DIM_BYTE)
+      if (VARIABLE_IS_DIM(frame))
       {
-        *ptr = val;
+        variable_dim_set(frame, ptr, val);
       }
       else
       {
@@ -2592,17 +3668,49 @@ assignment:
     }
     else
     {
-      // Array assignment
-      ptr = ((unsigned char*)frame) + sizeof(variable_frame);
-      unsigned short len = frame->header.frame_size - sizeof(variable_frame);
-      while (len--)
+      // Array assignment - values and quoted strings, an array ending
+      // with a string is padded with zeros.
+      ptr = VARIABLE_DIM_DATA(frame);
+      unsigned short len = VARIABLE_DIM_COUNT(frame);
+      while (len)
       {
+        ignore_blanks();
+        if (*txtpos == '"' || *txtpos == '\'')
+        {
+          short slen = find_quoted_string();
+          if (slen < 0 || slen > len)
+          {
+            GOTO_QWHAT;
+          }
+          for (len -= slen; slen; slen--)
+          {
+            variable_dim_set(frame, ptr, *txtpos++);
+            ptr += VARIABLE_DIM_WIDTH(frame);
+          }
+          txtpos++;
+          ignore_blanks();
+          if (*txtpos == NL)
+          {
+            for (; len; len--)
+            {
+              variable_dim_set(frame, ptr, 0);
+              ptr += VARIABLE_DIM_WIDTH(frame);
+            }
+          }
+          else if (*txtpos++ != ',')
+          {
+            GOTO_QWHAT;
+          }
+          continue;
+        }
         val = expression(EXPR_COMMA);
         if (error_num)
         {
           GOTO_QWHAT;
         }
-        *ptr++ = val;
+        variable_dim_set(frame, ptr, val);
+        ptr += VARIABLE_DIM_WIDTH(frame);
+        len--;
       }
     }
     
@@ -2614,6 +3722,99 @@ assignment:
   }
 
 #if ENABLE_BLE_CONSOLE  
+//
+// PACK [<start>[, <step>]]
+// Rewrite every line of the program, optionally renumbering it from start, then compact
+// each page to reclaim the space of replaced and deleted lines. Line numbers after GOTO
+// and GOSUB are renumbered too, computed targets are not. Lines go wherever there is room,
+// so the program is not necessarily contiguous and partly filled pages are not merged.
+//
+cmd_pack:
+  {
+    VAR_TYPE start = 0;
+    VAR_TYPE step = 10;
+    unsigned short count = program_end - program_start;
+    unsigned short i;
+
+    if (*txtpos != NL)
+    {
+      start = expression(EXPR_COMMA);
+      if (!error_num && txtpos[-1] == ',')
+      {
+        step = expression(EXPR_NORMAL);
+      }
+      if (error_num || *txtpos != NL || start < 1 || step < 1 || start + (VAR_TYPE)(count ? count - 1 : 0) * step >= FLASHID_SPECIAL)
+      {
+        GOTO_QWHAT;
+      }
+    }
+    clean_memory();
+    lineptr = program_end;
+
+    // Keep the original line numbers and a line buffer at the top of memory
+    if (sp - heap < count * sizeof(LINENUM) + 256 + sizeof(unsigned char*))
+    {
+      goto qoom;
+    }
+    LINENUM* ids = (LINENUM*)(sp - count * sizeof(LINENUM));
+    unsigned char* buf = (unsigned char*)ids - 256;
+    for (i = 0; i < count; i++)
+    {
+      ids[i] = *(LINENUM*)program_start[i];
+    }
+
+    // Check every line first, so the program is either rewritten completely or not at all
+    for (i = 0; i < count; i++)
+    {
+      if (!pack_line(ids, count, i, start, step, buf, 0))
+      {
+        lineptr = program_start + i;
+        goto qtoobig;
+      }
+    }
+
+    // Lines which move down are rewritten first in ascending order, then those moving up in
+    // descending order, so a new number never replaces a line which is still to be done.
+    for (i = 0; i < count; i++)
+    {
+      if ((start ? start + i * step : ids[i]) <= ids[i] && !pack_line(ids, count, i, start, step, buf, 1))
+      {
+        goto qtoobig;
+      }
+    }
+    for (i = count; i--; )
+    {
+      if ((start ? start + i * step : ids[i]) > ids[i] && !pack_line(ids, count, i, start, step, buf, 1))
+      {
+        goto qtoobig;
+      }
+    }
+
+    // Reclaim the pages the old lines were in
+    SEMAPHORE_FLASH_WAIT();
+    flashstore_compactall(heap, sp);
+    SEMAPHORE_FLASH_SIGNAL();
+  }
+  goto print_error_or_ok;
+
+//
+// LOAD
+// Replace the program with pre-tokenized lines sent as binary frames, see interpreter_load().
+//
+cmd_load:
+  if (*txtpos != NL || lineptr < program_end)
+  {
+    GOTO_QWHAT;
+  }
+  clean_memory();
+  program_end = flashstore_deleteall();
+  heap = (unsigned char*)program_end;
+  load.got = 0;
+  load.last = 0;
+  load.end = 0;
+  load.active = 1;
+  goto print_error_or_ok;
+
 //
 // LIST [<linenr>]
 // List the current program starting at the optional line number.
@@ -2681,6 +3882,11 @@ print:
       {
         txtpos++;
       }
+      else if (*txtpos >= 'A' && *txtpos <= 'Z' && (txtpos[1] == ',' || txtpos[1] == NL || txtpos[1] == WS_SPACE) &&
+               print_array_string(*txtpos))
+      {
+        txtpos++;
+      }
       else
       {
         VAR_TYPE e;
@@ -2751,13 +3957,17 @@ cmd_reboot:
   GOTO_QWHAT; // Not reached
 
 //
-// DIM <var>(<size>)
-// Converts a variable into an array of bytes of the given size.
+// DIM <var>(<size>) [WORD|LONG] [MSB|LSB] [= <array>(<offset>)]
+// Converts a variable into an array of bytes, 16-bit words or 32-bit longs of the given size.
+// Words and longs are stored LSB first unless MSB is given.
+// With '= <array>(<offset>)' no memory is allocated; the variable becomes a view onto
+// the bytes of the other array starting at the offset.
 //
 cmd_dim:
   {
     VAR_TYPE size;
     unsigned char name;
+    unsigned char type = VAR_DIM_BYTE;
 
     if (*txtpos < 'A' || *txtpos > 'Z')
     {
@@ -2765,75 +3975,50 @@ cmd_dim:
     }
     name = *txtpos++;
     size = expression(EXPR_BRACES);
-    if (error_num || !size)
+    if (error_num || size <= 0)
     {
       GOTO_QWHAT;
     }
-    create_dim(name, size, NULL);
-    if (error_num)
+    ignore_blanks();
+    if (*txtpos == KW_CONSTANT && (txtpos[1] == CO_WORD || txtpos[1] == CO_LONG))
     {
-      GOTO_QWHAT;
+      type = (txtpos[1] == CO_WORD ? VAR_DIM_WORD : VAR_DIM_LONG);
+      txtpos += 2;
     }
-  }
-  goto run_next_statement;
-
-//
-// TIMER <timer number>, <timeout ms> [REPEAT] GOSUB <linenum>
-// Creates an optionally repeating timer which will call a specific subroutine everytime it fires.
-//
-cmd_timer:
-  {
-    unsigned char timer;
-    VAR_TYPE timeout;
-    unsigned char repeat = 0;
-    LINENUM subline;
-    
-    timer = (unsigned char)expression(EXPR_COMMA);
-    if (error_num)
+    if (*txtpos == SPI_MSB)
     {
-      GOTO_QWHAT;
+      type |= VAR_DIM_MSB;
+      txtpos++;
     }
-    ignore_blanks();
-    if (*txtpos == TI_STOP)
+    else if (*txtpos == SPI_LSB)
     {
       txtpos++;
-      OS_timer_stop(timer);
     }
-    else
+    size <<= (type & VAR_DIM_TYPE_MASK) - VAR_DIM_BYTE;
+    if (*txtpos == OP_EQ)
     {
-      timeout = expression(EXPR_NORMAL);
-      if (error_num)
+      variable_frame* vframe;
+      txtpos++;
+      unsigned char* ptr = parse_variable_address(&vframe);
+      if (!ptr || !VARIABLE_IS_DIM(vframe) || ptr + size > VARIABLE_DIM_DATA(vframe) + VARIABLE_DIM_SIZE(vframe))
       {
         GOTO_QWHAT;
       }
-      ignore_blanks();
-      if (*txtpos == TI_REPEAT)
-      {
-        txtpos++;
-        repeat = 1;
-      }
-      if (*txtpos == KW_GOSUB)
-      {
-        txtpos++;
-        subline = (LINENUM)expression(EXPR_NORMAL);
-        if (error_num)
-        {
-          GOTO_QWHAT;
-        }
-      }
-      else
-      {
-#ifdef FEATURE_SAMPLING 
-        // allow TIMER without GOSUB
-        if (*txtpos == NL)
-        {
-          subline = 0;
-        }
-        else
-#endif
-          GOTO_QWHAT;
-      }
-      if (!OS_timer_start(timer, timeout, repeat, subline))
+      CHECK_SP_OOM(sizeof(variable_frame) + sizeof(dim_view), qoom);
+      vframe = (variable_frame*)sp;
+      vframe->header.frame_type = FRAME_VARIABLE_FLAG;
+      vframe->header.frame_size = sizeof(variable_frame) + sizeof(dim_view);
+      vframe->type = type | VAR_DIM_VIEW;
+      vframe->name = name;
+      vframe->ble = NULL;
+      ((dim_view*)(vframe + 1))->data = ptr;
+      ((dim_view*)(vframe + 1))->size = size;
+      VARIABLE_SAVE(vframe);
+    }
+    else
+    {
+      create_dim(name, type, size, NULL);
+      if (error_num)
       {
         GOTO_QWHAT;
       }
@@ -2842,11 +4027,170 @@ cmd_timer:
   goto run_next_statement;
 
 //
-// DELAY <timeout>
-// Pauses execution for timeout-ms. -1 means forever
+// FILL <array>[(<index>)], <value>[, <count>]
+// Set count elements (default: to the end of the array) to the value.
 //
-cmd_delay:
-  val = expression(EXPR_NORMAL);
+cmd_fill:
+  {
+    variable_frame* vframe;
+    unsigned char* ptr = parse_array_address(&vframe);
+    if (!ptr || *txtpos++ != ',')
+    {
+      GOTO_QWHAT;
+    }
+    const unsigned char width = VARIABLE_DIM_WIDTH(vframe);
+    unsigned short len = (VARIABLE_DIM_DATA(vframe) + VARIABLE_DIM_SIZE(vframe) - ptr) / width;
+    val = expression(EXPR_COMMA);
+    if (txtpos[-1] == ',')
+    {
+      VAR_TYPE count = expression(EXPR_NORMAL);
+      if (count < 0 || count > len)
+      {
+        GOTO_QWHAT;
+      }
+      len = count;
+    }
+    if (error_num)
+    {
+      GOTO_QWHAT;
+    }
+    if (len)
+    {
+      // Store the first element and replicate its bytes through the rest
+      variable_dim_set(vframe, ptr, val);
+      for (len = (len - 1) * width; len; len--, ptr++)
+      {
+        ptr[width] = *ptr;
+      }
+    }
+    if (vframe->ble)
+    {
+      ble_notify_assign(vframe->ble);
+    }
+  }
+  goto run_next_statement;
+
+//
+// COPY <array>[(<index>)] TO <array>[(<index>)][, <count>]
+// Copy count elements of the first array (default: as many as fit) into the second.
+// The bytes are copied as they are and the ranges may overlap.
+//
+cmd_copy:
+  {
+    variable_frame* sframe;
+    variable_frame* dframe;
+    unsigned char* src = parse_array_address(&sframe);
+    if (!src || *txtpos++ != ST_TO)
+    {
+      GOTO_QWHAT;
+    }
+    unsigned char* dst = parse_array_address(&dframe);
+    if (!dst)
+    {
+      GOTO_QWHAT;
+    }
+    unsigned short len = VARIABLE_DIM_DATA(sframe) + VARIABLE_DIM_SIZE(sframe) - src;
+    unsigned short dlen = VARIABLE_DIM_DATA(dframe) + VARIABLE_DIM_SIZE(dframe) - dst;
+    ignore_blanks();
+    if (*txtpos == ',')
+    {
+      txtpos++;
+      VAR_TYPE count = expression(EXPR_NORMAL);
+      if (error_num || count < 0 || (count << VARIABLE_DIM_SHIFT(sframe)) > len || (count << VARIABLE_DIM_SHIFT(sframe)) > dlen)
+      {
+        GOTO_QWHAT;
+      }
+      len = count << VARIABLE_DIM_SHIFT(sframe);
+    }
+    else if (len > dlen)
+    {
+      len = dlen & (0xFFFF << VARIABLE_DIM_SHIFT(sframe));
+    }
+    if (dst > src)
+    {
+      OS_rmemcpy(dst, src, len);
+    }
+    else
+    {
+      OS_memcpy(dst, src, len);
+    }
+    if (dframe->ble)
+    {
+      ble_notify_assign(dframe->ble);
+    }
+  }
+  goto run_next_statement;
+
+//
+// TIMER <timer number>, <timeout ms> [REPEAT] GOSUB <linenum>
+// Creates an optionally repeating timer which will call a specific subroutine everytime it fires.
+//
+cmd_timer:
+  {
+    unsigned char timer;
+    VAR_TYPE timeout;
+    unsigned char repeat = 0;
+    LINENUM subline;
+    
+    timer = (unsigned char)expression(EXPR_COMMA);
+    if (error_num)
+    {
+      GOTO_QWHAT;
+    }
+    ignore_blanks();
+    if (*txtpos == TI_STOP)
+    {
+      txtpos++;
+      OS_timer_stop(timer);
+    }
+    else
+    {
+      timeout = expression(EXPR_NORMAL);
+      if (error_num)
+      {
+        GOTO_QWHAT;
+      }
+      ignore_blanks();
+      if (*txtpos == TI_REPEAT)
+      {
+        txtpos++;
+        repeat = 1;
+      }
+      if (*txtpos == KW_GOSUB)
+      {
+        txtpos++;
+        subline = (LINENUM)expression(EXPR_NORMAL);
+        if (error_num)
+        {
+          GOTO_QWHAT;
+        }
+      }
+      else
+      {
+#ifdef FEATURE_SAMPLING 
+        // allow TIMER without GOSUB
+        if (*txtpos == NL)
+        {
+          subline = 0;
+        }
+        else
+#endif
+          GOTO_QWHAT;
+      }
+      if (!OS_timer_start(timer, timeout, repeat, subline))
+      {
+        GOTO_QWHAT;
+      }
+    }
+  }
+  goto run_next_statement;
+
+//
+// DELAY <timeout>
+// Pauses execution for timeout-ms. -1 means forever
+//
+cmd_delay:
+  val = expression(EXPR_NORMAL);
   if (error_num)
   {
     GOTO_QWHAT;
@@ -3156,15 +4500,123 @@ cmd_serial:
   GOTO_QWHAT;
 #endif // HAL_UART
   
+#if defined(PROCESS_MPPT) && MPPT_MODE_HEX
+//
+// VEDIRECT #<port>, <register>, <period>[, <divisor>[, <signed>]]
+//  Keep a register of the VE.Direct device on a serial port opened with flow M up to date,
+//  asking for it every period ms, or 0 to only take what the device sends by itself.
+//  The value is divided by the divisor, and sign extended when signed is TRUE.
+// VEDIRECT #<port> READ <array>
+//  Copy the latest values into the array, in the order the registers were added.
+// VEDIRECT #<port> STOP
+//  Forget all the registers.
+//
+cmd_vedirect:
+  {
+    if (*txtpos++ != '#')
+    {
+      GOTO_QWHAT;
+    }
+    const unsigned char port = expression(EXPR_COMMA);
+    if (error_num || port > (OS_MAX_SERIAL-1))
+    {
+      GOTO_QWHAT;
+    }
+    if (txtpos[-1] == ',')
+    {
+      const VAR_TYPE id = expression(EXPR_COMMA);
+      const VAR_TYPE period = expression(EXPR_COMMA);
+      VAR_TYPE divisor = 1;
+      unsigned char flags = 0;
+      if (txtpos[-1] == ',')
+      {
+        divisor = expression(EXPR_COMMA);
+        if (txtpos[-1] == ',' && expression(EXPR_NORMAL))
+        {
+          flags = MPPT_REGISTER_SIGNED;
+        }
+      }
+      if (error_num || id < 0 || id > 0xFFFF || period < 0 || period > 0xFFFF || divisor < 1 || divisor > 0xFFFF)
+      {
+        GOTO_QWHAT;
+      }
+      if (mppt_register(port, id, period, divisor, flags))
+      {
+        goto qtoobig;
+      }
+    }
+    else if (*txtpos == KW_READ)
+    {
+      txtpos++;
+      variable_frame* vframe;
+      unsigned char* ptr = parse_array_address(&vframe);
+      if (!ptr || *txtpos != NL)
+      {
+        GOTO_QWHAT;
+      }
+      const unsigned char width = VARIABLE_DIM_WIDTH(vframe);
+      unsigned char* end = VARIABLE_DIM_DATA(vframe) + VARIABLE_DIM_SIZE(vframe);
+      for (unsigned char i = 0; i < mppt_register_count(port) && ptr + width <= end; i++, ptr += width)
+      {
+        variable_dim_set(vframe, ptr, mppt_register_value(port, i));
+      }
+    }
+    else if (*txtpos == TI_STOP)
+    {
+      txtpos++;
+      mppt_reset(port, 0);
+    }
+    else
+    {
+      GOTO_QWHAT;
+    }
+  }
+  goto run_next_statement;
+#endif
+
 #if !defined(ENABLE_WIRE) || ENABLE_WIRE  
 //
 // WIRE ...
+// WIRE TIMER <timer>, <ms>, <linenr>
+// WIRE TIMER STOP
+// The timer runs the compiled sequence on the line natively, starting now. The line must
+// have run once, so its sequence is compiled.
 //
 cmd_wire:  
   if (lineptr >= program_end)
   {
     goto qdirect;
   }
+  if (*txtpos == KW_TIMER)
+  {
+    txtpos++;
+    if (*txtpos == TI_STOP)
+    {
+      txtpos++;
+      if (wire_timer < OS_MAX_TIMER)
+      {
+        OS_timer_stop(wire_timer);
+        wire_timer = OS_MAX_TIMER;
+      }
+    }
+    else
+    {
+      unsigned char id = (unsigned char)expression(EXPR_COMMA);
+      VAR_TYPE timeout = expression(EXPR_COMMA);
+      wire_timer_line = expression(EXPR_NORMAL);
+      if (error_num || id >= OS_MAX_TIMER || timeout < 1 || !interpreter_wire(wire_timer_line))
+      {
+        GOTO_QWHAT;
+      }
+      wire_timer = id;
+      OS_timer_start(id, timeout, 1, 0);
+    }
+    goto run_next_statement;
+  }
+  if (pin_wire_cached())
+  {
+    goto run_next_statement;
+  }
   pin_wire_parse();
   if (error_num)
   {
@@ -3174,6 +4626,15 @@ cmd_wire:
 #endif
   
 ble_gatt:
+  if (*txtpos == KW_CONSTANT && txtpos[1] == CO_STREAM)
+  {
+    txtpos += 2;
+    if (ble_stream_start())
+    {
+      GOTO_QWHAT;
+    }
+    goto run_next_statement;
+  }
   if (lineptr >= program_end)
   {
     goto qdirect;
@@ -3261,9 +4722,33 @@ ble_gatt:
 //
 // SCAN <time> LIMITED|GENERAL [ACTIVE] [DUPLICATES] ONDISCOVER GOSUB <linenum>
 //  or
+// SCAN FILTER RSSI <min>|ADTYPE <type>[, <value>]|ADDRESS <array>|DUPLICATES <ms>|END
+//  or
+// SCAN BATCH <array>[, <entry size>]|END
+//  or
 // SCAN LIMITED|GENERAL|NAME "..."|CUSTOM "..."|END
 //
 ble_scan:
+#if ( HOST_CONFIG & OBSERVER_CFG )
+  if (*txtpos == BLE_FILTER)
+  {
+    txtpos++;
+    if (scan_filter_set())
+    {
+      GOTO_QWHAT;
+    }
+    goto run_next_statement;
+  }
+  if (*txtpos == KW_CONSTANT && txtpos[1] == CO_BATCH)
+  {
+    txtpos += 2;
+    if (scan_batch_set())
+    {
+      GOTO_QWHAT;
+    }
+    goto run_next_statement;
+  }
+#endif
   if (*txtpos < 0x80)
   {
 #if ( HOST_CONFIG & OBSERVER_CFG )        
@@ -3332,7 +4817,7 @@ ble_scan:
     GAPRole_SetParameter(TGAP_LIM_DISC_SCAN, sizeof(param), &param);
 #if ( HOST_CONFIG & OBSERVER_CFG )        
     blueBasic_discover.linenum = linenum;
-    uint16 param = !dups;
+    param = !dups;
     GAPRole_SetParameter(TGAP_FILTER_ADV_REPORTS, sizeof(param), &param);
     GAPObserverRole_CancelDiscovery();
     mode = 3;
@@ -3344,34 +4829,145 @@ ble_scan:
   
 ble_advert:
   {
-    if (!ble_adptr)
+    if (*txtpos == KW_CONSTANT && txtpos[1] == CO_UPDATE)
     {
-      ble_adptr = ble_adbuf;
+      txtpos += 2;
+      if (*txtpos == KW_TIMER)
+      {
+        txtpos++;
+        if (*txtpos == TI_STOP)
+        {
+          txtpos++;
+          if (ble_adtimer < OS_MAX_TIMER)
+          {
+            OS_timer_stop(ble_adtimer);
+            ble_adtimer = OS_MAX_TIMER;
+          }
+        }
+        else
+        {
+          unsigned char id = (unsigned char)expression(EXPR_COMMA);
+          VAR_TYPE timeout = expression(EXPR_NORMAL);
+          if (error_num || id >= OS_MAX_TIMER || timeout < 1)
+          {
+            GOTO_QWHAT;
+          }
+          ble_adtimer = id;
+          OS_timer_start(id, timeout, 1, 0);
+        }
+      }
+      else
+      {
+        interpreter_advert_update();
+      }
+      goto run_next_statement;
     }
-    unsigned char ch = *txtpos;
-    switch (ch)
+    if (*txtpos == KW_CONSTANT && txtpos[1] == CO_ROTATE)
     {
-      case BLE_LIMITED:
-        if (ble_adptr + 3 > ble_adbuf + sizeof(ble_adbuf))
+      txtpos += 2;
+      if (*txtpos == KW_END)
+      {
+        txtpos++;
+        if (ble_adrotate_timer < OS_MAX_TIMER)
         {
-          SET_ERR_LINE;
-          goto qtoobig;
+          OS_timer_stop(ble_adrotate_timer);
+          ble_adrotate_timer = OS_MAX_TIMER;
         }
-        *ble_adptr++ = 2;
-        *ble_adptr++ = GAP_ADTYPE_FLAGS;
-        *ble_adptr++ = GAP_ADTYPE_FLAGS_LIMITED | GAP_ADTYPE_FLAGS_BREDR_NOT_SUPPORTED;
+        ble_adrotate.count = 0;
+      }
+      else if (*txtpos == KW_TIMER)
+      {
         txtpos++;
-        break;
-      case BLE_GENERAL:
-        if (ble_adptr + 3 > ble_adbuf + sizeof(ble_adbuf))
+        unsigned char id = (unsigned char)expression(EXPR_COMMA);
+        ignore_blanks();
+        ble_adrotate.turns = 0;
+        if (*txtpos >= 'A' && *txtpos <= 'Z')
+        {
+          ble_adrotate.turns = *txtpos++;
+        }
+        if (error_num || id >= OS_MAX_TIMER || !ble_adrotate.count)
+        {
+          GOTO_QWHAT;
+        }
+        // The rotation replaces the payloads, so their bound fields no longer apply
+        OS_memset(ble_adlen, 0, sizeof(ble_adlen));
+        ble_adrotate_timer = id;
+        ble_adrotate.next = 0;
+        interpreter_advert_rotate();
+      }
+      else
+      {
+        unsigned char i = ble_adrotate.count;
+        VAR_TYPE dwell;
+
+        if (i == BLE_ADROTATE)
         {
           SET_ERR_LINE;
           goto qtoobig;
         }
-        *ble_adptr++ = 2;
-        *ble_adptr++ = GAP_ADTYPE_FLAGS;
-        *ble_adptr++ = GAP_ADTYPE_FLAGS_GENERAL | GAP_ADTYPE_FLAGS_BREDR_NOT_SUPPORTED;
-        txtpos++;
+        ble_adrotate.entry[i].advert = *txtpos++;
+        ble_adrotate.entry[i].scanrsp = 0;
+        ignore_blanks();
+        if (*txtpos == KW_SCAN)
+        {
+          txtpos++;
+          ignore_blanks();
+          ble_adrotate.entry[i].scanrsp = *txtpos++;
+          ignore_blanks();
+        }
+        if (*txtpos++ != ',')
+        {
+          GOTO_QWHAT;
+        }
+        dwell = expression(EXPR_NORMAL);
+        if (error_num || dwell < 1 || dwell > 0xFFFF ||
+            ble_adrotate.entry[i].advert < 'A' || ble_adrotate.entry[i].advert > 'Z' ||
+            (ble_adrotate.entry[i].scanrsp && (ble_adrotate.entry[i].scanrsp < 'A' || ble_adrotate.entry[i].scanrsp > 'Z')))
+        {
+          GOTO_QWHAT;
+        }
+        ble_adrotate.entry[i].dwell = dwell;
+        ble_adrotate.count++;
+      }
+      goto run_next_statement;
+    }
+    if (!ble_adptr)
+    {
+      // Starting a new payload, so forget the fields bound to the old one
+      ble_adptr = ble_adbuf;
+      ble_adlen[!ble_isadvert] = 0;
+      for (unsigned char i = 0; i < BLE_ADFIELDS; i++)
+      {
+        if (((ble_adfields[i].offset & BLE_ADFIELD_SCANRSP) == 0) == (ble_isadvert != 0))
+        {
+          ble_adfields[i].var = 0;
+        }
+      }
+    }
+    unsigned char ch = *txtpos;
+    switch (ch)
+    {
+      case BLE_LIMITED:
+        if (ble_adptr + 3 > ble_adbuf + sizeof(ble_adbuf))
+        {
+          SET_ERR_LINE;
+          goto qtoobig;
+        }
+        *ble_adptr++ = 2;
+        *ble_adptr++ = GAP_ADTYPE_FLAGS;
+        *ble_adptr++ = GAP_ADTYPE_FLAGS_LIMITED | GAP_ADTYPE_FLAGS_BREDR_NOT_SUPPORTED;
+        txtpos++;
+        break;
+      case BLE_GENERAL:
+        if (ble_adptr + 3 > ble_adbuf + sizeof(ble_adbuf))
+        {
+          SET_ERR_LINE;
+          goto qtoobig;
+        }
+        *ble_adptr++ = 2;
+        *ble_adptr++ = GAP_ADTYPE_FLAGS;
+        *ble_adptr++ = GAP_ADTYPE_FLAGS_GENERAL | GAP_ADTYPE_FLAGS_BREDR_NOT_SUPPORTED;
+        txtpos++;
         break;
       case BLE_NAME:
         {
@@ -3468,23 +5064,46 @@ ble_advert:
             {
               variable_frame* frame;
               unsigned char* ptr;
+              unsigned short width;
+              unsigned char i;
               
               if (txtpos[1] != NL && txtpos[1] != WS_SPACE)
               {
                 GOTO_QWHAT;
               }
 
+              // Arrays are bound whole, other variables by their lowest 1 to 4 bytes (default 1)
               ptr = get_variable_frame(ch, &frame);
-              if (frame->type != VAR_DIM_BYTE)
+              if (VARIABLE_IS_DIM(frame))
               {
-                GOTO_QWHAT;
+                width = VARIABLE_DIM_SIZE(frame);
               }
-              if (ble_adptr + frame->header.frame_size - sizeof(variable_frame) > ble_adbuf + sizeof(ble_adbuf))
+              else
+              {
+                width = 1;
+                if (txtpos[1] == WS_SPACE && txtpos[2] >= '1' && txtpos[2] <= '4')
+                {
+                  width = txtpos[2] - '0';
+                  txtpos += 2;
+                }
+              }
+              if (ble_adptr + width > ble_adbuf + sizeof(ble_adbuf))
               {
                 SET_ERR_LINE;
                 goto qtoobig;
               }
-              for (ch = sizeof(variable_frame); ch < frame->header.frame_size; ch++)
+              for (i = 0; ble_adfields[i].var; i++)
+              {
+                if (i == BLE_ADFIELDS - 1)
+                {
+                  SET_ERR_LINE;
+                  goto qtoobig;
+                }
+              }
+              ble_adfields[i].var = ch;
+              ble_adfields[i].offset = (ble_adptr - ble_adbuf) | (ble_isadvert ? 0 : BLE_ADFIELD_SCANRSP);
+              ble_adfields[i].width = width;
+              for (; width; width--)
               {
                 *ble_adptr++ = *ptr++;
               }
@@ -3502,6 +5121,7 @@ ble_advert:
           ble_adptr = NULL;
           GOTO_QWHAT;
         }
+        ble_adlen[!ble_isadvert] = ble_adptr - ble_adbuf;
         if (ble_isadvert)
         {
           uint8 advert = TRUE;
@@ -3580,14 +5200,14 @@ cmd_btpoke:
       param = _GAPROLE(param);
       variable_frame* vframe;
       ptr = get_variable_frame(*txtpos, &vframe);
-      if (vframe->type != VAR_DIM_BYTE)
+      if (!VARIABLE_IS_DIM(vframe))
       {
         GOTO_QWHAT;
       }
       if (param >= _GAPROLE(BLE_PAIRING_MODE) && param <= _GAPROLE(BLE_ERASE_SINGLEBOND))
       {
 #if GAP_BOND_MGR       
-        if (GAPBondMgr_SetParameter(param, vframe->header.frame_size - sizeof(variable_frame), ptr) != SUCCESS)
+        if (GAPBondMgr_SetParameter(param, VARIABLE_DIM_SIZE(vframe), ptr) != SUCCESS)
         {
           GOTO_QWHAT;
         }
@@ -3595,7 +5215,7 @@ cmd_btpoke:
         GOTO_QWHAT;
 #endif
       }
-      else if (GAPRole_SetParameter(param, vframe->header.frame_size - sizeof(variable_frame), ptr) != SUCCESS)
+      else if (GAPRole_SetParameter(param, VARIABLE_DIM_SIZE(vframe), ptr) != SUCCESS)
       {
         GOTO_QWHAT;
       }
@@ -3719,6 +5339,7 @@ cmd_open:
         file->action = 'W';
         unsigned short record = file->record;
         file->record = 0;
+        // Only whether each record is there matters, so the copy a find may return isn't kept
         for (unsigned long special = FS_MAKE_FILE_SPECIAL(file->filename, 0); flashstore_findspecial(special); special++, file->record++)
         {
           if (hasOffset && (unsigned short) (special & 0xffff) >= record)
@@ -3829,9 +5450,13 @@ cmd_read:
           {
             *(VAR_TYPE*)ptr = OS_serial_read(port);
           }
-          else if (vframe->type == VAR_DIM_BYTE)
+          else
           {
-            *ptr = OS_serial_read(port);
+            unsigned char alen = VARIABLE_DIM_WIDTH(vframe);
+            for (; alen; alen--)
+            {
+              *ptr++ = OS_serial_read(port);
+            }
           }
         }
         else if (vframe)
@@ -3839,8 +5464,8 @@ cmd_read:
           // No address, but we have a vframe - this is a full array
           if (error_num == ERROR_EXPRESSION)
             error_num = ERROR_OK; // clear parsing error due to missing index braces
-          unsigned char alen = vframe->header.frame_size - sizeof(variable_frame);
-          for (ptr = (unsigned char*)vframe + sizeof(variable_frame); alen; alen--)
+          unsigned short alen = VARIABLE_DIM_SIZE(vframe);
+          for (ptr = VARIABLE_DIM_DATA(vframe); alen; alen--)
           {
             *ptr++ = OS_serial_read(port);
           }
@@ -3881,7 +5506,11 @@ cmd_read:
           }
           else
           {
-            *ptr = OS_i2c_read(0);
+            unsigned char alen = VARIABLE_DIM_WIDTH(vframe);
+            for (; alen; alen--)
+            {
+              *ptr++ = OS_i2c_read(0);
+            }
           }
         }
         else if (vframe)
@@ -3889,8 +5518,8 @@ cmd_read:
           // No address, but we have a vframe - this is a full array
           if (error_num == ERROR_EXPRESSION)
             error_num = ERROR_OK; // clear parsing error due to missing index braces
-          unsigned char alen = vframe->header.frame_size - sizeof(variable_frame);
-          for (ptr = (unsigned char*)vframe + sizeof(variable_frame); alen; alen--)
+          unsigned short alen = VARIABLE_DIM_SIZE(vframe);
+          for (ptr = VARIABLE_DIM_DATA(vframe); alen; alen--)
           {
             *ptr++ = OS_i2c_read(0);
           }
@@ -3915,6 +5544,8 @@ cmd_read:
       if (file->filename >= 'A')
 #endif        
       {
+        // A file record may be a copy good only until the next find, so it is found again
+        // after each variable is parsed
         unsigned char* special = flashstore_findspecial(FS_MAKE_FILE_SPECIAL(file->filename, file->record));
         if (!special)
         {
@@ -3939,6 +5570,15 @@ cmd_read:
           unsigned char* ptr = parse_variable_address(&vframe);
           if (ptr)
           {
+#ifdef FEATURE_FILESTORE
+            // The record is a copy, which an EOF() in the index may have replaced
+            special = flashstore_findspecial(FS_MAKE_FILE_SPECIAL(file->filename, file->record));
+            if (!special)
+            {
+              SET_ERR_LINE;
+              goto qeof;
+            }
+#endif
             if (file->poffset == len)
             {
               file->record = (file->record + 1) % file->modulo;
@@ -3951,14 +5591,20 @@ cmd_read:
               file->poffset = FLASHSPECIAL_DATA_OFFSET;
               len = special[FLASHSPECIAL_DATA_LEN];
             }
-            if (vframe->type == VAR_DIM_BYTE)
+            if (vframe->type == VAR_INT)
             {
-              *ptr = special[file->poffset++];
+              // A record holding fewer bytes, such as those WRITE gives constants, is zero extended
+              unsigned char vlen = (len - file->poffset < sizeof(VAR_TYPE) ? len - file->poffset : sizeof(VAR_TYPE));
+              *(VAR_TYPE*)ptr = 0;
+              OS_memcpy(ptr, special + file->poffset, vlen);
+              file->poffset += vlen;
             }
-            else if (vframe->type == VAR_INT)
+            else
             {
-              *(VAR_TYPE*)ptr = *(VAR_TYPE*)(special+file->poffset);
-              file->poffset += sizeof(VAR_TYPE);
+              // Array elements are stored in the array's own byte order
+              unsigned char alen = VARIABLE_DIM_WIDTH(vframe);
+              OS_memcpy(ptr, special + file->poffset, alen);
+              file->poffset += alen;
             }
           }
           else if (vframe)
@@ -3966,8 +5612,8 @@ cmd_read:
             // No address, but we have a vframe - this is a full array
             if (error_num == ERROR_EXPRESSION)
               error_num = ERROR_OK; // clear parsing error due to missing index braces
-            unsigned char alen = vframe->header.frame_size - sizeof(variable_frame);
-            ptr = (unsigned char*)vframe + sizeof(variable_frame);
+            unsigned short alen = VARIABLE_DIM_SIZE(vframe);
+            ptr = VARIABLE_DIM_DATA(vframe);
             while (alen)
             {
               if (file->poffset == len)
@@ -4033,13 +5679,13 @@ cmd_read:
           if (ptr)
           {
             unsigned char v = item[file->poffset++];
-            if (vframe->type == VAR_DIM_BYTE)
+            if (vframe->type == VAR_INT)
             {
-              *ptr = v;
+              *(VAR_TYPE*)ptr = v;
             }
-            else if (vframe->type == VAR_INT)
+            else
             {
-              *(VAR_TYPE*)ptr = v;
+              variable_dim_set(vframe, ptr, v);
             }
           }
           else if (vframe)
@@ -4047,8 +5693,8 @@ cmd_read:
             // No address, but we have a vframe - this is a full array
             if (error_num == ERROR_EXPRESSION)
               error_num = ERROR_OK; // clear parsing error due to missing index braces
-            unsigned char alen = vframe->header.frame_size - sizeof(variable_frame);
-            ptr = (unsigned char*)vframe + sizeof(variable_frame);
+            unsigned short alen = VARIABLE_DIM_SIZE(vframe);
+            ptr = VARIABLE_DIM_DATA(vframe);
             while (alen)
             {
               if (file->poffset >= len)
@@ -4120,19 +5766,9 @@ cmd_write:
         }
         variable_frame* vframe = NULL;
         unsigned char* ptr = parse_variable_address(&vframe);
-        if (ptr)
+        if (ptr && vframe->type == VAR_INT)
         {
-          unsigned char send_byte;
-          if (vframe->type == VAR_DIM_BYTE)
-          {
-            send_byte = *ptr;
-//            OS_serial_write(port, *ptr) == 0);
-          }
-          else
-          {
-            send_byte = *(VAR_TYPE*)ptr;
-            //OS_serial_write(port, *(VAR_TYPE*)ptr);
-          }
+          unsigned char send_byte = *(VAR_TYPE*)ptr;
           while (!OS_serial_write(port, send_byte))
           {
             // keep OSAL spinning
@@ -4141,12 +5777,20 @@ cmd_write:
         }
         else if (vframe)
         {
-          // No address, but we have a vframe - this is a full array
+          // An array element is sent as all its bytes, no address means the full array
           if (error_num == ERROR_EXPRESSION)
             error_num = ERROR_OK; // clear parsing error due to missing index braces
-          unsigned char alen;
-          ptr = (unsigned char*)vframe + sizeof(variable_frame);
-          for (alen = vframe->header.frame_size - sizeof(variable_frame); alen; alen--)
+          unsigned short alen;
+          if (ptr)
+          {
+            alen = VARIABLE_DIM_WIDTH(vframe);
+          }
+          else
+          {
+            ptr = VARIABLE_DIM_DATA(vframe);
+            alen = VARIABLE_DIM_SIZE(vframe);
+          }
+          for (; alen; alen--)
           {
             for ( ; OS_serial_write(port, *ptr) == 0 ; )
             {
@@ -4230,15 +5874,17 @@ cmd_write:
           unsigned char* ptr = parse_variable_address(&vframe);
           if (ptr)
           {
-            if (vframe->type == VAR_DIM_BYTE)
+            if (vframe->type == VAR_INT)
             {
-              CHECK_HEAP_OOM(1, qhoom);
-              *iptr = *ptr;
+              CHECK_HEAP_OOM(sizeof(VAR_TYPE), qhoom);
+              *(VAR_TYPE*)iptr = *(VAR_TYPE*)ptr;
             }
             else
             {
-              CHECK_HEAP_OOM(sizeof(VAR_TYPE), qhoom);
-              *(VAR_TYPE*)iptr = *(VAR_TYPE*)ptr;
+              // Array elements are stored in the array's own byte order
+              unsigned char alen = VARIABLE_DIM_WIDTH(vframe);
+              CHECK_HEAP_OOM(alen, qhoom);
+              OS_memcpy(iptr, ptr, alen);
             }
           }
           else if (vframe)
@@ -4246,9 +5892,9 @@ cmd_write:
             // No address, but we have a vframe - this is a full array
             if (error_num == ERROR_EXPRESSION)
               error_num = ERROR_OK; // clear parsing error due to missing index braces
-            unsigned char alen = vframe->header.frame_size - sizeof(variable_frame);
+            unsigned short alen = VARIABLE_DIM_SIZE(vframe);
             CHECK_HEAP_OOM(alen, qhoom);
-            OS_memcpy(iptr, ((unsigned char*)vframe) + sizeof(variable_frame), alen);
+            OS_memcpy(iptr, VARIABLE_DIM_DATA(vframe), alen);
           }
           else
           {
@@ -4311,13 +5957,13 @@ qhoom:
           if (ptr)
           {
             CHECK_HEAP_OOM(1, qhoom2);
-            if (vframe->type == VAR_DIM_BYTE)
+            if (vframe->type == VAR_INT)
             {
-              *iptr = *ptr;
+              *iptr = *(VAR_TYPE*)ptr;
             }
             else
             {
-              *iptr = *(VAR_TYPE*)ptr;
+              *iptr = variable_dim_get(vframe, ptr);
             }
           }
           else if (vframe)
@@ -4325,9 +5971,9 @@ qhoom:
             // No address, but we have a vframe - this is a full array
             if (error_num == ERROR_EXPRESSION)
               error_num = ERROR_OK; // clear parsing error due to missing index braces
-            unsigned char alen = vframe->header.frame_size - sizeof(variable_frame);
+            unsigned short alen = VARIABLE_DIM_SIZE(vframe);
             CHECK_HEAP_OOM(alen, qhoom2);
-            OS_memcpy(iptr, ((unsigned char*)vframe) + sizeof(variable_frame), alen);
+            OS_memcpy(iptr, VARIABLE_DIM_DATA(vframe), alen);
           }
           else
           {
@@ -4373,7 +6019,10 @@ qhoom2:
 //
 // SPI MASTER <port 0|1|2|3>, <mode 0|1|2|3>, LSB|MSB <speed> [, wordsize]
 //  or
-// SPI TRANSFER Px(y) <array>
+// SPI TRANSFER Px(y) <array> [GOSUB <linenum>]
+//  note: Without a wordsize the array is moved by DMA. With GOSUB the program carries on
+//  and the subroutine runs once the transfer is done, so the array must not be one that
+//  a RETURN or NEXT would drop.
 //
 cmd_spi:
   {
@@ -4496,16 +6145,52 @@ cmd_spi:
         GOTO_QWHAT;
       }
       ptr = get_variable_frame(ch, &vframe);
-      if (vframe->type != VAR_DIM_BYTE)
+      if (!VARIABLE_IS_DIM(vframe))
       {
         GOTO_QWHAT;
       }
       txtpos++;
+      unsigned short len = VARIABLE_DIM_SIZE(vframe);
+      unsigned short pos = 0;
+
+#if OS_SPI_DMA
+#if OS_ADC_SCAN
+      if (spiWordsize == 255 && !adcScan.buffer)
+#else
+      if (spiWordsize == 255)
+#endif
+      {
+        unsigned short line = 0;
+        if (*txtpos == KW_GOSUB)
+        {
+          txtpos++;
+          line = expression(EXPR_NORMAL);
+          if (error_num || !line)
+          {
+            GOTO_QWHAT;
+          }
+        }
+        if (*txtpos != NL || spiDma.line || spiDma.done || (line && dim_is_scoped(ptr)))
+        {
+          GOTO_QWHAT;
+        }
+        pin_wire(pin + 1, pin + 2);
+        OS_spi_dma(spiChannel, ptr, len);
+        if (line)
+        {
+          spiDma.pin = pin[0];
+          spiDma.line = line;
+          goto run_next_statement;
+        }
+        while (OS_spi_dma_busy)
+          ;
+        pin_wire(pin, pin + 1);
+        goto run_next_statement;
+      }
+#endif
 
       // .. transfer ..
       pin_wire(pin + 1, pin + 2);
-      unsigned short len = vframe->header.frame_size - sizeof(variable_frame);
-      unsigned short pos = 0;
       if (spiChannel == 0)
       {
         for (;;)
@@ -4553,6 +6238,12 @@ cmd_spi:
         }
       }
       pin_wire(pin, pin + 1);
+      if (*txtpos == KW_GOSUB)
+      {
+        // Done already, so call it now
+        txtpos++;
+        goto cmd_gosub;
+      }
     }
     else
     {
@@ -4564,20 +6255,25 @@ cmd_spi:
   
 #if HAL_I2C  
 //
-// I2C MASTER <scl pin> <sda pin> [PULLUP]
+// I2C MASTER [<scl pin> <sda pin> [PULLUP]]
 //  or
 // I2C WRITE <addr>, <data, ...> [, READ <variable>|<array>]
 //  or
 // I2C READ <addr>, <variable>|<array>, ...
-//  note: The CC2541 has i2c hardware which we are not yet using.
+//  note: Without pins the master uses the CC2541 i2c hardware with fixed pins. An array
+//  is read in one burst, and a READ after WRITE follows a repeated start, so registers
+//  can be read from a register address.
 // or
 // I2C SLAVE <addr> [ONREAD GOSUB <linenum>] [ONWRITE GOSUB <linenum>]
-//  note: this uses the CC2541 i2c hardware with fixed pins
+//  note: this uses the CC2541 i2c hardware with fixed pins, which can also be the master
 cmd_i2c:
   switch (*txtpos++)
   {
     case SPI_MASTER:
 #if HAL_I2C_SLAVE
+    ignore_blanks();
+    i2cHardware = (*txtpos == NL);
+    if (!i2cHardware)
     {
       unsigned char pullup = 0;
       unsigned char* ptr = heap;
@@ -4609,12 +6305,9 @@ cmd_i2c:
       pin_wire(heap, ptr);
       break;
     }
-#else  // HAL_I2C_SLAVE
-    {
-        OS_I2C_INIT;
-        break;
-    }
 #endif  // HAL_I2C_SLAVE
+    OS_I2C_INIT;
+    break;
     
 #if HAL_I2C_SLAVE    
   case SPI_SLAVE:
@@ -4661,6 +6354,7 @@ cmd_i2c:
     case KW_WRITE:
     case KW_READ:
 #if HAL_I2C_SLAVE      
+    if (!i2cHardware)
     {
       unsigned char* rdata = NULL;
       unsigned char* data;
@@ -4754,9 +6448,15 @@ cmd_i2c:
       }
       txtpos++;
       rdata = get_variable_frame(i, &vframe);
-      if (vframe->type == VAR_DIM_BYTE)
+      if (VARIABLE_IS_DIM(vframe))
       {
-        len = vframe->header.frame_size - sizeof(variable_frame);
+        // A read is counted in a byte
+        if (VARIABLE_DIM_SIZE(vframe) > 255)
+        {
+          SET_ERR_LINE;
+          goto qtoobig;
+        }
+        len = VARIABLE_DIM_SIZE(vframe);
         OS_memset(rdata, 0, len);
       }
       else
@@ -4834,76 +6534,81 @@ i2c_end:
       }
       break;
     }
-#else // HAL_I2C_SLAVE
+#endif // HAL_I2C_SLAVE
     {
-    // hardware master read/write
-    // ... tbd
-      
-      // INA 226 Slave address 
-      // A1 / A0
-      // GND / GND : 1000000
+      // Hardware master: write, then read after a repeated start
       unsigned char* rdata = NULL;
       unsigned char len = 0;
-      unsigned char i = 0;
+      unsigned char rlen = 0;
       unsigned char* ptr = heap;
       unsigned char rnw = (txtpos[-1] == KW_READ ? 1 : 0);
-      
-      // Encode data we want to write
+
+      // Encode data we want to write, the address first
       for (;;)
       {
-        unsigned char d;
         if (*txtpos == NL)
         {
           break;
         }
+        else if (*txtpos == KW_READ)
+        {
+          txtpos++;
+          if (rnw || !len)
+          {
+            GOTO_QWHAT;
+          }
+          rnw = 1;
+        }
         else
         {
-          d = expression(EXPR_COMMA);
+          *ptr++ = expression(EXPR_COMMA);
           if (error_num)
           {
             GOTO_QWHAT;
           }
-          *ptr++ = d;
           len++;
-        }        
+        }
         // If this is a read we have no more to write, so we go and read instead.
-        if (rnw)
+        if (rnw && len)
         {
           break;
         }
       }
-      // if write we call the write command
-      if (!rnw)
-      {
-        if (len > 0)
-        {
-          OS_I2C_WRITE(heap[0], len - 1, heap + 1);
-        }
-        break;
-      }
-
-      variable_frame* vframe;
-      ignore_blanks();
-      i = *txtpos;
-      if (i < 'A' || i > 'Z')
+      if (!len)
       {
         GOTO_QWHAT;
       }
-      txtpos++;
-      rdata = get_variable_frame(i, &vframe);
-      if (vframe->type == VAR_DIM_BYTE)
-      {
-        len = vframe->header.frame_size - sizeof(variable_frame);
-      }
-      else
+      if (rnw)
       {
-        len = 1;
-        *(VAR_TYPE*)rdata = 0;
+        // Read straight into the variable or array
+        variable_frame* vframe;
+        ignore_blanks();
+        unsigned char i = *txtpos;
+        if (i < 'A' || i > 'Z')
+        {
+          GOTO_QWHAT;
+        }
+        txtpos++;
+        rdata = get_variable_frame(i, &vframe);
+        if (VARIABLE_IS_DIM(vframe))
+        {
+          // A read is counted in a byte
+          if (VARIABLE_DIM_SIZE(vframe) > 255)
+          {
+            SET_ERR_LINE;
+            goto qtoobig;
+          }
+          rlen = VARIABLE_DIM_SIZE(vframe);
+        }
+        else
+        {
+          rlen = 1;
+          *(VAR_TYPE*)rdata = 0;
+        }
       }
-      OS_I2C_READ(heap[0], len, rdata);
-      break;    
+      OS_I2C_TRANSFER(heap[0], len - 1, heap + 1, rlen, rdata);
+      break;
     }
-#endif // HAL_I2C_SLAVE    
     default:
       txtpos--;
       GOTO_QWHAT;
@@ -4920,12 +6625,25 @@ i2c_end:
 //  Set the number of bits returned from an ADC operation.
 // ANALOG REFERENCE, INTERNAL|EXTERNAL
 // ANALOG STOP
-//  Stop timer based sampling
+//  Stop timer based sampling and scanning
+// ANALOG SCAN port map, rate, decimate
+//  Convert the P0 pins in the map rate times a second (4..1000) by ADC sequence and DMA,
+//  and reduce each run of decimate (1..32) samples to its mean, min, max and RMS.
+//  Reading a scanned pin gives its latest mean. The samples take 4 x pins x decimate bytes
+//  of program memory, counting up to the highest pin in the map.
+// ANALOG READ <array>
+//  Copy the mean, min, max and RMS of each scanned pin, lowest pin first, into the array
 // ANALOG TRUE, 0|1
 //  in timer based sampling select processing
 //  0: averaging
 //  1: True RMS
-// ANALOG TIMER id, timeout, port map ,strobe port, strobe polarity LOW|HIGH, duty
+// ANALOG POWER, voltage channel, current channel, window, mV full scale, mA full scale
+//  Multiply voltage and current on each timer based sample and count energy and charge
+//  every window (1..255) samples. Channels are ADC inputs: 0..7 for AIN0..7, 8..11 for
+//  the differential pairs AIN0-1 to AIN6-7.
+// ANALOG POWER, <array>
+//  Copy mV, mA and mW of the last window, then mWh in, mWh out, mAh in and mAh out
+// ANALOG TIMER id, timeout, port map ,strobe port, strobe polarity LOW|HIGH, duty [, length ...]
 //  Background adc sampling via timer with strobe and delay
 //  id: timer id to use as time base (TIMER id, periode)
 //  timeout: timer period in ms
@@ -4934,6 +6652,8 @@ i2c_end:
 //  strobe port: use P0(x) as strobe signal for sampling
 //  strobe polarity: LOW, HIGH, 0, or 1
 //  strobe duty: duty active in ms (1..timeout)
+//  length: samples averaged for each pin in the map, lowest pin first (1..255, default 8).
+//    The last length given is used for the remaining pins. True RMS takes at most 32.
 cmd_analog:
   switch (*txtpos)
   {
@@ -4945,10 +6665,86 @@ cmd_analog:
     case TI_STOP:
       txtpos++;
       sampling.map = 0;
+      sampling.power = 0;
+      sampling.active = 0;
+#if OS_ADC_SCAN
+      adc_scan_stop();
+#endif
+      break;
+#if OS_ADC_SCAN
+    case KW_SCAN:
+      {
+        txtpos++;
+        const unsigned char map = expression(EXPR_COMMA);
+        const VAR_TYPE rate = expression(EXPR_COMMA);
+        const VAR_TYPE decimate = expression(EXPR_NORMAL);
+        if (error_num || !map || rate < 4 || rate > 1000 || decimate < 1 || decimate > 32)
+        {
+          GOTO_QWHAT;
+        }
+        adc_scan_stop();
+#if OS_SPI_DMA
+        // We need its DMA channel
+        while (OS_spi_dma_busy)
+          ;
+#endif
+        unsigned char channels = 8;
+        while (!(map & (1 << (channels - 1))))
+        {
+          channels--;
+        }
+        const unsigned short len = channels * (unsigned char)decimate;
+        const unsigned short size = 2 * len * sizeof(short);
+        if (!adcScanFrame || adcScanFrame->frame_size < sizeof(frame_header) + size)
+        {
+          frame_header* frame = (frame_header*)heap;
+          CHECK_HEAP_OOM(sizeof(frame_header) + size, qoom);
+          frame->frame_type = FRAME_SCAN_FLAG;
+          frame->frame_size = sizeof(frame_header) + size;
+          adcScanFrame = frame;
+        }
+        adcScan.buffer = (short*)(adcScanFrame + 1);
+        OS_memset(adcScan.snapshot, 0, sizeof(adcScan.snapshot));
+        adcScan.map = map;
+        adcScan.channels = channels;
+        adcScan.decimate = decimate;
+        APCFG |= map;
+        OS_adc_scan_start(analogReference | analogResolution | (channels - 1), 250000 / rate, adcScan.buffer, len);
+      }
       break;
+    case KW_READ:
+      {
+        txtpos++;
+        variable_frame* vframe;
+        unsigned char* ptr = parse_array_address(&vframe);
+        if (!ptr || *txtpos != NL)
+        {
+          GOTO_QWHAT;
+        }
+        const unsigned char width = VARIABLE_DIM_WIDTH(vframe);
+        unsigned char* end = VARIABLE_DIM_DATA(vframe) + VARIABLE_DIM_SIZE(vframe);
+        for (unsigned char ch = 0; ch < 8; ch++)
+        {
+          if (adcScan.map & (1 << ch))
+          {
+            if (ptr + 4 * width > end)
+            {
+              GOTO_QWHAT;
+            }
+            variable_dim_set(vframe, ptr, adcScan.snapshot[ch].mean);
+            variable_dim_set(vframe, ptr + width, adcScan.snapshot[ch].min);
+            variable_dim_set(vframe, ptr + 2 * width, adcScan.snapshot[ch].max);
+            variable_dim_set(vframe, ptr + 3 * width, adcScan.snapshot[ch].rms);
+            ptr += 4 * width;
+          }
+        }
+      }
+      break;
+#endif
     case KW_TIMER:
       {
         txtpos++;
+        sampling.active = 0;
         sampling.timer = (unsigned short) expression(EXPR_COMMA);
         sampling.timeout = (unsigned short) expression(EXPR_COMMA);
         unsigned char map = (unsigned char) expression(EXPR_COMMA);
@@ -4972,11 +6768,78 @@ cmd_analog:
         default:
           GOTO_QWHAT;
         }
-        sampling.duty = (unsigned short) expression(EXPR_NORMAL);
+        sampling.duty = (unsigned short) expression(EXPR_COMMA);
         if (error_num || sampling.duty < 1 || sampling.duty >= sampling.timeout)
           GOTO_QWHAT;
+
+        // Window lengths, then the space they need
+        sampling.map = 0;
+        unsigned char lengths[8];
+        unsigned char length = 8;
+        unsigned short size = 0;
+        for (unsigned char i = 0; i < 8; i++)
+        {
+          lengths[i] = 0;
+          if (map & (1 << i))
+          {
+            if (txtpos[-1] == ',')
+            {
+              const VAR_TYPE l = expression(EXPR_COMMA);
+              if (error_num || l < 1 || l > 255)
+              {
+                GOTO_QWHAT;
+              }
+              length = l;
+            }
+            lengths[i] = length;
+          }
+        }
+        if (txtpos[-1] == ',')
+        {
+          GOTO_QWHAT;
+        }
+        if (map & 0xc0)
+        {
+          // One stream, kept in the first window, at the length of the lowest pin
+          unsigned char i = 0;
+          while (!lengths[i])
+          {
+            i++;
+          }
+          length = lengths[i];
+          OS_memset(lengths, 0, sizeof(lengths));
+          lengths[0] = length;
+#ifdef FEATURE_TRUE_RMS
+          if (sampling.mode == 1 && length > 32)
+          {
+            GOTO_QWHAT;
+          }
+#endif
+        }
+        for (unsigned char i = 0; i < 8; i++)
+        {
+          size += lengths[i] * sizeof(*sampling.window[i].samples);
+        }
+        if (size && (!samplingFrame || samplingFrame->frame_size < sizeof(frame_header) + size))
+        {
+          frame_header* frame = (frame_header*)heap;
+          CHECK_HEAP_OOM(sizeof(frame_header) + size, qoom);
+          frame->frame_type = FRAME_SAMPLING_FLAG;
+          frame->frame_size = sizeof(frame_header) + size;
+          samplingFrame = frame;
+        }
+        unsigned char* ptr = size ? (unsigned char*)(samplingFrame + 1) : NULL;
+        for (unsigned char i = 0; i < 8; i++)
+        {
+          sampling.window[i].samples = (void*)ptr;
+          sampling.window[i].length = lengths[i];
+          ptr += lengths[i] * sizeof(*sampling.window[i].samples);
+        }
+        sampling_reset();
+
         sampling.map = map;
         P0DIR |= sampling.pin; // set output mode   
+        sampling.active = 1;
         OS_timer_start(sampling.timer, sampling.timeout, 1, 0);
       }
       break;
@@ -5022,30 +6885,73 @@ cmd_analog:
 #if defined(FEATURE_TRUE_RMS)
       case CO_TRUE:
         {
-          sampling.mode = expression(EXPR_NORMAL);
-          if (error_num)
+          const VAR_TYPE mode = expression(EXPR_NORMAL);
+          if (error_num || (mode == 1 && (sampling.map & 0xc0) && sampling.window[0].length > 32))
             GOTO_QWHAT;
-          OS_memset(sampling.adc, 0, sizeof(sampling.adc));
+          sampling.mode = mode;
+          sampling_reset();
         }
         break;
 #endif
-      default:
-        GOTO_QWHAT;
-    }
-  }
-  goto run_next_statement;
-
-cmd_config:
-  switch (*txtpos)
-  {
-    case FUNC_MILLIS:
-    {
-      if (txtpos[1] != ',')
-      {
-        GOTO_QWHAT;
-      }
-      txtpos += 2;
-      VAR_TYPE time = expression(EXPR_NORMAL);
+#ifdef FEATURE_SAMPLING
+      case CO_POWER:
+        {
+          variable_frame* vframe;
+          unsigned char* start = txtpos;
+          unsigned char* ptr = parse_array_address(&vframe);
+          if (ptr)
+          {
+            if (*txtpos != NL || ptr + 7 * VARIABLE_DIM_WIDTH(vframe) > VARIABLE_DIM_DATA(vframe) + VARIABLE_DIM_SIZE(vframe))
+            {
+              GOTO_QWHAT;
+            }
+            const int32 values[7] = { power.mv, power.ma, power.mw, power.mwh[0], power.mwh[1], power.mah[0], power.mah[1] };
+            for (unsigned char i = 0; i < 7; i++, ptr += VARIABLE_DIM_WIDTH(vframe))
+            {
+              variable_dim_set(vframe, ptr, values[i]);
+            }
+            break;
+          }
+          txtpos = start;
+          const VAR_TYPE vchannel = expression(EXPR_COMMA);
+          const VAR_TYPE ichannel = expression(EXPR_COMMA);
+          const VAR_TYPE window = expression(EXPR_COMMA);
+          const VAR_TYPE vscale = expression(EXPR_COMMA);
+          const VAR_TYPE iscale = expression(EXPR_NORMAL);
+          if (error_num || vchannel < 0 || vchannel > 11 || ichannel < 0 || ichannel > 11 ||
+              window < 1 || window > 255 || vscale < 1 || vscale > 65535 || iscale < 1 || iscale > 65535)
+          {
+            GOTO_QWHAT;
+          }
+          sampling.power = 0;
+          OS_memset(&power, 0, sizeof(power));
+          power.vchannel = vchannel;
+          power.ichannel = ichannel;
+          power.window = window;
+          power.vscale = vscale;
+          power.iscale = iscale;
+          APCFG |= (vchannel < 8 ? 1 << vchannel : 3 << (2 * vchannel - 16)) | (ichannel < 8 ? 1 << ichannel : 3 << (2 * ichannel - 16));
+          sampling.power = 1;
+        }
+        break;
+#endif
+      default:
+        GOTO_QWHAT;
+    }
+  }
+  goto run_next_statement;
+
+cmd_config:
+  switch (*txtpos)
+  {
+    case FUNC_MILLIS:
+    {
+      if (txtpos[1] != ',')
+      {
+        GOTO_QWHAT;
+      }
+      txtpos += 2;
+      VAR_TYPE time = expression(EXPR_NORMAL);
       if (error_num)
       {
         GOTO_QWHAT;
@@ -5260,6 +7166,9 @@ static int16 adc_read(unsigned char minor)
   HAL_ENTER_CRITICAL_SECTION(intState);
   ADCCON3 = minor | analogResolution | analogReference;
 #ifdef SIMULATE_PINS
+  val = OS_adc_sample(minor);
+  ADCL = val;
+  ADCH = val >> 8;
   ADCCON1 = 0x80;
 #endif
   while ((ADCCON1 & 0x80) == 0)
@@ -5271,6 +7180,36 @@ static int16 adc_read(unsigned char minor)
 }
 
 
+#if OS_ADC_SCAN || defined(FEATURE_TRUE_RMS)
+//
+// Integer square root, bit by bit.
+//
+static unsigned short isqrt(unsigned long val)
+{
+  unsigned long bit = 1UL << 30;
+  unsigned long root = 0;
+
+  while (bit > val)
+  {
+    bit >>= 2;
+  }
+  while (bit)
+  {
+    if (val >= root + bit)
+    {
+      val -= root + bit;
+      root = (root >> 1) + bit;
+    }
+    else
+    {
+      root >>= 1;
+    }
+    bit >>= 2;
+  }
+  return root;
+}
+#endif
+
 //
 // Read pin
 //
@@ -5281,30 +7220,31 @@ static VAR_TYPE pin_read(unsigned char major, unsigned char minor)
     case 0:
       if (APCFG & (1 << minor))
       {
+#if OS_ADC_SCAN
+        if (adcScan.map & (1 << minor))
+        {
+          return adcScan.snapshot[minor].mean;
+        }
+#endif
 #ifdef FEATURE_SAMPLING  
         if (sampling.map & (1 << minor))
         {
+          // Both scaled as they were when the window was always 8 samples
           if (sampling.map & 0xc0)
           {
-            int32 val;
-            val = sampling.adc[0];   
-            val += sampling.adc[1];  
-            val += sampling.adc[2];  
-            val += sampling.adc[3];
-            val += sampling.adc[4];
-            val += sampling.adc[5];
-            val += sampling.adc[6];
-            val += sampling.adc[7];
+            int32 val = sampling.window[0].sum;
 #ifdef FEATURE_TRUE_RMS
+            // The mean of squares of 14 bits is at most 26 bits, so 64 times it still fits
             if (sampling.mode == 1)
-              val = (int32)sqrt((val > 0 ? 8.0 : -8.0) * val) * (val > 0 ? 1 : -1);
-            else
+            {
+              val /= sampling.window[0].length;
+              return val < 0 ? -(int32)isqrt((uint32)-val * 64) : isqrt((uint32)val * 64);
+            }
 #endif
-              // sampling_mode == 2 for averaging
-              val /= 4;
-            return val;
+            // sampling_mode == 2 for averaging
+            return val * 2 / sampling.window[0].length;
           }
-          return sampling.adc[minor];
+          return sampling.window[minor].sum / sampling.window[minor].length;
         }
 #endif  
         return adc_read(minor) >> (8 - (analogResolution >> 3));
@@ -5318,9 +7258,104 @@ static VAR_TYPE pin_read(unsigned char major, unsigned char minor)
 }
 
 #ifdef FEATURE_SAMPLING
+#define MS_PER_HOUR 3600000UL
+
+//
+// Add value x ms to a total counted in value x hours, keeping what is left over in frac.
+// The product would not fit in 32 bits, so ms goes in a byte at a time.
+//
+static void power_integrate(uint32* total, uint32* frac, uint32 value, uint32 ms)
+{
+  uint32 hours = 0;
+  uint32 rest = 0;
+
+  *total += (value / MS_PER_HOUR) * ms;
+  value %= MS_PER_HOUR;
+  for (signed char shift = 16; shift >= 0; shift -= 8)
+  {
+    rest = (rest << 8) + value * (unsigned char)(ms >> shift);
+    hours = (hours << 8) + rest / MS_PER_HOUR;
+    rest %= MS_PER_HOUR;
+  }
+  rest += *frac;
+  *total += hours + rest / MS_PER_HOUR;
+  *frac = rest % MS_PER_HOUR;
+}
+
+//
+// Sample voltage and current for ANALOG POWER. Each window's means are kept for reading,
+// and its energy and charge are counted by the direction they flow.
+//
+static void power_sample(void)
+{
+  // 14 bit samples times a 16 bit scale fit in 30 bits. Divided, not shifted, so
+  // negative readings round towards zero like positive ones.
+  const int32 mv = ((int32)(adc_read(power.vchannel) >> 2) * power.vscale) / 8192;
+  const int32 ma = ((int32)(adc_read(power.ichannel) >> 2) * power.iscale) / 8192;
+
+  power.vsum += mv;
+  power.isum += ma;
+  power.psum += mv * (ma / 1000) + mv * (ma % 1000) / 1000;
+  if (++power.count < power.window)
+  {
+    return;
+  }
+  power.mv = power.vsum / power.window;
+  power.ma = power.isum / power.window;
+  power.mw = power.psum / power.window;
+  power.count = 0;
+  power.vsum = 0;
+  power.isum = 0;
+  power.psum = 0;
+
+  const uint32 ms = (uint32)power.window * sampling.timeout;
+  if (power.mw < 0)
+  {
+    power_integrate(&power.mwh[1], &power.frac[1], -power.mw, ms);
+  }
+  else
+  {
+    power_integrate(&power.mwh[0], &power.frac[0], power.mw, ms);
+  }
+  if (power.ma < 0)
+  {
+    power_integrate(&power.mah[1], &power.frac[3], -power.ma, ms);
+  }
+  else
+  {
+    power_integrate(&power.mah[0], &power.frac[2], power.ma, ms);
+  }
+}
+
+//
+// Clear the sampling windows.
+//
+static void sampling_reset(void)
+{
+  for (unsigned char i = 0; i < 8; i++)
+  {
+    os_sampling_window_t* window = &sampling.window[i];
+    OS_memset(window->samples, 0, window->length * sizeof(*window->samples));
+    window->sum = 0;
+    window->next = 0;
+  }
+}
+
+//
+// Replace the oldest sample in a window, keeping its sum.
+//
+static void sampling_add(os_sampling_window_t* window, int32 val)
+{
+  window->sum += val - window->samples[window->next];
+  window->samples[window->next] = val;
+  if (++window->next == window->length)
+  {
+    window->next = 0;
+  }
+}
+
 void interpreter_sampling(void)
 {
-  static uint8 samplingCnt;
   uint16 next;
     
   if ( ((P0 & sampling.pin) > 0) != sampling.polarity ) 
@@ -5352,11 +7387,11 @@ void interpreter_sampling(void)
       {
         a += 3;
         a /= 4;  // make it 14 bit
-        sampling.adc[7 & samplingCnt++] = (long)a * (a < 0 ? -a : a); // result 28-bit signed 
+        sampling_add(&sampling.window[0], (long)a * (a < 0 ? -a : a)); // result 28-bit signed 
       } else
   #endif
       {
-        sampling.adc[7 & samplingCnt++] = a;      
+        sampling_add(&sampling.window[0], a);
       }
     }
     else 
@@ -5367,19 +7402,79 @@ void interpreter_sampling(void)
       {
         if (map & 0x80)
         {
-          int16 a = adc_read(pin);
-          sampling.adc[pin] = ((int32)sampling.adc[pin] * 7 + a) >> 3;
+          sampling_add(&sampling.window[pin], adc_read(pin));
         }
         map <<= 1;
         pin--;
       }
     }  
+    if (sampling.power)
+    {
+      power_sample();
+    }
   }
   P0 ^= sampling.pin;
   // reschedule timer with repeat in case timer interrupt gets lost
   OS_timer_start(sampling.timer, next, 1, 0);
 }
 
+#if OS_ADC_SCAN
+static void adc_scan_stop(void)
+{
+  if (adcScan.buffer)
+  {
+    OS_adc_scan_stop();
+    adcScan.buffer = NULL;
+  }
+  adcScan.map = 0;
+}
+
+//
+// Reduce the block of samples the DMA has just filled. Each channel's mean is a moving
+// average decimated by the block length; min, max and RMS come from the same samples.
+//
+void interpreter_adc_scan(void)
+{
+  const signed char block = OS_adc_scan_block;
+  const unsigned char shift = 8 - (analogResolution >> 3);
+
+  if (block < 0 || !adcScan.buffer)
+  {
+    return;
+  }
+  OS_adc_scan_block = -1;
+  for (unsigned char ch = 0; ch < adcScan.channels; ch++)
+  {
+    if (adcScan.map & (1 << ch))
+    {
+      short* sample = adcScan.buffer + (block ? adcScan.channels * adcScan.decimate : 0) + ch;
+      int32 sum = 0;
+      uint32 squares = 0; // At most 32 samples of 14 bits
+      short min = 0x7FFF;
+      short max = -0x8000;
+      for (unsigned char i = adcScan.decimate; i--; sample += adcScan.channels)
+      {
+        const short val = *sample >> shift;
+        sum += val;
+        squares += (int32)val * val;
+        if (val < min)
+        {
+          min = val;
+        }
+        if (val > max)
+        {
+          max = val;
+        }
+      }
+      adcScan.snapshot[ch].mean = sum / adcScan.decimate;
+      adcScan.snapshot[ch].min = min;
+      adcScan.snapshot[ch].max = max;
+      adcScan.snapshot[ch].rms = isqrt(squares / adcScan.decimate);
+    }
+  }
+}
+#endif
+
 #endif  // FEATURE_SAMPLING
 
 #if !defined(ENABLE_WIRE) || ENABLE_WIRE
@@ -5396,6 +7491,12 @@ static void pin_wire_parse(void)
     pinParsePtr = heap;
     pinParseCurrent = 0;
     pinParseReadAddr = NULL;
+    pinParseVars = 0;
+    if (pinParseEntry)
+    {
+      pinParseEntry->offset = txtpos - *lineptr;
+      OS_memset(pinParseEntry->vars, 0, sizeof(pinParseEntry->vars));
+    }
   }
 
   for (;;)
@@ -5404,12 +7505,18 @@ static void pin_wire_parse(void)
     switch (op)
     {
       case NL:
+        // Sequences over several statements are not cached
+        pinParseEntry = NULL;
         txtpos--;
         return;
       case WS_SPACE:
       case ',':
         break;
       case KW_END:
+        if (pinParseEntry)
+        {
+          pin_wire_cache();
+        }
         pin_wire(heap, pinParsePtr);
         pinParsePtr = NULL;
         return;
@@ -5424,7 +7531,7 @@ static void pin_wire_parse(void)
 #endif
         txtpos--;
         *pinParsePtr++ = WIRE_PIN;
-        pinParseCurrent = pin_parse();
+        pinParseCurrent = pin_parse_literal();
         *pinParsePtr++ = pinParseCurrent;
         if (error_num)
         {
@@ -5439,7 +7546,7 @@ static void pin_wire_parse(void)
         break;
       case PM_TIMEOUT:
         *pinParsePtr++ = WIRE_TIMEOUT;
-        *(unsigned short*)pinParsePtr = expression(EXPR_COMMA);
+        *(unsigned short*)pinParsePtr = pin_wire_expression();
         pinParsePtr += sizeof(unsigned short);
         if (error_num)
         {
@@ -5455,7 +7562,7 @@ static void pin_wire_parse(void)
 
           unsigned char size;
           variable_frame* vframe;
-          unsigned char* vptr = parse_variable_address(&vframe);
+          unsigned char* vptr = pin_wire_address(&vframe);
           if (!vptr)
           {
             goto wire_error;
@@ -5465,6 +7572,10 @@ static void pin_wire_parse(void)
             *vptr = 0;
             size = sizeof(unsigned char);
           }
+          else if (VARIABLE_IS_DIM(vframe))
+          {
+            goto wire_error;
+          }
           else
           {
             *(VAR_TYPE*)vptr = 0;
@@ -5484,7 +7595,7 @@ static void pin_wire_parse(void)
           break;
         }
         *pinParsePtr++ = WIRE_WAIT_TIME;
-        *(unsigned short*)pinParsePtr = expression(EXPR_COMMA);
+        *(unsigned short*)pinParsePtr = pin_wire_expression();
         pinParsePtr += sizeof(unsigned short);
         if (error_num)
         {
@@ -5502,7 +7613,7 @@ static void pin_wire_parse(void)
           txtpos++;
         }
         variable_frame* vframe;
-        unsigned char* vptr = parse_variable_address(&vframe);
+        unsigned char* vptr = pin_wire_address(&vframe);
         if (!vptr)
         {
           goto wire_error;
@@ -5512,10 +7623,16 @@ static void pin_wire_parse(void)
           *vptr = 0;
           size = sizeof(unsigned char);
         }
+        else if (VARIABLE_IS_DIM(vframe))
+        {
+          goto wire_error;
+        }
         else
         {
+          // Only the low byte is read, the rest is cleared here
           *(VAR_TYPE*)vptr = 0;
           size = sizeof(VAR_TYPE);
+          pinParseEntry = NULL;
         }
         if (pinParseReadAddr != vptr)
         {
@@ -5543,7 +7660,11 @@ static void pin_wire_parse(void)
         {
           variable_frame* vframe;
           unsigned char* vptr = get_variable_frame(v, &vframe);
-          
+          if (VARIABLE_IS_DIM(vframe) && vframe->type != VAR_DIM_BYTE)
+          {
+            goto wire_error;
+          }
+          pin_wire_variable(v, vframe);
           const unsigned char size = (vframe->type == VAR_DIM_BYTE ? sizeof(unsigned char) : sizeof(VAR_TYPE));
           if (pinParseReadAddr != vptr)
           {
@@ -5570,7 +7691,7 @@ static void pin_wire_parse(void)
       }
       default:
         txtpos--;
-        VAR_TYPE val = expression(EXPR_COMMA);
+        VAR_TYPE val = pin_wire_expression();
         if (!error_num)
         {
           *pinParsePtr++ = (val ? WIRE_HIGH : WIRE_LOW);
@@ -5580,71 +7701,302 @@ static void pin_wire_parse(void)
     }
   }
 wire_error:
+  pinParseEntry = NULL;
   if (!error_num)
   {
     error_num = ERROR_GENERAL;
   }
 }
-#endif
 
-static void pin_wire(unsigned char* ptr, unsigned char* end)
+//
+// Note whether the tokens from 'ptr' up to 'txtpos' are only literals, so what was parsed
+// from them can be cached.
+//
+static void pin_wire_literal(unsigned char* ptr)
 {
-  // We now have an fast expression to manipulate the pins. Do it.
-  // We inline all the pin operations to keep the time down.
-#if !defined(ENABLE_WIRE) || ENABLE_WIRE
-  unsigned short wtimeout = 256;
-  unsigned short ptimeout = 256;
-#endif
-  unsigned char major = 0;
-  unsigned char dbit = 1;
-  unsigned char len;
-  unsigned short count;
-  unsigned char* dptr = NULL;
-  unsigned char dstep = 0;
+  for (; ptr < txtpos; ptr++)
+  {
+    if (*ptr == KW_CONSTANT)
+    {
+      ptr++;
+    }
+    else if ((*ptr < '0' || *ptr > '9') && *ptr != WS_SPACE && *ptr != ',' && *ptr != '-' && *ptr != '(' && *ptr != ')')
+    {
+      pinParseEntry = NULL;
+    }
+  }
+}
 
-  while (ptr < end)
+static unsigned char pin_parse_literal(void)
+{
+  unsigned char* ptr = txtpos + 1;
+  unsigned char pin = pin_parse();
+  pin_wire_literal(ptr);
+  return pin;
+}
+
+static VAR_TYPE pin_wire_expression(void)
+{
+  unsigned char* ptr = txtpos;
+  VAR_TYPE val = expression(EXPR_COMMA);
+  pin_wire_literal(ptr);
+  return val;
+}
+
+//
+// Record an array the sequence stores into, which must still be there to use the cache.
+//
+static void pin_wire_variable(unsigned char name, variable_frame* vframe)
+{
+  unsigned char vname;
+
+  if (!pinParseEntry || !VARIABLE_IS_EXTENDED(name))
   {
-    const unsigned char cmd = *ptr++;
+    return;
+  }
+  if (pinParseVars == WIRE_CACHE_VARS)
+  {
+    pinParseEntry = NULL;
+    return;
+  }
+  pinParseEntry->vars[pinParseVars].name = name;
+  pinParseEntry->vars[pinParseVars].frame = vframe;
+  pinParseEntry->vars[pinParseVars].size = vframe->header.frame_size;
+  pinParseVars++;
+}
 
-    if (cmd & WIRE_CMD_MASK)
+static unsigned char* pin_wire_address(variable_frame** vframe)
+{
+  ignore_blanks();
+  unsigned char* ptr = txtpos;
+  unsigned char* vptr = parse_variable_address(vframe);
+  if (vptr)
+  {
+    pin_wire_literal(ptr + 1);
+    pin_wire_variable(*ptr, *vframe);
+  }
+  return vptr;
+}
+
+//
+// Keep the operations just parsed. A sequence parsed again, because its arrays changed,
+// reuses its old space when it is the same size.
+//
+static void pin_wire_cache(void)
+{
+  const unsigned short len = pinParsePtr - heap;
+
+  if (pinParseEntry->line && pinParseEntry->len == len)
+  {
+    // Reuse
+  }
+  else if (len <= WIRE_CACHE_SIZE - wire_cache.used)
+  {
+    pinParseEntry->start = wire_cache.used;
+    pinParseEntry->len = len;
+    wire_cache.used += len;
+  }
+  else
+  {
+    pinParseEntry->line = 0;
+    pinParseEntry = NULL;
+    return;
+  }
+  OS_memcpy(wire_cache.ops + pinParseEntry->start, heap, len);
+  pinParseEntry->line = *(LINENUM*)*lineptr;
+  pinParseEntry->end = txtpos - *lineptr;
+  pinParseEntry = NULL;
+}
+
+//
+// Check the arrays of a cached sequence are the ones it was compiled for.
+//
+static unsigned char pin_wire_valid(wire_cache_entry* entry)
+{
+  variable_frame* vframe;
+  unsigned char i;
+
+  for (i = 0; i < WIRE_CACHE_VARS && entry->vars[i].name; i++)
+  {
+    get_variable_frame(entry->vars[i].name, &vframe);
+    if (vframe != entry->vars[i].frame || vframe->header.frame_size != entry->vars[i].size)
     {
-      major = PIN_MAJOR(cmd);
-      dbit = 1 << PIN_MINOR(cmd);
-      switch (cmd & WIRE_CMD_MASK)
+      return 0;
+    }
+  }
+  return 1;
+}
+
+//
+// Run the cached sequence for the WIRE statement at 'txtpos', and continue after its END.
+//  Returns 0 if it must be parsed, with 'pinParseEntry' set to where it can be cached.
+//
+static unsigned char pin_wire_cached(void)
+{
+  wire_cache_entry* entry;
+  wire_cache_entry* unused = NULL;
+  const unsigned char offset = txtpos - *lineptr;
+  const LINENUM line = *(LINENUM*)*lineptr;
+
+  pinParseEntry = NULL;
+  if (pinParsePtr)
+  {
+    // In the middle of a sequence
+    return 0;
+  }
+  for (entry = wire_cache.entry; entry < wire_cache.entry + WIRE_CACHE_ENTRIES; entry++)
+  {
+    if (entry->line == line && entry->offset == offset)
+    {
+      if (pin_wire_valid(entry))
       {
-        case WIRE_PIN_OUTPUT:
-          goto wire_output;
-        case WIRE_PIN_INPUT:
-          goto wire_input;
-        case WIRE_PIN_HIGH:
-          goto wire_high;
-        case WIRE_PIN_LOW:
-          goto wire_low;
-        case WIRE_PIN_READ:
-          goto wire_read;
-        default:
-          goto wire_error;
+        pin_wire(wire_cache.ops + entry->start, wire_cache.ops + entry->start + entry->len);
+        txtpos = *lineptr + entry->end;
+        return 1;
       }
+      pinParseEntry = entry;
+      return 0;
     }
-    else
+    if (!entry->line && !unused)
     {
-      switch (WIRE_CASE(cmd))
-      {
-        case WIRE_CASE(WIRE_PIN):
-        {
-          len = *ptr++;
-          major = PIN_MAJOR(len);
-          dbit = 1 << PIN_MINOR(len);
-          break;
-        }
-        case WIRE_CASE(WIRE_OUTPUT):
-        wire_output:
-          switch (major)
-          {
-            case 0:
-              P0DIR |= dbit;
-              break;
-            case 1:
+      unused = entry;
+    }
+  }
+  pinParseEntry = unused;
+  return 0;
+}
+
+//
+// Run the cached sequence of a WIRE statement on the given line, without the interpreter.
+// This is how a native timer runs it.
+//  Returns 0 if there is no such sequence, or its arrays have changed.
+//
+unsigned char interpreter_wire(unsigned short line)
+{
+  wire_cache_entry* entry;
+
+  for (entry = wire_cache.entry; entry < wire_cache.entry + WIRE_CACHE_ENTRIES; entry++)
+  {
+    if (entry->line == line && pin_wire_valid(entry))
+    {
+      pin_wire(wire_cache.ops + entry->start, wire_cache.ops + entry->start + entry->len);
+      return 1;
+    }
+  }
+  return 0;
+}
+#endif
+
+#if OS_SPI_DMA
+//
+// Is the array data at ptr dropped when a GOSUB, event or FOR returns? That is so if
+// one of their frames is older, so further up the stack.
+//
+static unsigned char dim_is_scoped(unsigned char* ptr)
+{
+  unsigned char* f;
+
+  for (f = sp; f < variables_begin; f += ((frame_header*)f)->frame_size)
+  {
+    const unsigned char type = ((frame_header*)f)->frame_type;
+    if (f > ptr && (type == FRAME_GOSUB_FLAG || type == FRAME_EVENT_FLAG || type == FRAME_FOR_FLAG))
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+//
+// Called when a SPI DMA transfer may have finished. Release the chip select and keep the
+// GOSUB until interpreter_spi_run() is called with the interpreter free.
+//  Returns 1 if a GOSUB is waiting.
+//
+unsigned char interpreter_spi_complete(void)
+{
+  if (spiDma.line && !OS_spi_dma_busy)
+  {
+    unsigned char pin = spiDma.pin;
+    spiDma.done = spiDma.line;
+    spiDma.line = 0;
+    pin_wire(&pin, &pin + 1);
+  }
+  return spiDma.done != 0;
+}
+
+//
+// Run the GOSUB of a completed SPI DMA transfer.
+//
+void interpreter_spi_run(void)
+{
+  const unsigned short line = spiDma.done;
+
+  if (line)
+  {
+    spiDma.done = 0;
+    interpreter_run(line, INTERPRETER_CAN_RETURN);
+  }
+}
+#endif
+
+static void pin_wire(unsigned char* ptr, unsigned char* end)
+{
+  // We now have an fast expression to manipulate the pins. Do it.
+  // We inline all the pin operations to keep the time down.
+#if !defined(ENABLE_WIRE) || ENABLE_WIRE
+  unsigned short wtimeout = 256;
+  unsigned short ptimeout = 256;
+#endif
+  unsigned char major = 0;
+  unsigned char dbit = 1;
+  unsigned char len;
+  unsigned short count;
+  unsigned char* dptr = NULL;
+  unsigned char dstep = 0;
+
+  while (ptr < end)
+  {
+    const unsigned char cmd = *ptr++;
+
+    if (cmd & WIRE_CMD_MASK)
+    {
+      major = PIN_MAJOR(cmd);
+      dbit = 1 << PIN_MINOR(cmd);
+      switch (cmd & WIRE_CMD_MASK)
+      {
+        case WIRE_PIN_OUTPUT:
+          goto wire_output;
+        case WIRE_PIN_INPUT:
+          goto wire_input;
+        case WIRE_PIN_HIGH:
+          goto wire_high;
+        case WIRE_PIN_LOW:
+          goto wire_low;
+        case WIRE_PIN_READ:
+          goto wire_read;
+        default:
+          goto wire_error;
+      }
+    }
+    else
+    {
+      switch (WIRE_CASE(cmd))
+      {
+        case WIRE_CASE(WIRE_PIN):
+        {
+          len = *ptr++;
+          major = PIN_MAJOR(len);
+          dbit = 1 << PIN_MINOR(len);
+          break;
+        }
+        case WIRE_CASE(WIRE_OUTPUT):
+        wire_output:
+          switch (major)
+          {
+            case 0:
+              P0DIR |= dbit;
+              break;
+            case 1:
               P1DIR |= dbit;
               break;
             case 2:
@@ -5968,7 +8320,12 @@ static unsigned char addspecial_with_compact(unsigned char* item)
   unsigned char ret;
   SEMAPHORE_FLASH_WAIT();
   ret = flashstore_addspecial(item);
+#ifdef FEATURE_FILESTORE
+  // Compacting the flash won't make room in the file store
+  if (!ret && !FS_IS_FILE_SPECIAL(*(unsigned long*)(item + FLASHSPECIAL_ITEM_ID)))
+#else
   if (!ret )
+#endif
   {
     flashstore_compact(item[sizeof(unsigned short)], heap, sp);
     ret = flashstore_addspecial(item);
@@ -5991,6 +8348,34 @@ static char ble_build_service(void)
   unsigned char* chardesc = NULL;
   unsigned char chardesclen = 0;
   LINENUM onconnect = 0;
+  service_frame** service;
+  unsigned long hash;
+  unsigned char entries;
+  unsigned short bytes;
+  unsigned char* cache;
+  unsigned char* cached = NULL;
+  unsigned char* cacheend = NULL;
+  unsigned char* next;
+
+  // The UUIDs and descriptions are used from flash if they were cached when the service
+  // was last built, and the service hasn't changed since.
+  hash = ble_service_hash(&entries, &bytes);
+  cache = flashstore_findspecial(FLASHSPECIAL_GATT + servicestart);
+  if (cache && (*(unsigned long*)(cache + GATTCACHE_HASH) != hash ||
+                cache[GATTCACHE_ENTRIES] != entries ||
+                cache[GATTCACHE_BYTES] != bytes ||
+                cache[FLASHSPECIAL_DATA_LEN] != GATTCACHE_DATA + bytes))
+  {
+    SEMAPHORE_FLASH_WAIT();
+    flashstore_deletespecial(FLASHSPECIAL_GATT + servicestart);
+    SEMAPHORE_FLASH_SIGNAL();
+    cache = NULL;
+  }
+  if (cache)
+  {
+    cached = cache + GATTCACHE_DATA;
+    cacheend = cached + bytes;
+  }
 
   linenum = servicestart;
   line = findlineptr();
@@ -6032,19 +8417,41 @@ static char ble_build_service(void)
       ch = *txtpos;
       if (ch == '"' || ch == '\'')
       {
-        ch = ble_get_uuid();
-        if (!ch)
+        if (cached)
         {
-          goto error;
+          txtpos += find_quoted_string() + 1;
+        }
+        else
+        {
+          ch = ble_get_uuid();
+          if (!ch)
+          {
+            goto error;
+          }
         }
         if (cmd == BLE_SERVICE)
         {
           attributes[count].type.uuid = ble_primary_service_uuid;
           unsigned char* ptr = heap;
-          CHECK_HEAP_OOM(ble_uuid_len + sizeof(gattAttrType_t), qoom);
-          OS_memcpy(ptr + sizeof(gattAttrType_t), ble_uuid, ble_uuid_len);
-          ((gattAttrType_t*)ptr)->len = ble_uuid_len;
-          ((gattAttrType_t*)ptr)->uuid = ptr + sizeof(gattAttrType_t);
+          if (cached)
+          {
+            next = ble_cache_next(cached, cacheend);
+            if (!next)
+            {
+              goto stale;
+            }
+            CHECK_HEAP_OOM(sizeof(gattAttrType_t), qoom);
+            ((gattAttrType_t*)ptr)->len = *cached;
+            ((gattAttrType_t*)ptr)->uuid = cached + 1;
+            cached = next;
+          }
+          else
+          {
+            CHECK_HEAP_OOM(ble_uuid_len + sizeof(gattAttrType_t), qoom);
+            OS_memcpy(ptr + sizeof(gattAttrType_t), ble_uuid, ble_uuid_len);
+            ((gattAttrType_t*)ptr)->len = ble_uuid_len;
+            ((gattAttrType_t*)ptr)->uuid = ptr + sizeof(gattAttrType_t);
+          }
           *(unsigned char**)&attributes[count].pValue = ptr;
           
           ignore_blanks();
@@ -6151,20 +8558,42 @@ done:
         goto error;
       }
       
-      unsigned char* uuid = heap;
-      gatt_variable_ref* vref = (gatt_variable_ref*)(uuid + ble_uuid_len);
-      CHECK_HEAP_OOM(ble_uuid_len + sizeof(gatt_variable_ref), qoom);
+      unsigned char* uuid;
+      gatt_variable_ref* vref;
+      if (cached)
+      {
+        next = ble_cache_next(cached, cacheend);
+        if (!next)
+        {
+          goto stale;
+        }
+        uuid = cached + 1;
+        attributes[count].type.len = *cached;
+        cached = next;
+        vref = (gatt_variable_ref*)heap;
+        CHECK_HEAP_OOM(sizeof(gatt_variable_ref), qoom);
+      }
+      else
+      {
+        uuid = heap;
+        attributes[count].type.len = ble_uuid_len;
+        vref = (gatt_variable_ref*)(uuid + ble_uuid_len);
+        CHECK_HEAP_OOM(ble_uuid_len + sizeof(gatt_variable_ref), qoom);
+        OS_memcpy(uuid, ble_uuid, ble_uuid_len);
+      }
+      attributes[count].type.uuid = uuid;
       vref->read = 0;
       vref->write = 0;
       vref->var = ch;
       vref->attrs = attributes;
       vref->cfg = NULL;
+      vref->policy = NOTIFY_IMMEDIATE;
+      vref->dirty = 0;
+      vref->unsent = 1;
+      vref->sent = 0;
       
-      OS_memcpy(uuid, ble_uuid, ble_uuid_len);
       *(unsigned char**)&attributes[count].pValue = (unsigned char*)vref;
       attributes[count].permissions = GATT_PERMIT_READ | GATT_PERMIT_WRITE;
-      attributes[count].type.uuid = uuid;
-      attributes[count].type.len = ble_uuid_len;
 
       for (;;)
       {
@@ -6192,6 +8621,25 @@ done:
             vref->write = linenum;
           }
         }
+        else if (ch == KW_CONSTANT && (txtpos[1] == CO_CHANGED || txtpos[1] == CO_EVENT))
+        {
+          vref->policy = (txtpos[1] == CO_CHANGED ? NOTIFY_CHANGED : NOTIFY_EVENT);
+          txtpos += 2;
+        }
+        else if (ch == KW_CONSTANT && txtpos[1] == CO_EVERY)
+        {
+          VAR_TYPE interval;
+
+          txtpos += 2;
+          interval = expression(EXPR_NORMAL);
+          if (error_num || interval < 1 || interval > 0xFFFF)
+          {
+            goto error;
+          }
+          vref->policy = NOTIFY_EVERY;
+          vref->interval = interval;
+          vref->last = (unsigned short)OS_get_millis() - vref->interval;
+        }
         else if (ch == NL)
         {
           break;
@@ -6228,9 +8676,22 @@ done:
         attributes[count].handle = 0;
 
         unsigned char* desc = heap;
-        CHECK_HEAP_OOM(chardesclen + 1, qoom);
-        OS_memcpy(desc, chardesc, chardesclen);
-        desc[chardesclen] = 0;
+        if (cached)
+        {
+          next = ble_cache_next(cached, cacheend);
+          if (!next)
+          {
+            goto stale;
+          }
+          desc = cached + 1;
+          cached = next;
+        }
+        else
+        {
+          CHECK_HEAP_OOM(chardesclen + 1, qoom);
+          OS_memcpy(desc, chardesc, chardesclen);
+          desc[chardesclen] = 0;
+        }
         *(unsigned char**)&attributes[count].pValue = desc;
         chardesclen = 0;
       }
@@ -6248,6 +8709,8 @@ done:
   frame->header.frame_size = heap - origheap;
   frame->attrs = attributes;
   frame->connect = onconnect;
+  frame->cache = cache;
+  frame->line = servicestart;
   ((unsigned short*)attributes)[-1] = count;
   
   // Register the service 
@@ -6257,9 +8720,23 @@ done:
   {
     goto error;
   }
+  frame->next = NULL;
+  for (service = &ble_services; *service; service = &(*service)->next)
+    ;
+  *service = frame;
+
+  if (!cache)
+  {
+    ble_cache_service(attributes, count, hash, entries, bytes);
+  }
 
   return 0;
 
+stale:
+  // The cache doesn't match the service after all, so it is rebuilt next time
+  SEMAPHORE_FLASH_WAIT();
+  flashstore_deletespecial(FLASHSPECIAL_GATT + servicestart);
+  SEMAPHORE_FLASH_SIGNAL();
 error:
   heap = origheap;
   txtpos = *line + sizeof(LINENUM) + sizeof(char);
@@ -6271,96 +8748,450 @@ qoom:
 }
 
 //
-// Parse a string into a UUID
-//  This is fairly lax in what it considers valid.
+// Key the program lines of the service being built, up to its GATT END, by their
+// total length and CRC-16, and count the entries, and their bytes, a cache of the
+// service holds. These follow the order ble_build_service() uses the cache in.
 //
-static char ble_get_uuid(void)
+static unsigned long ble_service_hash(unsigned char* entries, unsigned short* bytes)
 {
-  VAR_TYPE v = 0;
-  unsigned char* end;
-  
-  end = txtpos + find_quoted_string();
-  if (end < txtpos)
+  unsigned char** line;
+  unsigned char* ptr;
+  unsigned short crc = 0xFFFF;
+  unsigned short total = 0;
+  unsigned char uuidlen = 0;
+  short desclen = -1;
+
+  *entries = 0;
+  *bytes = 0;
+  linenum = servicestart;
+  for (line = findlineptr(); line < program_end; line++)
   {
-    return 0;
+    ptr = *line;
+    crc = crc16(crc, ptr, ptr[sizeof(LINENUM)]);
+    total += ptr[sizeof(LINENUM)];
+    ptr += sizeof(LINENUM) + sizeof(char);
+    if (ptr[0] != KW_GATT)
+    {
+      continue;
+    }
+    switch (ptr[1])
+    {
+      case KW_END:
+        return ((unsigned long)total << 16) | crc;
+      case BLE_SERVICE:
+      case BLE_CHARACTERISTIC:
+        txtpos = ptr + 2;
+        uuidlen = (ble_get_uuid() ? ble_uuid_len : 0);
+        if (ptr[1] == BLE_SERVICE)
+        {
+          (*entries)++;
+          *bytes += uuidlen + 1;
+        }
+        else
+        {
+          ignore_blanks();
+          desclen = find_quoted_string();
+        }
+        break;
+      case KW_READ:
+      case KW_WRITE:
+      case BLE_NOTIFY:
+      case BLE_INDICATE:
+      case BLE_WRITENORSP:
+      case BLE_AUTH:
+        // The characteristic's UUID and description
+        (*entries)++;
+        *bytes += uuidlen + 1;
+        if (desclen > 0)
+        {
+          (*entries)++;
+          *bytes += desclen + 2;
+          desclen = -1;
+        }
+        break;
+      default:
+        break;
+    }
   }
+  return ((unsigned long)total << 16) | crc;
+}
 
-  ble_uuid_len = 0;
-  while (txtpos < end)
+//
+// Save the UUIDs and descriptions of a newly built service in flash so, while the
+// service is unchanged, later builds use them in place rather than parse and copy them.
+//  Each is a length byte followed by the bytes, in attribute order.
+//
+static void ble_cache_service(gattAttribute_t* attributes, short count, unsigned long hash, unsigned char entries, unsigned short bytes)
+{
+  unsigned char* item = heap;
+  unsigned char* ptr = item + GATTCACHE_DATA;
+  unsigned char* end = item + 255;
+  const unsigned char* data;
+  unsigned char len;
+  unsigned char n = 0;
+  short i;
+
+  if (end > sp)
   {
-    if (ble_uuid_len >= sizeof(ble_uuid))
+    return;
+  }
+  for (i = 0; i < count; i++)
+  {
+    if (attributes[i].type.uuid == ble_primary_service_uuid)
     {
-      return 0;
+      data = ((gattAttrType_t*)attributes[i].pValue)->uuid;
+      len = ((gattAttrType_t*)attributes[i].pValue)->len;
     }
-    else if (*txtpos == '-')
+    else if (attributes[i].type.uuid == ble_characteristic_description_uuid)
     {
-      txtpos++;
+      data = attributes[i].pValue;
+      for (len = 0; data[len]; len++)
+        ;
+      len++;
+    }
+    else if (i > 0 && attributes[i - 1].type.uuid == ble_characteristic_uuid && attributes[i].type.uuid != ble_characteristic_uuid)
+    {
+      data = attributes[i].type.uuid;
+      len = attributes[i].type.len;
     }
     else
     {
-      v = parse_int(2, 16);
-      if (error_num)
-      {
-        return 0;
-      }
-      ble_uuid[ble_uuid_len++] = (unsigned char)v;
+      continue;
     }
+    if (ptr + len + 1 > end)
+    {
+      return; // Too big to cache
+    }
+    *ptr++ = len;
+    ptr = OS_memcpy(ptr, data, len);
+    n++;
   }
-#ifdef TARGET_CC254X
-  // Reverse
-  for (v = 0; v < ble_uuid_len / 2; v++)
+  if (n != entries || ptr - item - GATTCACHE_DATA != bytes)
   {
-    unsigned char c = ble_uuid[v];
-    ble_uuid[v] = ble_uuid[ble_uuid_len - v - 1];
-    ble_uuid[ble_uuid_len - v - 1] = c;
+    return; // Laid out differently than ble_service_hash() expects, so it would never be used
   }
-#endif
-  txtpos++;
-  return ble_uuid_len > 0;
+
+  item[FLASHSPECIAL_DATA_LEN] = ptr - item;
+  *(unsigned long*)(item + FLASHSPECIAL_ITEM_ID) = FLASHSPECIAL_GATT + servicestart;
+  *(unsigned long*)(item + GATTCACHE_HASH) = hash;
+  item[GATTCACHE_ENTRIES] = entries;
+  item[GATTCACHE_BYTES] = bytes;
+  // Keep the item clear of the heap space compaction works in
+  heap = end;
+  addspecial_with_compact(item);
+  heap = item;
 }
 
 //
-// Calculate the maximum read/write offset for the specified variable
+// Drop the flash cache of the service at line id, if there is one, as the line is about
+// to be replaced, deleted or moved. The cache is kept by line number so it would be left
+// behind otherwise.
 //
-static unsigned short ble_max_offset(gatt_variable_ref* vref, unsigned short offset, unsigned char maxlen)
+static void ble_forget_service(LINENUM id)
 {
-  variable_frame* frame;
-  unsigned char moffset = offset + maxlen;
+  unsigned char** line = (unsigned char**)flashstore_findclosest(id);
 
-  get_variable_frame(vref->var, &frame);
-
-  if (frame->type == VAR_DIM_BYTE)
+  if (line < program_end && *(LINENUM*)*line == id &&
+      (*line)[sizeof(LINENUM) + sizeof(char)] == KW_GATT && (*line)[sizeof(LINENUM) + sizeof(char) + 1] == BLE_SERVICE)
   {
-    if (moffset > frame->header.frame_size - sizeof(variable_frame))
-    {
-      moffset = frame->header.frame_size - sizeof(variable_frame);
-    }
+    SEMAPHORE_FLASH_WAIT();
+    flashstore_deletespecial(FLASHSPECIAL_GATT + id);
+    SEMAPHORE_FLASH_SIGNAL();
   }
-  else
+}
+
+//
+// Step over a cached entry. Returns NULL if it runs past the end of the cache.
+//
+static unsigned char* ble_cache_next(unsigned char* cached, unsigned char* end)
+{
+  if (cached >= end || *cached >= end - cached)
   {
-    if (moffset > VAR_SIZE)
-    {
-      moffset = VAR_SIZE;
-    }
+    return NULL;
   }
-
-  return moffset;
+  return cached + *cached + 1;
 }
 
-#ifdef DEBUG_SERIAL
-#define DEBUG_OUT(x) OS_serial_write(1,x)
-#else
-#define DEBUG_OUT(x)
-#endif
-
 //
-// When a BLE characteristic is read, we process the incoming request from
-// the appropriate BASIC variable. If an ONREAD event is specified we notify the user
-// of the read request *before* we do the actual read.
+// The flashstore moved its items, so services using cached UUIDs and descriptions
+// must follow their copy.
 //
-static unsigned char ble_read_callback(unsigned short handle, gattAttribute_t* attr, unsigned char* value, unsigned char* len, unsigned short offset, unsigned char maxlen, uint8 method)
+void interpreter_flashmoved(void)
 {
-  gatt_variable_ref* vref;
+  service_frame* vframe;
+  unsigned char* moved;
+  unsigned char* old;
+  unsigned char len;
+  short i;
+
+  for (vframe = ble_services; vframe; vframe = vframe->next)
+  {
+    old = vframe->cache;
+    if (!old)
+    {
+      continue;
+    }
+    moved = flashstore_findspecial(FLASHSPECIAL_GATT + vframe->line);
+    if (moved == old || !moved)
+    {
+      continue;
+    }
+    len = moved[FLASHSPECIAL_DATA_LEN];
+    for (i = ((short*)vframe->attrs)[-1] - 1; i >= 0; i--)
+    {
+      gattAttribute_t* attr = &vframe->attrs[i];
+      if (attr->type.uuid >= old && attr->type.uuid < old + len)
+      {
+        attr->type.uuid = attr->type.uuid - old + moved;
+      }
+      else if (attr->type.uuid == ble_primary_service_uuid)
+      {
+        gattAttrType_t* type = (gattAttrType_t*)attr->pValue;
+        type->uuid = type->uuid - old + moved;
+      }
+      else if (attr->type.uuid == ble_characteristic_description_uuid)
+      {
+        *(unsigned char**)&attr->pValue = attr->pValue - old + moved;
+      }
+    }
+    vframe->cache = moved;
+  }
+}
+
+//
+// Copy the variables bound to advertising and scan response fields into the payloads,
+// and give any which changed to the GAP role.
+//
+void interpreter_advert_update(void)
+{
+  unsigned char kind;
+  unsigned char i;
+  unsigned char changed;
+  unsigned char* ptr;
+  unsigned char* field;
+  unsigned char width;
+  variable_frame* frame;
+
+  if (ble_adptr)
+  {
+    return; // ble_adbuf is busy building a payload, try again later
+  }
+  for (kind = 0; kind < 2; kind++)
+  {
+    if (!ble_adlen[kind])
+    {
+      continue;
+    }
+    GAPRole_GetParameter(kind ? _GAPROLE(BLE_SCAN_RSP_DATA) : _GAPROLE(BLE_ADVERT_DATA), ble_adbuf);
+    changed = 0;
+    for (i = 0; i < BLE_ADFIELDS; i++)
+    {
+      if (!ble_adfields[i].var || !(ble_adfields[i].offset & BLE_ADFIELD_SCANRSP) != !kind)
+      {
+        continue;
+      }
+      ptr = get_variable_frame(ble_adfields[i].var, &frame);
+      width = ble_adfields[i].width;
+      if (VARIABLE_IS_DIM(frame) && VARIABLE_DIM_SIZE(frame) < width)
+      {
+        width = VARIABLE_DIM_SIZE(frame);
+      }
+      field = ble_adbuf + (ble_adfields[i].offset & ~BLE_ADFIELD_SCANRSP);
+      for (; width; width--, field++, ptr++)
+      {
+        if (*field != *ptr)
+        {
+          *field = *ptr;
+          changed = 1;
+        }
+      }
+    }
+    if (changed)
+    {
+      GAPRole_SetParameter(kind ? _GAPROLE(BLE_SCAN_RSP_DATA) : _GAPROLE(BLE_ADVERT_DATA), ble_adlen[kind], ble_adbuf);
+    }
+  }
+}
+
+//
+// Put the next payloads of the advertising rotation on air, and time the ones after.
+//
+void interpreter_advert_rotate(void)
+{
+  variable_frame* frame;
+  unsigned char* ptr;
+  unsigned char i = ble_adrotate.next;
+
+  if (!ble_adrotate.count || ble_adrotate_timer >= OS_MAX_TIMER)
+  {
+    return;
+  }
+  ptr = get_variable_frame(ble_adrotate.entry[i].advert, &frame);
+  if (VARIABLE_IS_DIM(frame) && VARIABLE_DIM_SIZE(frame) <= sizeof(ble_adbuf))
+  {
+    GAPRole_SetParameter(_GAPROLE(BLE_ADVERT_DATA), VARIABLE_DIM_SIZE(frame), ptr);
+  }
+  if (ble_adrotate.entry[i].scanrsp)
+  {
+    ptr = get_variable_frame(ble_adrotate.entry[i].scanrsp, &frame);
+    if (VARIABLE_IS_DIM(frame) && VARIABLE_DIM_SIZE(frame) <= sizeof(ble_adbuf))
+    {
+      GAPRole_SetParameter(_GAPROLE(BLE_SCAN_RSP_DATA), VARIABLE_DIM_SIZE(frame), ptr);
+    }
+  }
+  if (ble_adrotate.turns)
+  {
+    ptr = get_variable_frame(ble_adrotate.turns, &frame);
+    if (VARIABLE_IS_DIM(frame) && i < VARIABLE_DIM_COUNT(frame))
+    {
+      ptr += i << VARIABLE_DIM_SHIFT(frame);
+      variable_dim_set(frame, ptr, variable_dim_get(frame, ptr) + 1);
+    }
+  }
+  ble_adrotate.next = (i + 1 == ble_adrotate.count ? 0 : i + 1);
+  OS_timer_start(ble_adrotate_timer, ble_adrotate.entry[i].dwell, 0, 0);
+}
+
+//
+// Parse a string into a UUID
+//  This is fairly lax in what it considers valid.
+//
+static char ble_get_uuid(void)
+{
+  VAR_TYPE v = 0;
+  unsigned char* end;
+  
+  end = txtpos + find_quoted_string();
+  if (end < txtpos)
+  {
+    return 0;
+  }
+
+  ble_uuid_len = 0;
+  while (txtpos < end)
+  {
+    if (ble_uuid_len >= sizeof(ble_uuid))
+    {
+      return 0;
+    }
+    else if (*txtpos == '-')
+    {
+      txtpos++;
+    }
+    else
+    {
+      v = parse_int(2, 16);
+      if (error_num)
+      {
+        return 0;
+      }
+      ble_uuid[ble_uuid_len++] = (unsigned char)v;
+    }
+  }
+#ifdef TARGET_CC254X
+  // Reverse
+  for (v = 0; v < ble_uuid_len / 2; v++)
+  {
+    unsigned char c = ble_uuid[v];
+    ble_uuid[v] = ble_uuid[ble_uuid_len - v - 1];
+    ble_uuid[ble_uuid_len - v - 1] = c;
+  }
+#endif
+  txtpos++;
+  return ble_uuid_len > 0;
+}
+
+//
+// Calculate the maximum read/write offset for the specified variable
+//
+static unsigned short ble_max_offset(gatt_variable_ref* vref, unsigned short offset, unsigned char maxlen)
+{
+  variable_frame* frame;
+  unsigned char moffset = offset + maxlen;
+
+  get_variable_frame(vref->var, &frame);
+
+  if (VARIABLE_IS_DIM(frame))
+  {
+    if (moffset > VARIABLE_DIM_SIZE(frame))
+    {
+      moffset = VARIABLE_DIM_SIZE(frame);
+    }
+  }
+  else
+  {
+    if (moffset > VAR_SIZE)
+    {
+      moffset = VAR_SIZE;
+    }
+  }
+
+  return moffset;
+}
+
+//
+// Run a GATT handler for a connection. The first 'count' of H (the connection handle),
+// S (the change) and V (its value) are set from 'values' and put back afterwards, so each
+// handler sees only its own connection and the rest of the program keeps its values.
+// ONREAD and ONWRITE get H; a program which used H across them must now keep it elsewhere.
+// A handler can't be told if any of these is an array, so we report an error instead.
+//
+static void ble_handler_run(LINENUM line, unsigned char count, VAR_TYPE* values)
+{
+  static const char names[] = "HSV";
+  unsigned char vname;
+  unsigned char i;
+  VAR_TYPE saved[sizeof(names) - 1];
+
+  for (i = 0; i < count; i++)
+  {
+    if (VARIABLE_IS_EXTENDED(names[i]))
+    {
+#if ENABLE_BLE_CONSOLE
+      unsigned char** ptr;
+
+      printmsg(error_msgs[ERROR_GENERAL]);
+      linenum = line;
+      ptr = findlineptr();
+      if (ptr < program_end)
+      {
+        list_line = *ptr;
+        OS_putchar('>');
+        OS_putchar('>');
+        OS_putchar(WS_SPACE);
+        printline(0, 1);
+        OS_putchar(NL);
+      }
+#endif
+      return;
+    }
+  }
+  for (i = 0; i < count; i++)
+  {
+    saved[i] = VARIABLE_INT_GET(names[i]);
+    VARIABLE_INT_SET(names[i], values[i]);
+  }
+  interpreter_run(line, INTERPRETER_CAN_RETURN);
+  for (i = 0; i < count; i++)
+  {
+    VARIABLE_INT_SET(names[i], saved[i]);
+  }
+}
+
+#ifdef DEBUG_SERIAL
+#define DEBUG_OUT(x) OS_serial_write(1,x)
+#else
+#define DEBUG_OUT(x)
+#endif
+
+//
+// When a BLE characteristic is read, we process the incoming request from
+// the appropriate BASIC variable. If an ONREAD event is specified we notify the user
+// of the read request *before* we do the actual read.
+//
+static unsigned char ble_read_callback(unsigned short handle, gattAttribute_t* attr, unsigned char* value, unsigned char* len, unsigned short offset, unsigned char maxlen, uint8 method)
+{
+  gatt_variable_ref* vref;
   unsigned char moffset;
   unsigned char* v;
   variable_frame* frame;
@@ -6383,15 +9214,17 @@ static unsigned char ble_read_callback(unsigned short handle, gattAttribute_t* a
   if (vref->read && offset == 0)
   {
     SEMAPHORE_READ_WAIT();
-    interpreter_run(vref->read, INTERPRETER_CAN_RETURN);
+    VAR_TYPE h = handle;
+    ble_handler_run(vref->read, 1, &h);
   }
 
   v = get_variable_frame(vref->var, &frame);
 #ifdef TARGET_CC254X
-  if (frame->type == VAR_DIM_BYTE)
+  if (VARIABLE_IS_DIM(frame))
   {
+    // Arrays are exposed as their raw bytes, so words and longs go out in the array's byte order
     OS_memcpy(value, v + offset, moffset - offset);
-    unsigned char var_len = frame->header.frame_size - sizeof(variable_frame);
+    unsigned short var_len = VARIABLE_DIM_SIZE(frame);
     // when the DIM array is larger than 20 bytes (max payload)
     // the read CB will be called with increasing offset until all data is transported
     // block the interpreter until all data has been transported
@@ -6446,7 +9279,7 @@ static unsigned char ble_write_callback(unsigned short handle, gattAttribute_t*
   v = get_variable_frame(vref->var, &frame);
 
 #ifdef TARGET_CC254X
-  if (frame->type == VAR_DIM_BYTE)
+  if (VARIABLE_IS_DIM(frame))
   {
     OS_memcpy(v + offset, value, moffset - offset);
   }
@@ -6463,7 +9296,8 @@ static unsigned char ble_write_callback(unsigned short handle, gattAttribute_t*
   
   if (vref->write)
   {
-    interpreter_run(vref->write, INTERPRETER_CAN_RETURN);
+    VAR_TYPE h = handle;
+    ble_handler_run(vref->write, 1, &h);
   }
 
   if (attr[1].type.uuid == ble_client_characteristic_config_uuid)
@@ -6477,107 +9311,689 @@ static unsigned char ble_write_callback(unsigned short handle, gattAttribute_t*
 //
 // Send a BLE NOTIFY event
 //
-static void ble_notify_assign(gatt_variable_ref* vref)
+static unsigned char ble_notify_send(gatt_variable_ref* vref)
 {
   DEBUG_OUT('!');
-  GATTServApp_ProcessCharCfg(vref->cfg, &(vref->var),
-                             FALSE, vref->attrs,
-                             ((unsigned short*)vref->attrs)[-1], INVALID_TASK_ID,
-                             ble_read_callback);
+  return GATTServApp_ProcessCharCfg(vref->cfg, &(vref->var),
+                                    FALSE, vref->attrs,
+                                    ((unsigned short*)vref->attrs)[-1], INVALID_TASK_ID,
+                                    ble_read_callback);
 }
 
 //
-// init all BLE client characteristic configurations values
+// The value of a GATT variable for NOTIFY CHANGED to compare: the variable itself,
+// or the CRC-32 of an array, which is too big to keep a copy of.
 //
-void ble_init_ccc( void )
+static VAR_TYPE ble_notify_value(gatt_variable_ref* vref)
+{
+  variable_frame* frame;
+  unsigned char* v = get_variable_frame(vref->var, &frame);
+
+  if (VARIABLE_IS_DIM(frame))
+  {
+    unsigned short len = VARIABLE_DIM_SIZE(frame);
+    unsigned long crc = 0xFFFFFFFF;
+    unsigned char bit;
+    for (; len; len--)
+    {
+      crc ^= *v++;
+      for (bit = 8; bit; bit--)
+      {
+        crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+      }
+    }
+    return (VAR_TYPE)~crc;
+  }
+  return *(VAR_TYPE*)v;
+}
+
+//
+// A GATT variable was assigned. Depending on its policy it is notified now, or
+// marked dirty so only its latest value is sent later on.
+//
+static void ble_notify_assign(gatt_variable_ref* vref)
+{
+  switch (vref->policy)
+  {
+    case NOTIFY_CHANGED:
+      {
+        const VAR_TYPE value = ble_notify_value(vref);
+
+        if (!vref->unsent && value == vref->sent)
+        {
+          return;
+        }
+        // Remember it only once it has gone, otherwise it is tried again with the next
+        // connection event
+        if (ble_notify_send(vref) == SUCCESS)
+        {
+          vref->unsent = 0;
+          vref->sent = value;
+          if (vref->dirty)
+          {
+            vref->dirty = 0;
+            ble_dirty--;
+          }
+        }
+        else if (!vref->dirty)
+        {
+          vref->dirty = 1;
+          ble_dirty++;
+          ble_notify_pace();
+        }
+      }
+      return;
+    case NOTIFY_EVERY:
+      if ((unsigned short)((unsigned short)OS_get_millis() - vref->last) < vref->interval)
+      {
+        break;
+      }
+      vref->last = (unsigned short)OS_get_millis();
+      // Fall through ...
+    case NOTIFY_IMMEDIATE:
+      if (vref->dirty)
+      {
+        vref->dirty = 0;
+        ble_dirty--;
+      }
+      ble_notify_send(vref);
+      return;
+    default:
+      break;
+  }
+  if (!vref->dirty)
+  {
+    vref->dirty = 1;
+    ble_dirty++;
+    ble_notify_pace();
+  }
+}
+
+//
+// Send the dirty variables whose time has come.
+//
+static void ble_notify_flush(void)
 {
-  unsigned char* ptr;
   service_frame* vframe;
+  gatt_variable_ref* vref;
   short i;
-  
-  for (ptr = (unsigned char*)program_end; ptr < heap; ptr += ((frame_header*)ptr)->frame_size)
+
+  for (vframe = ble_services; ble_dirty && vframe; vframe = vframe->next)
   {
-    vframe = (service_frame*)ptr;
-    if (vframe->header.frame_type == FRAME_SERVICE_FLAG)
+    for (i = ((short*)vframe->attrs)[-1] - 1; i > 0; i--)
     {
-        for (i = ((short*)vframe->attrs)[-1]; i; i--)
+      if (vframe->attrs[i].type.uuid == ble_client_characteristic_config_uuid)
+      {
+        vref = (gatt_variable_ref*)vframe->attrs[i - 1].pValue;
+        if (vref->dirty &&
+            (vref->policy != NOTIFY_EVERY || (unsigned short)((unsigned short)OS_get_millis() - vref->last) >= vref->interval) &&
+            ble_notify_send(vref) == SUCCESS)
         {
-          if (vframe->attrs[i].type.uuid == ble_client_characteristic_config_uuid)
+          vref->dirty = 0;
+          vref->last = (unsigned short)OS_get_millis();
+          ble_dirty--;
+          if (vref->policy == NOTIFY_CHANGED)
           {
-            gattCharCfg_t *conn = *(gattCharCfg_t **)vframe->attrs[i].pValue;
-            GATTServApp_InitCharCfg(INVALID_CONNHANDLE, conn);
+            vref->unsent = 0;
+            vref->sent = ble_notify_value(vref);
           }
         }
+      }
     }
   }
-} 
+}
 
 //
-// BLE connection management. If the ONCONNECT event was specified when a service
-// was created, we forward any connection changes up to the user code.
+// GATT STREAM <array>[(<index>)][, <length>] [GOSUB <linenum>]
+//  or
+// GATT STREAM END
+// Start streaming part of a NOTIFY array to the subscribed clients. Returns 1 on error.
 //
-void ble_connection_status(unsigned short connHandle, unsigned char changeType, signed char rssi)
+static unsigned char ble_stream_start(void)
 {
+  variable_frame* frame;
   unsigned char* ptr;
-  service_frame* vframe;
+  unsigned short size;
+  gattAttribute_t* attr;
 
-  for (ptr = (unsigned char*)program_end; ptr < heap; ptr += ((frame_header*)ptr)->frame_size)
+  if (*txtpos == KW_END)
   {
-    vframe = (service_frame*)ptr;
-    if (vframe->header.frame_type == FRAME_SERVICE_FLAG)
+    txtpos++;
+    ble_stream_stop();
+    return *txtpos != NL;
+  }
+  if (ble_stream.vref)
+  {
+    return 1; // Busy
+  }
+  ptr = parse_array_address(&frame);
+  if (!ptr || !frame->ble)
+  {
+    return 1;
+  }
+  ble_stream.offset = ptr - VARIABLE_DIM_DATA(frame);
+  size = VARIABLE_DIM_SIZE(frame) - ble_stream.offset;
+  if (*txtpos == ',')
+  {
+    VAR_TYPE len;
+
+    txtpos++;
+    len = expression(EXPR_NORMAL);
+    if (len < 0 || len > size)
     {
-#ifndef BLUEBATTERY
-      if (vframe->connect)
+      return 1;
+    }
+    size = len;
+  }
+  ble_stream.end = ble_stream.offset + size;
+  ble_stream.complete = 0;
+  if (*txtpos == KW_GOSUB)
+  {
+    txtpos++;
+    ble_stream.complete = expression(EXPR_NORMAL);
+  }
+  if (error_num || *txtpos != NL)
+  {
+    return 1;
+  }
+  for (attr = frame->ble->attrs; attr->pValue != (unsigned char*)frame->ble; attr++)
+    ;
+  ble_stream.handle = attr->handle;
+  ble_stream.chunk = 0;
+  ble_stream.sent = 0;
+  ble_stream.vref = frame->ble;
+  ble_notify_pace();
+  return 0;
+}
+
+static void ble_stream_stop(void)
+{
+  ble_stream.vref = NULL;
+  ble_notify_pace();
+}
+
+//
+// Connection event notices are wanted while there's a stream or dirty variables.
+//
+static void ble_notify_pace(void)
+{
+  static unsigned char pacing;
+  const unsigned char pace = (ble_stream.vref || ble_dirty);
+
+  if (pace != pacing)
+  {
+    pacing = pace;
+    OS_notify_pace(pace);
+  }
+}
+
+//
+// At the end of a connection event, send the dirty variables and as much of the stream
+// as the link layer will take. Returns 1 while there is more to send, so we're called
+// again after the next connection event.
+//
+unsigned char interpreter_notify(void)
+{
+  gattCharCfg_t* cfg;
+  variable_frame* frame;
+  unsigned char* v;
+  unsigned char i;
+
+  ble_notify_flush();
+  if (!ble_stream.vref)
+  {
+    ble_notify_pace();
+    return ble_dirty;
+  }
+  cfg = ble_stream.vref->cfg;
+  v = get_variable_frame(ble_stream.vref->var, &frame);
+  if (!VARIABLE_IS_DIM(frame) || ble_stream.end > VARIABLE_DIM_SIZE(frame))
+  {
+    ble_stream.offset = ble_stream.end; // Array has gone
+  }
+  while (ble_stream.offset < ble_stream.end)
+  {
+    if (!ble_stream.chunk)
+    {
+      // Size the chunk for the smallest MTU of the subscribed connections
+      unsigned short size = 0;
+      unsigned char listening = 0;
+      for (i = 0; i < linkDBNumConns; i++)
       {
-       unsigned char vname;
-       if (VARIABLE_IS_EXTENDED('H') || VARIABLE_IS_EXTENDED('S') || VARIABLE_IS_EXTENDED('V'))
-        {
-          continue; // Silently fail
-        }
-        VARIABLE_INT_SET('H', connHandle);
-        VARIABLE_INT_SET('S', changeType);
-        if (changeType == LINKDB_STATUS_UPDATE_STATEFLAGS)
+        if (cfg[i].connHandle != INVALID_CONNHANDLE && (cfg[i].value & GATT_CLIENT_CFG_NOTIFY))
         {
-          unsigned char f = 0;
-          for (unsigned char j = 0x01; j < 0x20; j <<= 1) // No direct way to read flag bits!
+          unsigned short mtu = ATT_GetMTU(cfg[i].connHandle) - 3;
+          if (!listening || mtu < size)
           {
-            if (linkDB_State(connHandle, j))
-            {
-              f |= j;
-            }
+            size = mtu;
           }
-          VARIABLE_INT_SET('V', f);
+          listening = 1;
+        }
+      }
+      if (!listening)
+      {
+        // Nobody is listening
+        break;
+      }
+      if (size > ble_stream.end - ble_stream.offset)
+      {
+        size = ble_stream.end - ble_stream.offset;
+      }
+      // The chunk is a byte, so very large MTUs are capped
+      ble_stream.chunk = (size > 0xFF ? 0xFF : size);
+    }
+    for (i = 0; i < linkDBNumConns; i++)
+    {
+      if (cfg[i].connHandle != INVALID_CONNHANDLE && (cfg[i].value & GATT_CLIENT_CFG_NOTIFY) && !(ble_stream.sent & (1 << i)))
+      {
+        attHandleValueNoti_t noti;
+
+        noti.handle = ble_stream.handle;
+        noti.len = ble_stream.chunk;
+        noti.pValue = GATT_bm_alloc(cfg[i].connHandle, ATT_HANDLE_VALUE_NOTI, ble_stream.chunk, NULL);
+        if (!noti.pValue)
+        {
+          return 1;
         }
-        else if (changeType == LINKDB_STATUS_UPDATE_RSSI)
+        OS_memcpy(noti.pValue, v + ble_stream.offset, ble_stream.chunk);
+        if (GATT_Notification(cfg[i].connHandle, &noti, FALSE) != SUCCESS)
         {
-          VARIABLE_INT_SET('V', rssi);
+          // The link layer buffers are full
+          GATT_bm_free((gattMsg_t*)&noti, ATT_HANDLE_VALUE_NOTI);
+          return 1;
         }
-        interpreter_run(vframe->connect, INTERPRETER_CAN_RETURN);
+        ble_stream.sent |= 1 << i;
       }
-#endif
-      if (changeType == LINKDB_STATUS_UPDATE_REMOVED || (changeType == LINKDB_STATUS_UPDATE_STATEFLAGS && !linkDB_Up(connHandle)))
+    }
+    ble_stream.offset += ble_stream.chunk;
+    ble_stream.chunk = 0;
+    ble_stream.sent = 0;
+  }
+  ble_stream_stop();
+  if (ble_stream.complete)
+  {
+    ble_stream.done = ble_stream.complete;
+    ble_stream.complete = 0;
+  }
+  return 0;
+}
+
+//
+// Is the GOSUB of a finished stream waiting for interpreter_stream_run()?
+//
+unsigned char interpreter_stream_complete(void)
+{
+  return ble_stream.done != 0;
+}
+
+//
+// Run the GOSUB of a finished stream.
+//
+void interpreter_stream_run(void)
+{
+  const LINENUM line = ble_stream.done;
+
+  if (line)
+  {
+    ble_stream.done = 0;
+    interpreter_run(line, INTERPRETER_CAN_RETURN);
+  }
+}
+
+//
+// init the BLE client characteristic configurations values of a connection,
+// or of all connections with INVALID_CONNHANDLE
+//
+void ble_init_ccc(unsigned short connHandle)
+{
+  service_frame* vframe;
+  short i;
+  
+  for (vframe = ble_services; vframe; vframe = vframe->next)
+  {
+    for (i = ((short*)vframe->attrs)[-1] - 1; i > 0; i--)
+    {
+      if (vframe->attrs[i].type.uuid == ble_client_characteristic_config_uuid)
+      {
+        gattCharCfg_t *conn = *(gattCharCfg_t **)vframe->attrs[i].pValue;
+        GATTServApp_InitCharCfg(connHandle, conn);
+      }
+    }
+  }
+} 
+
+//
+// BLE connection management. If the ONCONNECT event was specified when a service
+// was created, we forward any connection changes up to the user code.
+//
+void ble_connection_status(unsigned short connHandle, unsigned char changeType, signed char rssi)
+{
+  service_frame* vframe;
+#ifndef BLUEBATTERY
+  VAR_TYPE values[3] = { connHandle, changeType, 0 };
+
+  if (changeType == LINKDB_STATUS_UPDATE_STATEFLAGS)
+  {
+    for (unsigned char j = 0x01; j < 0x20; j <<= 1) // No direct way to read flag bits!
+    {
+      if (linkDB_State(connHandle, j))
       {
-        ble_init_ccc();
+        values[2] |= j;
       }
     }
-  }  
+  }
+  else if (changeType == LINKDB_STATUS_UPDATE_RSSI)
+  {
+    values[2] = rssi;
+  }
+#endif
+
+  // Only the link which went away loses its configuration
+  if (changeType == LINKDB_STATUS_UPDATE_REMOVED || (changeType == LINKDB_STATUS_UPDATE_STATEFLAGS && !linkDB_Up(connHandle)))
+  {
+    ble_init_ccc(connHandle);
+  }
+
+#ifndef BLUEBATTERY
+  for (vframe = ble_services; vframe; vframe = vframe->next)
+  {
+    if (vframe->connect)
+    {
+      ble_handler_run(vframe->connect, 3, values);
+    }
+  }
+#endif
 }
 
-#ifdef TARGET_CC254X
 #if ( HOST_CONFIG & OBSERVER_CFG )    
+//
+// Set one of the scan filter options, following SCAN FILTER:
+//  RSSI <min> - ignore weaker reports
+//  ADTYPE <type>[, <value>] - only reports with this AD type, whose data starts with the 16-bit value
+//  ADDRESS <array> - only reports from these addresses, 6 bytes each in the same order as B()
+//  DUPLICATES <ms> - ignore reports from an address reported less than ms ago
+//  END - remove all filters
+// Returns 1 on error.
+//
+static unsigned char scan_filter_set(void)
+{
+  VAR_TYPE v;
+
+  if (*txtpos == KW_END)
+  {
+    txtpos++;
+    OS_memset(&scan_filter, 0, sizeof(scan_filter));
+  }
+  else if (*txtpos == BLE_DUPLICATES)
+  {
+    txtpos++;
+    v = expression(EXPR_NORMAL);
+    if (v < 0 || v > 0xFFFF)
+    {
+      return 1;
+    }
+    scan_filter.window = v;
+    scan_filter.nrseen = 0;
+  }
+  else if (*txtpos == KW_CONSTANT && txtpos[1] == CO_RSSI)
+  {
+    txtpos += 2;
+    v = expression(EXPR_NORMAL);
+    if (v < -128 || v > 127)
+    {
+      return 1;
+    }
+    scan_filter.rssi = v;
+    scan_filter.flags |= SCAN_FILTER_RSSI;
+  }
+  else if (*txtpos == KW_CONSTANT && txtpos[1] == CO_ADTYPE)
+  {
+    txtpos += 2;
+    v = expression(EXPR_COMMA);
+    if (v < 1 || v > 255)
+    {
+      return 1;
+    }
+    scan_filter.adtype = v;
+    scan_filter.flags = (scan_filter.flags & ~SCAN_FILTER_ADVALUE) | SCAN_FILTER_ADTYPE;
+    if (txtpos[-1] == ',')
+    {
+      scan_filter.advalue = expression(EXPR_NORMAL);
+      scan_filter.flags |= SCAN_FILTER_ADVALUE;
+    }
+  }
+  else if (*txtpos == KW_CONSTANT && txtpos[1] == CO_ADDRESS)
+  {
+    variable_frame* frame;
+    unsigned char* ptr;
+    unsigned short len;
+
+    txtpos += 2;
+    ptr = parse_array_address(&frame);
+    if (!ptr || VARIABLE_DIM_WIDTH(frame) != 1)
+    {
+      return 1;
+    }
+    len = VARIABLE_DIM_DATA(frame) + VARIABLE_DIM_SIZE(frame) - ptr;
+    if (len % B_ADDR_LEN || len > sizeof(scan_filter.addresses))
+    {
+      return 1;
+    }
+    OS_memcpy(scan_filter.addresses, ptr, len);
+    scan_filter.nraddresses = len / B_ADDR_LEN;
+  }
+  else
+  {
+    return 1;
+  }
+  return error_num || *txtpos != NL;
+}
+
+static unsigned char scan_filter_address(unsigned char* a, unsigned char* b)
+{
+  unsigned char i;
+  for (i = 0; i < B_ADDR_LEN && a[i] == b[i]; i++)
+    ;
+  return i == B_ADDR_LEN;
+}
+
+//
+// Check an advertising report against the scan filter.
+//  Returns 1 if the report should be passed to the ONDISCOVER handler.
+//
+static unsigned char scan_filter_match(unsigned char* address, signed char rssi, unsigned char len, unsigned char* data)
+{
+  unsigned char i;
+
+  if ((scan_filter.flags & SCAN_FILTER_RSSI) && rssi < scan_filter.rssi)
+  {
+    return 0;
+  }
+  if (scan_filter.nraddresses)
+  {
+    for (i = 0; i < scan_filter.nraddresses && !scan_filter_address(scan_filter.addresses[i], address); i++)
+      ;
+    if (i == scan_filter.nraddresses)
+    {
+      return 0;
+    }
+  }
+  if (scan_filter.flags & SCAN_FILTER_ADTYPE)
+  {
+    // AD structures are <len><type><data:len-1>
+    unsigned char* ad;
+    for (ad = data; ; ad += ad[0] + 1)
+    {
+      if (ad + 2 > data + len || !ad[0] || ad + ad[0] + 1 > data + len)
+      {
+        return 0;
+      }
+      if (ad[1] == scan_filter.adtype &&
+          (!(scan_filter.flags & SCAN_FILTER_ADVALUE) || (ad[0] >= 3 && (ad[2] | (ad[3] << 8)) == scan_filter.advalue)))
+      {
+        break;
+      }
+    }
+  }
+  if (scan_filter.window)
+  {
+    unsigned short now = (unsigned short)OS_get_millis();
+    unsigned char pass = 1;
+
+    for (i = 0; i < scan_filter.nrseen && !scan_filter_address(scan_filter.seen[i].address, address); i++)
+      ;
+    if (i < scan_filter.nrseen)
+    {
+      pass = ((unsigned short)(now - scan_filter.seen[i].time) >= scan_filter.window);
+      now = pass ? now : scan_filter.seen[i].time;
+    }
+    else if (i == SCAN_FILTER_SEEN)
+    {
+      // Forget the least recently seen address
+      i--;
+    }
+    else
+    {
+      scan_filter.nrseen++;
+    }
+    // Move the address to the front
+    OS_rmemcpy(&scan_filter.seen[1], &scan_filter.seen[0], i * sizeof(scan_filter.seen[0]));
+    OS_memcpy(scan_filter.seen[0].address, address, B_ADDR_LEN);
+    scan_filter.seen[0].time = now;
+    return pass;
+  }
+  return 1;
+}
+
+//
+// Set the array reports are batched into (after SCAN BATCH), or END to run the
+// handler for each report again. Returns 1 on error.
+//
+static unsigned char scan_batch_set(void)
+{
+  variable_frame* frame;
+  unsigned char name;
+  VAR_TYPE size = SCAN_BATCH_ENTRY;
+
+  scan_batch.count = 0;
+  if (*txtpos == KW_END)
+  {
+    txtpos++;
+    scan_batch.name = 0;
+    return *txtpos != NL;
+  }
+  ignore_blanks();
+  name = *txtpos;
+  if (name < 'A' || name > 'Z')
+  {
+    return 1;
+  }
+  txtpos++;
+  get_variable_frame(name, &frame);
+  if (!VARIABLE_IS_DIM(frame) || VARIABLE_DIM_WIDTH(frame) != 1)
+  {
+    return 1;
+  }
+  if (*txtpos == ',')
+  {
+    txtpos++;
+    size = expression(EXPR_NORMAL);
+    if (size < SCAN_BATCH_HEADER || size > SCAN_BATCH_HEADER + 31)
+    {
+      return 1;
+    }
+  }
+  scan_batch.name = name;
+  scan_batch.size = size;
+  return error_num || *txtpos != NL;
+}
+
+//
+// Run the ONDISCOVER handler for the batched reports, with their count in N.
+//
+static void scan_batch_run(void)
+{
+  unsigned char vname;
+  const unsigned short count = scan_batch.count;
+
+  scan_batch.count = 0;
+  if (count && !VARIABLE_IS_EXTENDED('N'))
+  {
+    unsigned char* osp = sp;
+    error_num = ERROR_OK;
+    VARIABLE_INT_SET('N', count);
+    interpreter_run(blueBasic_discover.linenum, INTERPRETER_CAN_RETURN);
+    sp = osp;
+  }
+}
+
+static void scan_batch_add(unsigned char addtype, unsigned char* address, signed char rssi, unsigned char eventtype, unsigned char len, unsigned char* data)
+{
+  variable_frame* frame;
+  unsigned char* entry = get_variable_frame(scan_batch.name, &frame);
+  const unsigned char datalen = scan_batch.size - SCAN_BATCH_HEADER;
+  unsigned short capacity;
+
+  if (!VARIABLE_IS_DIM(frame) || VARIABLE_DIM_WIDTH(frame) != 1)
+  {
+    return;
+  }
+  // The array may have been redimensioned since the last report
+  capacity = VARIABLE_DIM_SIZE(frame) / scan_batch.size;
+  if (scan_batch.count >= capacity)
+  {
+    scan_batch.count = 0;
+    if (!capacity)
+    {
+      return;
+    }
+  }
+  entry += scan_batch.count * scan_batch.size;
+  OS_memcpy(entry, address, B_ADDR_LEN);
+  entry[6] = rssi;
+  entry[7] = addtype;
+  entry[8] = eventtype;
+  entry[9] = len;
+  OS_memset(entry + SCAN_BATCH_HEADER, 0, datalen);
+  OS_memcpy(entry + SCAN_BATCH_HEADER, data, len < datalen ? len : datalen);
+  if (++scan_batch.count == capacity)
+  {
+    scan_batch_run();
+  }
+}
+
+//
+// The scan has ended, deliver what's left of the batch.
+//
+extern void interpreter_discoverycomplete(void)
+{
+  if (blueBasic_discover.linenum && scan_batch.name)
+  {
+    scan_batch_run();
+  }
+}
+
 extern void interpreter_devicefound(unsigned char addtype, unsigned char* address, signed char rssi, unsigned char eventtype, unsigned char len, unsigned char* data)
 {
   unsigned char vname;
 
-  if (blueBasic_discover.linenum && !VARIABLE_IS_EXTENDED('A') && !VARIABLE_IS_EXTENDED('R') && !VARIABLE_IS_EXTENDED('E'))
+  if (!blueBasic_discover.linenum || !scan_filter_match(address, rssi, len, data))
+  {
+    return;
+  }
+  if (scan_batch.name)
+  {
+    scan_batch_add(addtype, address, rssi, eventtype, len, data);
+  }
+  else if (!VARIABLE_IS_EXTENDED('A') && !VARIABLE_IS_EXTENDED('R') && !VARIABLE_IS_EXTENDED('E'))
   {
     unsigned char* osp = sp;
     error_num = ERROR_OK;
     VARIABLE_INT_SET('A', addtype);
     VARIABLE_INT_SET('R', rssi);
     VARIABLE_INT_SET('E', eventtype);
-    create_dim('B', 8, address);
-    create_dim('V', len, data);
+    create_dim('B', VAR_DIM_BYTE, 8, address);
+    create_dim('V', VAR_DIM_BYTE, len, data);
     if (!error_num)
     {
       interpreter_run(blueBasic_discover.linenum, INTERPRETER_CAN_RETURN);
@@ -6586,4 +10002,3 @@ extern void interpreter_devicefound(unsigned char addtype, unsigned char* addres
   }
 }
 #endif
-#endif // TARGET_CC254X
@@ -3,6 +3,8 @@ static const unsigned char keywords_0[] =
   'A','B','S',FUNC_ABS,
   'A','C','T','I','V','E',BLE_ACTIVE,
   'A','D','C',PM_ADC,
+  'A','D','D','R','E','S','S',KW_CONSTANT,CO_ADDRESS,
+  'A','D','T','Y','P','E',KW_CONSTANT,CO_ADTYPE,
   'A','D','V','E','R','T','_','E','N','A','B','L','E','D',KW_CONSTANT,CO_ADVERT_ENABLED,
   'A','D','V','E','R','T',KW_ADVERT,
   'A','N','A','L','O','G',KW_ANALOG,
@@ -20,6 +22,7 @@ static const unsigned char keywords_0[] =
 };
 static const unsigned char keywords_1[] =
 {
+  'B','A','T','C','H',KW_CONSTANT,CO_BATCH,
   'B','A','T','T','E','R','Y',FUNC_BATTERY,
   'B','O','N','D','I','N','G','_','E','N','A','B','L','E','D',KW_CONSTANT,CO_BONDING_ENABLED,
   'B','T','P','E','E','K',BLE_FUNC_BTPEEK,
@@ -36,13 +39,18 @@ static const unsigned char keywords_1[] =
 };
 static const unsigned char keywords_2[] =
 {
+  'C','H','A','N','G','E','D',KW_CONSTANT,CO_CHANGED,
   'C','H','A','R','A','C','T','E','R','I','S','T','I','C',BLE_CHARACTERISTIC,
   'C','L','O','S','E',KW_CLOSE,
+  'C','M','P',FUNC_CMP,
   'C','O','N','F','I','G',KW_CONFIG,
+  'C','O','P','Y',KW_COPY,
+  'C','R','C',FUNC_CRC,
   'C','U','S','T','O','M',BLE_CUSTOM,
   'P','0',KW_PIN_P0,
   'P','1',KW_PIN_P1,
   'P','2',KW_PIN_P2,
+  'P','A','C','K',KW_PACK,
   'P','A','S','S','C','O','D','E',KW_CONSTANT,CO_DEFAULT_PASSCODE,
   'P','I','N','M','O','D','E',KW_PINMODE,
   'P','O','W','E','R',KW_CONSTANT,CO_POWER,
@@ -71,6 +79,8 @@ static const unsigned char keywords_4[] =
   'E','L','S','E',KW_ELSE,
   'E','N','D',KW_END,
   'E','O','F',FUNC_EOF,
+  'E','V','E','N','T',KW_CONSTANT,CO_EVENT,
+  'E','V','E','R','Y',KW_CONSTANT,CO_EVERY,
   'E','X','T','E','R','N','A','L',KW_CONSTANT,CO_EXTERNAL,
   'R','E','A','D',KW_READ,
   'R','E','B','O','O','T',KW_REBOOT,
@@ -81,6 +91,8 @@ static const unsigned char keywords_4[] =
   'R','E','T','U','R','N',KW_RETURN,
   'R','I','S','I','N','G',PM_RISING,
   'R','N','D',FUNC_RND,
+  'R','O','T','A','T','E',KW_CONSTANT,CO_ROTATE,
+  'R','S','S','I',KW_CONSTANT,CO_RSSI,
   'R','U','N',KW_RUN,
   'R','X','G','A','I','N',KW_CONSTANT,CO_RXGAIN,
   0
@@ -89,6 +101,9 @@ static const unsigned char keywords_5[] =
 {
   'F','A','L','L','I','N','G',PM_FALLING,
   'F','A','L','S','E',KW_CONSTANT,CO_FALSE,
+  'F','I','L','L',KW_FILL,
+  'F','I','L','T','E','R',BLE_FILTER,
+  'F','I','N','D',FUNC_FIND,
   'F','O','R',KW_FOR,
   'S','C','A','N',KW_SCAN,
   'S','E','R','I','A','L',KW_SERIAL,
@@ -98,6 +113,9 @@ static const unsigned char keywords_5[] =
   'S','P','I',KW_SPI,
   'S','T','E','P',ST_STEP,
   'S','T','O','P',TI_STOP,
+  'S','T','R','E','A','M',KW_CONSTANT,CO_STREAM,
+  'S','T','R',FUNC_STR,
+  'S','U','M',FUNC_SUM,
   0
 };
 static const unsigned char keywords_6[] =
@@ -125,6 +143,7 @@ static const unsigned char keywords_7[] =
 {
   '!','=',OP_NE_BANG,
   'H','I','G','H',KW_CONSTANT,CO_HIGH,
+  'U','P','D','A','T','E',KW_CONSTANT,CO_UPDATE,
   '|',OP_OR,
   0
 };
@@ -142,6 +161,8 @@ static const unsigned char keywords_8[] =
   'I','N','P','U','T',PM_INPUT,
   'I','N','T','E','R','N','A','L',KW_CONSTANT,CO_INTERNAL,
   'I','N','T','E','R','R','U','P','T',KW_INTERRUPT,
+  'V','A','L',FUNC_VAL,
+  'V','E','D','I','R','E','C','T',KW_VEDIRECT,
   0
 };
 static const unsigned char keywords_9[] =
@@ -151,6 +172,7 @@ static const unsigned char keywords_9[] =
   '=',OP_EQ,
   'W','A','I','T',PM_WAIT,
   'W','I','R','E',KW_WIRE,
+  'W','O','R','D',KW_CONSTANT,CO_WORD,
   'W','R','I','T','E','N','O','R','S','P',BLE_WRITENORSP,
   'W','R','I','T','E',KW_WRITE,
   0
@@ -171,6 +193,8 @@ static const unsigned char keywords_11[] =
   'L','I','M','_','D','I','S','C','_','A','D','V','_','I','N','T','_','M','A','X',KW_CONSTANT,CO_LIM_DISC_INT_MAX,
   'L','I','M','_','D','I','S','C','_','A','D','V','_','I','N','T','_','M','I','N',KW_CONSTANT,CO_LIM_DISC_INT_MIN,
   'L','I','S','T',KW_LIST,
+  'L','O','A','D',KW_LOAD,
+  'L','O','N','G',KW_CONSTANT,CO_LONG,
   'L','O','W',KW_CONSTANT,CO_LOW,
   'L','S','B',SPI_LSB,
   'Y','E','S',KW_CONSTANT,CO_YES,
@@ -78,6 +78,7 @@ struct keyword
   { "RESOLUTION", "KW_CONSTANT,CO_RESOLUTION" },
   { "INTERNAL", "KW_CONSTANT,CO_INTERNAL" },
   { "EXTERNAL", "KW_CONSTANT,CO_EXTERNAL" },
+  { "AVDD", "KW_CONSTANT,CO_AVDD" },
   { "ONREAD", "BLE_ONREAD" },
   { "ONWRITE", "BLE_ONWRITE" },
   { "ONCONNECT", "BLE_ONCONNECT" },
@@ -118,6 +119,20 @@ struct keyword
   { "TRUNCATE", "FS_TRUNCATE" },
   { "APPEND", "FS_APPEND" },
   { "EOF", "FUNC_EOF" },
+  { "FILL", "KW_FILL" },
+  { "COPY", "KW_COPY" },
+  { "SUM", "FUNC_SUM" },
+  { "CMP", "FUNC_CMP" },
+  { "CRC", "FUNC_CRC" },
+  { "FIND", "FUNC_FIND" },
+  { "VAL", "FUNC_VAL" },
+  { "STR", "FUNC_STR" },
+  { "POW", "FUNC_POW" },
+  { "TEMP", "FUNC_TEMP" },
+  { "PACK", "KW_PACK" },
+  { "FILTER", "BLE_FILTER" },
+  { "LOAD", "KW_LOAD" },
+  { "VEDIRECT", "KW_VEDIRECT" },
   //
   // Constants
   //
@@ -148,6 +163,20 @@ struct keyword
   { "BONDING_ENABLED", "KW_CONSTANT,CO_BONDING_ENABLED" },
 
   { "POWER", "KW_CONSTANT,CO_POWER" },
+
+  { "WORD", "KW_CONSTANT,CO_WORD" },
+  { "LONG", "KW_CONSTANT,CO_LONG" },
+
+  { "RSSI", "KW_CONSTANT,CO_RSSI" },
+  { "ADTYPE", "KW_CONSTANT,CO_ADTYPE" },
+  { "ADDRESS", "KW_CONSTANT,CO_ADDRESS" },
+  { "BATCH", "KW_CONSTANT,CO_BATCH" },
+  { "STREAM", "KW_CONSTANT,CO_STREAM" },
+  { "CHANGED", "KW_CONSTANT,CO_CHANGED" },
+  { "EVERY", "KW_CONSTANT,CO_EVERY" },
+  { "EVENT", "KW_CONSTANT,CO_EVENT" },
+  { "UPDATE", "KW_CONSTANT,CO_UPDATE" },
+  { "ROTATE", "KW_CONSTANT,CO_ROTATE" },
 };
 
 #define	NR_TABLES	13
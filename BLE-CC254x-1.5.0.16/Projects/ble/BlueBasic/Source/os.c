@@ -12,7 +12,7 @@
 #include "OSAL.h"
 #include "OSAL_Clock.h"
 #include "hal_uart.h"
-#ifdef HAL_I2C
+#if HAL_I2C
 #include "hal_i2c.h"
 #endif
 #include "OSAL_PwrMgr.h"
@@ -70,7 +70,7 @@ os_serial_t serial[OS_MAX_SERIAL];
 uint8 uart_stop_polling = 1;
 #endif
 
-#ifdef HAL_I2C
+#if HAL_I2C
 // I2C
 os_i2c_t i2c[1];
 unsigned char prevent_sleep_flags = 0; 
@@ -98,6 +98,7 @@ static struct {
 #if ENABLE_BLE_CONSOLE
 
 extern unsigned char ble_console_write(unsigned char ch);
+extern void ble_console_write_buffer(const unsigned char* buf, unsigned char len);
 extern unsigned char ble_console_enabled;
 
 #endif
@@ -200,6 +201,11 @@ void OS_putchar(char ch)
 {
   ble_console_write(ch);
 }
+
+void OS_putbuffer(const char* buf, unsigned char len)
+{
+  ble_console_write_buffer((const unsigned char*)buf, len);
+}
 #endif
 
 void* OS_rmemcpy(void *dst, const void GENERIC *src, unsigned int len)
@@ -247,6 +253,25 @@ char OS_timer_start(unsigned char id, unsigned long timeout, unsigned char repea
   return 1;
 }
 
+//
+// Pace notification streams by the end of each connection event, and send the first part now.
+//
+void OS_notify_pace(unsigned char enable)
+{
+  uint16 connHandle;
+
+  GAPRole_GetParameter(GAPROLE_CONNHANDLE, &connHandle);
+  if (enable)
+  {
+    HCI_EXT_ConnEventNoticeCmd(connHandle, blueBasic_TaskID, BLUEBASIC_CONNECTION_EVENT);
+    osal_set_event(blueBasic_TaskID, BLUEBASIC_CONNECTION_EVENT);
+  }
+  else
+  {
+    HCI_EXT_ConnEventNoticeCmd(connHandle, INVALID_TASK_ID, 0);
+  }
+}
+
 #if ENABLE_YIELD
 void OS_yield(unsigned short linenum)
 {
@@ -350,6 +375,74 @@ void OS_flashstore_init(void)
   }
 }
 
+#ifdef FEATURE_FILESTORE
+//
+// SPI FRAM (FM25V, MB85RS and the like) on USART1 alt. 2: SCK P1.5, MOSI P1.6, MISO P1.7,
+// and chip select on P1.FILESTORE_CS. The USART is then not available to SERIAL or SPI.
+//
+#ifndef FILESTORE_CS
+#define FILESTORE_CS    4
+#endif
+#define FRAM_WREN       0x06
+#define FRAM_WRITE      0x02
+#define FRAM_READ       0x03
+
+static unsigned char fram_byte(unsigned char ch)
+{
+  U1CSR &= 0xF9;
+  U1DBUF = ch;
+  while ((U1CSR & 0x02) != 0x02)
+    ;
+  return U1DBUF;
+}
+
+static void fram_select(unsigned char cmd, unsigned long addr)
+{
+  P1 &= ~(1 << FILESTORE_CS);
+  fram_byte(cmd);
+#if FILESTORE_LEN > 0x10000
+  fram_byte(addr >> 16);
+#endif
+  fram_byte(addr >> 8);
+  fram_byte(addr);
+}
+
+void OS_filestore_init(void)
+{
+  P1 |= 1 << FILESTORE_CS;
+  P1SEL = (P1SEL & ~(1 << FILESTORE_CS)) | 0xE0;
+  P1DIR |= 1 << FILESTORE_CS;
+  PERCFG |= 0x02;
+  U1BAUD = 0;
+  U1GCR = 0x20 | 17; // Mode 0, MSB first, 4MHz
+  U1CSR = 0x00;      // SPI master
+}
+
+void OS_filestore_read(unsigned long addr, unsigned char* buf, unsigned char len)
+{
+  fram_select(FRAM_READ, addr);
+  while (len--)
+  {
+    *buf++ = fram_byte(0);
+  }
+  P1 |= 1 << FILESTORE_CS;
+}
+
+void OS_filestore_write(unsigned long addr, const unsigned char* buf, unsigned char len)
+{
+  // FRAM writes at bus speed, so there's nothing to wait for
+  P1 &= ~(1 << FILESTORE_CS);
+  fram_byte(FRAM_WREN);
+  P1 |= 1 << FILESTORE_CS;
+  fram_select(FRAM_WRITE, addr);
+  while (len--)
+  {
+    fram_byte(*buf++);
+  }
+  P1 |= 1 << FILESTORE_CS;
+}
+#endif
+
 
 void OS_enable_sleep(unsigned char enable)
 {
@@ -536,7 +629,7 @@ unsigned char OS_serial_open(unsigned char port, unsigned long baud, unsigned ch
   extern uint8 Hal_TaskID;
 //  CLEAR_SLEEP_MODE();
 //  osal_pwrmgr_task_state(Hal_TaskID, PWRMGR_HOLD);
-#ifdef HAL_I2C
+#if HAL_I2C
   prevent_sleep_flags |= 0x01;
 #endif
 #endif
@@ -573,6 +666,12 @@ unsigned char OS_serial_open(unsigned char port, unsigned long baud, unsigned ch
 #ifdef PROCESS_SERIAL_DATA
     serial[port].sbuf_read_pos = 16;
 #endif
+#if defined(PROCESS_MPPT) && MPPT_MODE_HEX
+    if (flow == 'M')
+    {
+      mppt_reset(port, 1);
+    }
+#endif
 #if !(UART_USE_CALLBACK)  
 //    if (onread != 0 || onwrite != 0)
     {
@@ -636,7 +735,7 @@ unsigned char OS_serial_close(unsigned char port)
   {
 #if HAL_UART_DMA
     extern uint8 Hal_TaskID;
-#ifndef HAL_I2C
+#if !HAL_I2C
     osal_pwrmgr_task_state(Hal_TaskID, PWRMGR_CONSERVE);
 #else
     prevent_sleep_flags &= 0xFE;
@@ -792,6 +891,176 @@ unsigned char OS_i2c_available(unsigned char port, unsigned char ch)
 }
 #endif
 
+#if defined(HAL_DMA) && HAL_DMA
+#if OS_SPI_DMA
+volatile unsigned char OS_spi_dma_busy;
+
+//
+// Exchange an array with the SPI slave in place. The RX channel stores each byte as it
+// arrives, the TX channel feeds the next byte from the array each time the USART is ready,
+// and writing the first byte by hand sets it going.
+//
+void OS_spi_dma(unsigned char channel, unsigned char* data, unsigned short len)
+{
+  halDMADesc_t* ch;
+
+  OS_spi_dma_busy = 1;
+
+  ch = HAL_DMA_GET_DESC1234(OS_SPI_DMA_RX);
+  HAL_DMA_SET_SOURCE(ch, channel ? 0x70F9 : 0x70C1); // X_U1DBUF : X_U0DBUF
+  HAL_DMA_SET_DEST(ch, data);
+  HAL_DMA_SET_VLEN(ch, HAL_DMA_VLEN_USE_LEN);
+  HAL_DMA_SET_LEN(ch, len);
+  HAL_DMA_SET_WORD_SIZE(ch, HAL_DMA_WORDSIZE_BYTE);
+  HAL_DMA_SET_TRIG_MODE(ch, HAL_DMA_TMODE_SINGLE);
+  HAL_DMA_SET_TRIG_SRC(ch, channel ? HAL_DMA_TRIG_URX1 : HAL_DMA_TRIG_URX0);
+  HAL_DMA_SET_SRC_INC(ch, HAL_DMA_SRCINC_0);
+  HAL_DMA_SET_DST_INC(ch, HAL_DMA_DSTINC_1);
+  HAL_DMA_SET_IRQ(ch, HAL_DMA_IRQMASK_ENABLE);
+  HAL_DMA_SET_M8(ch, HAL_DMA_M8_USE_8_BITS);
+  HAL_DMA_SET_PRIORITY(ch, HAL_DMA_PRI_HIGH);
+  HAL_DMA_CLEAR_IRQ(OS_SPI_DMA_RX);
+  HAL_DMA_ARM_CH(OS_SPI_DMA_RX);
+
+  if (len > 1)
+  {
+    ch = HAL_DMA_GET_DESC1234(OS_SPI_DMA_TX);
+    HAL_DMA_SET_SOURCE(ch, data + 1);
+    HAL_DMA_SET_DEST(ch, channel ? 0x70F9 : 0x70C1);
+    HAL_DMA_SET_VLEN(ch, HAL_DMA_VLEN_USE_LEN);
+    HAL_DMA_SET_LEN(ch, len - 1);
+    HAL_DMA_SET_WORD_SIZE(ch, HAL_DMA_WORDSIZE_BYTE);
+    HAL_DMA_SET_TRIG_MODE(ch, HAL_DMA_TMODE_SINGLE);
+    HAL_DMA_SET_TRIG_SRC(ch, channel ? HAL_DMA_TRIG_UTX1 : HAL_DMA_TRIG_UTX0);
+    HAL_DMA_SET_SRC_INC(ch, HAL_DMA_SRCINC_1);
+    HAL_DMA_SET_DST_INC(ch, HAL_DMA_DSTINC_0);
+    HAL_DMA_SET_IRQ(ch, HAL_DMA_IRQMASK_DISABLE);
+    HAL_DMA_SET_M8(ch, HAL_DMA_M8_USE_8_BITS);
+    HAL_DMA_SET_PRIORITY(ch, HAL_DMA_PRI_HIGH);
+    HAL_DMA_ARM_CH(OS_SPI_DMA_TX);
+  }
+
+  // Arming takes a few cycles to settle
+  asm("NOP"); asm("NOP"); asm("NOP"); asm("NOP"); asm("NOP");
+  asm("NOP"); asm("NOP"); asm("NOP"); asm("NOP");
+
+  if (channel)
+  {
+    U1CSR &= 0xF9;
+    U1DBUF = *data;
+  }
+  else
+  {
+    U0CSR &= 0xF9;
+    U0DBUF = *data;
+  }
+}
+
+//
+// Stop a transfer that hasn't finished.
+//
+void OS_spi_dma_abort(void)
+{
+  halIntState_t intState;
+
+  HAL_ENTER_CRITICAL_SECTION(intState);
+  HAL_DMA_ABORT_CH(OS_SPI_DMA_TX);
+  HAL_DMA_ABORT_CH(OS_SPI_DMA_RX);
+  HAL_DMA_CLEAR_IRQ(OS_SPI_DMA_RX);
+  OS_spi_dma_busy = 0;
+  HAL_EXIT_CRITICAL_SECTION(intState);
+}
+#endif
+
+#if OS_ADC_SCAN
+volatile signed char OS_adc_scan_block = -1; // The half of the buffer just filled
+static short* adc_scan_buffer;
+static unsigned short adc_scan_len;
+static unsigned char adc_scan_half;
+
+static void adc_scan_arm(void)
+{
+  halDMADesc_t* ch = HAL_DMA_GET_DESC1234(OS_ADC_DMA);
+  HAL_DMA_SET_DEST(ch, adc_scan_buffer + (adc_scan_half ? adc_scan_len : 0));
+  HAL_DMA_ARM_CH(OS_ADC_DMA);
+}
+
+//
+// Convert the ADC sequence AIN0..SCH each period (in 4us ticks) of Timer 1, and have the
+// DMA fill one half of the buffer with len results while the other half is looked at.
+// Timer 1 is ours while this runs.
+//
+void OS_adc_scan_start(unsigned char adccon2, unsigned short period, short* buffer, unsigned short len)
+{
+  halDMADesc_t* ch = HAL_DMA_GET_DESC1234(OS_ADC_DMA);
+
+  adc_scan_buffer = buffer;
+  adc_scan_len = len;
+  adc_scan_half = 0;
+  OS_adc_scan_block = -1;
+
+  HAL_DMA_SET_SOURCE(ch, 0x70BA); // X_ADCL, and X_ADCH follows
+  HAL_DMA_SET_VLEN(ch, HAL_DMA_VLEN_USE_LEN);
+  HAL_DMA_SET_LEN(ch, len);
+  HAL_DMA_SET_WORD_SIZE(ch, HAL_DMA_WORDSIZE_WORD);
+  HAL_DMA_SET_TRIG_MODE(ch, HAL_DMA_TMODE_SINGLE);
+  HAL_DMA_SET_TRIG_SRC(ch, HAL_DMA_TRIG_ADC_CHALL);
+  HAL_DMA_SET_SRC_INC(ch, HAL_DMA_SRCINC_0);
+  HAL_DMA_SET_DST_INC(ch, HAL_DMA_DSTINC_1);
+  HAL_DMA_SET_IRQ(ch, HAL_DMA_IRQMASK_ENABLE);
+  HAL_DMA_SET_M8(ch, HAL_DMA_M8_USE_8_BITS);
+  HAL_DMA_SET_PRIORITY(ch, HAL_DMA_PRI_HIGH);
+  HAL_DMA_CLEAR_IRQ(OS_ADC_DMA);
+  adc_scan_arm();
+
+  T1CTL = 0x00;
+  T1CNTL = 0x00;
+  T1CC0L = (period - 1) & 0xFF;
+  T1CC0H = (period - 1) >> 8;
+  T1CCTL0 = 0x04; // Compare, no interrupt
+  ADCCON2 = adccon2;
+  ADCCON1 = 0x23; // Start a sequence on Timer 1 channel 0 compare
+  T1CTL = 0x0E;   // Tick/128, modulo
+}
+
+void OS_adc_scan_stop(void)
+{
+  T1CTL = 0x00;
+  ADCCON1 = 0x33; // Start by hand again
+  HAL_DMA_ABORT_CH(OS_ADC_DMA);
+  adc_scan_buffer = NULL;
+  OS_adc_scan_block = -1;
+}
+#endif
+
+//
+// Called from the hal DMA interrupt. The task has no event bit left for this, so we raise
+// the message event; it is fine with an empty queue and checks what finished when it runs.
+//
+void bb_dmaisr(void)
+{
+#if OS_SPI_DMA
+  if (HAL_DMA_CHECK_IRQ(OS_SPI_DMA_RX))
+  {
+    HAL_DMA_CLEAR_IRQ(OS_SPI_DMA_RX);
+    OS_spi_dma_busy = 0;
+    osal_set_event(blueBasic_TaskID, SYS_EVENT_MSG);
+  }
+#endif
+#if OS_ADC_SCAN
+  if (adc_scan_buffer && HAL_DMA_CHECK_IRQ(OS_ADC_DMA))
+  {
+    // Swap halves. The next sequence starts a period later, so there's time.
+    HAL_DMA_CLEAR_IRQ(OS_ADC_DMA);
+    OS_adc_scan_block = adc_scan_half;
+    adc_scan_half ^= 1;
+    adc_scan_arm();
+    osal_set_event(blueBasic_TaskID, SYS_EVENT_MSG);
+  }
+#endif
+}
+#endif
+
 // read temperature adc
 int16 read_temperature_adc(void)
 {
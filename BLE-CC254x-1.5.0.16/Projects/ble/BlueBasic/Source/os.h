@@ -43,15 +43,25 @@
 #define ENABLE_PORT0    1
 #define ENABLE_PORT1    1
 #define SIMULATE_FLASH  1
+// Build with SIMULATE_FILESTORE=0 to test files kept in the internal flash store instead
+#ifndef SIMULATE_FILESTORE
+#define SIMULATE_FILESTORE 1
+#endif
+#if SIMULATE_FILESTORE
+#define FEATURE_FILESTORE 1 // File records on the in-memory FRAM in os.c
+#endif
+#define FEATURE_SAMPLING  1 // ADC results are replayed from a capture, see os.c
+#define FEATURE_TRUE_RMS  1
+#define OS_ADC_SCAN       1
 
 #define OS_memset(A, B, C)    memset(A, B, C)
-#define OS_memcpy(A, B, C)    memcpy(A, B, C)
 #define OS_rmemcpy(A, B, C)   memmove(A, B, C)
 #define OS_srand(A)           srandom(A)
 #define OS_rand()             random()
 #define OS_malloc(A)          malloc(A)
 #define OS_free(A)            free(A)
 #define OS_putchar(A)         putchar(A)
+#define OS_putbuffer(A, L)    fwrite(A, 1, L, stdout)
 #define OS_breakcheck()       (0)
 #define OS_reboot(F)
 #define OS_set_millis(V)      do { } while ((void)(V), 0)
@@ -60,6 +70,12 @@
 #define OS_delaymicroseconds(A) do { } while ((void)(A), 0)
 #define OS_yield(A)
 
+// Like osal_memcpy, returns the end
+static inline void* OS_memcpy(void* dst, const void* src, unsigned int len)
+{
+  return (unsigned char*)memcpy(dst, src, len) + len;
+}
+
 extern void OS_prompt_buffer(unsigned char* start, unsigned char* end);
 extern char OS_prompt_available(void);
 extern void OS_timer_stop(unsigned char id);
@@ -69,6 +85,7 @@ extern void OS_flashstore_write(unsigned long faddr, unsigned char* value, unsig
 extern void OS_flashstore_erase(unsigned long page);
 extern void OS_init(void);
 extern uint32_t OS_get_millis(void);
+extern short OS_adc_sample(unsigned char channel);
 
 // command line option from main.c
 extern unsigned char flashstore_nrpages;
@@ -128,6 +145,12 @@ extern unsigned char flashstore_nrpages;
 #define GAP_DEVICE_NAME_LEN                   21
 #define GGS_DEVICE_NAME_ATT                   0
 
+#define B_ADDR_LEN                            6
+
+// Simulate the observer role, scan reports are replayed from a capture (see os.c)
+#define OBSERVER_CFG                          0x02
+#define HOST_CONFIG                           OBSERVER_CFG
+
 #define HCI_EXT_TX_POWER_MINUS_23_DBM         0
 #define HCI_EXT_TX_POWER_MINUS_6_DBM          1
 #define HCI_EXT_TX_POWER_0_DBM                2
@@ -166,15 +189,28 @@ typedef struct
 
 typedef struct gattCharCfg
 {
-  unsigned short connhandle;
+  unsigned short connHandle;
   unsigned char value;
 } gattCharCfg_t;
 
+typedef struct
+{
+  unsigned short handle;
+  unsigned char len;
+  unsigned char* pValue;
+} attHandleValueNoti_t;
+
+typedef attHandleValueNoti_t gattMsg_t;
+
+#define ATT_HANDLE_VALUE_NOTI   0x1B
+
 #define bool unsigned char
 #define uint8 unsigned char
 #define uint16 unsigned short
 #define int8 char
 #define int16 short
+#define int32 int32_t
+#define uint32 uint32_t
 #define FALSE 0
 #define TRUE 1
 #define linkDBNumConns 1
@@ -211,6 +247,24 @@ extern unsigned char HCI_EXT_SetRxGainCmd(unsigned char gain);
 extern unsigned char GAPObserverRole_StartDiscovery(unsigned char mode, unsigned char active, unsigned char whitelist);
 extern unsigned char GAPObserverRole_CancelDiscovery(void);
 extern bStatus_t GAP_SetParamValue( gapParamIDs_t paramID, uint16 paramValue );
+extern uint16 ATT_GetMTU(uint16 connHandle);
+extern void* GATT_bm_alloc(uint16 connHandle, uint8 opcode, uint16 size, uint16* pSizeAlloc);
+extern void GATT_bm_free(gattMsg_t* pMsg, uint8 opcode);
+extern bStatus_t GATT_Notification(uint16 connHandle, attHandleValueNoti_t* pNoti, uint8 authenticated);
+extern void OS_notify_pace(unsigned char enable);
+
+extern void interpreter_devicefound(unsigned char addtype, unsigned char* address, signed char rssi, unsigned char eventtype, unsigned char len, unsigned char* data);
+extern void interpreter_discoverycomplete(void);
+extern unsigned char interpreter_notify(void);
+extern unsigned char interpreter_stream_complete(void);
+extern void interpreter_stream_run(void);
+extern void interpreter_flashmoved(void);
+extern void interpreter_advert_update(void);
+extern void interpreter_advert_rotate(void);
+extern unsigned char interpreter_wire(unsigned short line);
+extern unsigned char interpreter_load(const unsigned char* data, unsigned char len);
+extern void interpreter_load_run(void);
+extern void interpreter_load_abort(void);
 
 #define osal_run_system()
 
@@ -249,11 +303,32 @@ extern bStatus_t GAP_SetParamValue( gapParamIDs_t paramID, uint16 paramValue );
 #include "victron_mppt.h"
 #endif
 
-#if HAL_I2C_MASTER
+#if HAL_I2C
 #include "hal_i2c.h"
+#if HAL_I2C_MASTER
 #define OS_I2C_INIT HalI2CInit(i2cClock_267KHZ)
 #define OS_I2C_READ(adr, len, pBuf) HalI2CRead(adr, len, pBuf)
 #define OS_I2C_WRITE(adr, len, pBuf) HalI2CWrite(adr, len, pBuf)
+#else
+#define OS_I2C_INIT HalI2CMasterInit(i2cClock_267KHZ)
+#endif
+#define OS_I2C_TRANSFER(adr, wlen, wBuf, rlen, rBuf) HalI2CTransfer(adr, wlen, wBuf, rlen, rBuf)
+#endif
+
+#if defined(HAL_DMA) && HAL_DMA
+#include "hal_dma.h"
+#endif
+#if defined(HAL_DMA) && HAL_DMA && (!defined(ENABLE_SPI) || ENABLE_SPI)
+// SPI array transfers use the DMA channels otherwise kept for AES, which we don't use
+#define OS_SPI_DMA                1
+#define OS_SPI_DMA_RX             1
+#define OS_SPI_DMA_TX             2
+#endif
+#if defined(FEATURE_SAMPLING) && defined(HAL_DMA) && HAL_DMA
+// ANALOG SCAN runs ADC sequences from Timer 1 and moves the results by DMA. It shares
+// its channel with SPI TRANSFER, which polls while a scan is running.
+#define OS_ADC_SCAN               1
+#define OS_ADC_DMA                2
 #endif
 
 // Configurations
@@ -354,7 +429,7 @@ typedef struct
 extern os_serial_t serial[OS_MAX_SERIAL];
 #endif
 
-#ifdef HAL_I2C
+#if HAL_I2C
 // I2C
 typedef struct
 {
@@ -378,24 +453,6 @@ typedef struct
 } os_timer_t;
 extern os_timer_t blueBasic_timers[OS_MAX_TIMER];
 
-#ifdef FEATURE_SAMPLING
-typedef struct {
-#ifdef FEATURE_TRUE_RMS
-  int32 adc[8];
-#else
-  int16 adc[8];
-#endif
-  uint8 map;
-  uint8 timer;
-  uint16 timeout;
-  uint16 duty;
-  uint8 pin;
-  uint8 polarity;
-  uint8 mode;
-} os_sampling_t;
-extern os_sampling_t sampling;
-#endif
-
 extern unsigned short bluebasic_yield_linenum;
 extern unsigned char bluebasic_block_execution;
 
@@ -440,6 +497,7 @@ extern unsigned char bluebasic_block_execution;
 #define OS_PUTCHAR(c) OS_putchar(c)
 #define OS_TYPE(c) OS_type(c)
 extern void OS_putchar(char ch);
+extern void OS_putbuffer(const char* buf, unsigned char len);
 extern void OS_type(char ch);
 #else
 #define OS_PUTCHAR(c)
@@ -462,8 +520,27 @@ extern void OS_delaymicroseconds(short micros);
 extern void OS_reboot(char flash);
 extern void OS_flashstore_init(void);
 extern void OS_enable_sleep(unsigned char enable);
+extern void OS_notify_pace(unsigned char enable);
 
 extern void interpreter_devicefound(unsigned char addtype, unsigned char* address, signed char rssi, unsigned char eventtype, unsigned char len, unsigned char* data);
+extern void interpreter_discoverycomplete(void);
+extern unsigned char interpreter_notify(void);
+extern unsigned char interpreter_stream_complete(void);
+extern void interpreter_stream_run(void);
+extern void interpreter_flashmoved(void);
+extern void interpreter_advert_update(void);
+extern void interpreter_advert_rotate(void);
+extern unsigned char interpreter_wire(unsigned short line);
+extern unsigned char interpreter_load(const unsigned char* data, unsigned char len);
+extern void interpreter_load_run(void);
+extern void interpreter_load_abort(void);
+#if OS_SPI_DMA
+extern unsigned char interpreter_spi_complete(void);
+extern void interpreter_spi_run(void);
+extern volatile unsigned char OS_spi_dma_busy;
+extern void OS_spi_dma(unsigned char channel, unsigned char* data, unsigned short len);
+extern void OS_spi_dma_abort(void);
+#endif
 
 #endif /* __APPLE__ */
 
@@ -553,8 +630,39 @@ extern unsigned char interpreter_run(unsigned short gofrom, unsigned char canret
 extern void interpreter_timer_event(unsigned short id);
 
 #ifdef FEATURE_SAMPLING
+// The last length samples of a channel, from the interpreter heap
+typedef struct {
+#ifdef FEATURE_TRUE_RMS
+  int32* samples;
+#else
+  int16* samples;
+#endif
+  int32 sum;
+  uint8 length;
+  uint8 next;
+} os_sampling_window_t;
+
+typedef struct {
+  os_sampling_window_t window[8];
+  uint8 map;
+  uint8 timer;
+  uint16 timeout;
+  uint16 duty;
+  uint8 pin;
+  uint8 polarity;
+  uint8 mode;
+  uint8 power;  // ANALOG POWER is counting
+  uint8 active; // ANALOG TIMER is running, so the timer is ours
+} os_sampling_t;
+extern os_sampling_t sampling;
 extern void interpreter_sampling(void);
 #endif
+#if OS_ADC_SCAN
+extern void interpreter_adc_scan(void);
+extern volatile signed char OS_adc_scan_block;
+extern void OS_adc_scan_start(unsigned char adccon2, unsigned short period, short* buffer, unsigned short len);
+extern void OS_adc_scan_stop(void);
+#endif
 
 #define PIN_MAKE(A,I) (((A) << 6) | ((I) << 3))
 #define PIN_MAJOR(P)  ((P) >> 6)
@@ -577,6 +685,7 @@ enum
 {
   FLASHSPECIAL_AUTORUN = 0x00000001,
   FLASHSPECIAL_SNV     = 0x00000100,
+  FLASHSPECIAL_GATT    = 0x00010000, // + line number of the GATT SERVICE
   FLASHSPECIAL_FILE0   = 0x00100000,
   FLASHSPECIAL_FILE25  = 0x00290000,
 };
@@ -590,13 +699,46 @@ enum
 
 #define SNV_MAKE_ID(FILENAME) ((FILENAME) - '0' + BLE_NVID_CUST_START)
 
+#ifdef FEATURE_FILESTORE
+// File records live apart from the program, on an external SPI FRAM of FILESTORE_LEN bytes
+#ifndef FILESTORE_LEN
+#define FILESTORE_LEN             0x20000 // 1 Mbit
+#endif
+#define FS_IS_FILE_SPECIAL(ID)    ((ID) >= FLASHSPECIAL_FILE0 && (ID) <= (FLASHSPECIAL_FILE25 | 0xFFFF))
+extern void OS_filestore_init(void);
+extern void filestore_init(void);
+extern void OS_filestore_read(unsigned long addr, unsigned char* buf, unsigned char len);
+extern void OS_filestore_write(unsigned long addr, const unsigned char* buf, unsigned char len);
+#endif
+
+// Program labels are @<name>. The tokenizer stores the '@' as the label's id, 0x10 to 0x1F,
+// so a jump goes straight to the line. An '@' is left when there is no id to give, and
+// FLASHSTORE_IS_LABEL() is true for both.
+#define FLASHSTORE_LABEL          '@'
+#define FLASHSTORE_LABEL_CHAR(C)  (((C) >= 'A' && (C) <= 'Z') || ((C) >= '0' && (C) <= '9') || (C) == '_')
+#define FLASHSTORE_NRLABELS       16
+#define FLASHSTORE_LABEL_TOKEN(I) (0x10 + (I))
+#define FLASHSTORE_LABEL_ID(C)    ((C) - 0x10)
+#define FLASHSTORE_IS_LABEL(C)    (((C) & 0xF0) == 0x10 || (C) == FLASHSTORE_LABEL)
+// The one token followed by an operand byte, which may be anything
+#define FLASHSTORE_TOKEN_OPERAND  0x80
+#define FLASHSTORE_LABELS_OK        0
+#define FLASHSTORE_LABELS_DUPLICATE 1
+#define FLASHSTORE_LABELS_FULL      2
+
 extern unsigned char** flashstore_init(unsigned char** startmem);
 extern unsigned char** flashstore_addline(unsigned char* line);
+extern unsigned char flashstore_appendline(unsigned char* line);
 extern unsigned char** flashstore_deleteline(unsigned short id);
 extern unsigned char** flashstore_deleteall(void);
 extern unsigned short** flashstore_findclosest(unsigned short id);
+extern unsigned char flashstore_labelid(unsigned char* name);
+extern void flashstore_labelsreset(void);
+extern unsigned char** flashstore_labelline(unsigned char id);
+extern unsigned char flashstore_labelerror(unsigned char*** line);
 extern unsigned int flashstore_freemem(void);
 extern void flashstore_compact(unsigned char asklen, unsigned char* tempmemstart, unsigned char* tempmemend);
+extern void flashstore_compactall(unsigned char* tempmemstart, unsigned char* tempmemend);
 extern unsigned char flashstore_addspecial(unsigned char* item);
 extern unsigned char flashstore_deletespecial(unsigned long specialid);
 extern unsigned char* flashstore_findspecial(unsigned long specialid);
@@ -10,35 +10,13 @@
 // victron_mppt.c
 //
 
-//#define MPPT_TEST
-
 #ifndef MPPT_TEST
 #include "os.h"
 #include "hal_uart.h"
-#else // MPPT_TEST
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <memory.h>
-
-#define MPPT_MODE_TEXT 1
-#define MPPT_MODE_HEX 0
-#define MPPT_AS_VOT 1
-#define FIELD_SIZEOF(t, f) (sizeof(((t*)0)->f))
-#define OS_MAX_SERIAL 1
-
-#define osal_memset(a,b,c) memset(a,b,c)
-#define uint8 unsigned char
-#define uint16 unsigned short
-#define int16 signed short
-#define int32 signed int
-#define int8 signed char
-#define LO_UINT16(a) ((a)&0xff)
-#define HI_UINT16(a) ((a)>>8 & 0xff)
-#define BUILD_UINT16(lo,hi) (((hi)<<8)|(lo))
-#define HalUARTRead(port, ptr, len) test_read(ptr,len)
-uint16 test_read(void* ptr, uint16 len);
-#endif // MPPT_TEST
+#else
+// host build of the parser, see xcode/BlueBasic/Tests/mppttest.c
+#include "mppttest.h"
+#endif
 
 // the douuble buffer is recommended by Victron in TEXT mode
 // when assuming BASIC app fetches the data before the next Frame
@@ -51,9 +29,15 @@ uint16 test_read(void* ptr, uint16 len);
 #endif
 
 #if MPPT_MODE_TEXT
-#define RECEIVE_MPPT(port, len) receive_text(port, len)
+#define RECEIVE_MPPT(port, len) receive_text(port)
+#else
+#define RECEIVE_MPPT(port, len) receive_hex(port)
+#endif
+
+#if MPPT_DEVICES > 1
+#define MPPT_DEVICE(port) (port)
 #else
-#define RECEIVE_MPPT(port) receive_mppt(port)
+#define MPPT_DEVICE(port) 0
 #endif
 
 #if !MPPT_AS_VOT
@@ -66,14 +50,8 @@ uint16 test_read(void* ptr, uint16 len);
 #define SCAN_INTERVAL 200
 #endif
 
-// interval for requesting a data set
-#define REQUEST_COUNT (sizeof(requests)/sizeof(request_t))
-#define REQUEST_INTERVAL (SCAN_INTERVAL/REQUEST_COUNT)
-
-//#define IS_NIB(a) (((a) >= '0' && (a) <= '9' ) || ( (a) >= 'A' && (a) <= 'F' ) )
-#define IS_NIB(a) (1)
-#define NIB_VAL(a) ((a) >= 'A' ? (a) - 'A' + 10 : (a) - '0' )
-#define SWAP_UINT16(a) BUILD_UINT16(HI_UINT16(a),LO_UINT16(a))
+// give up on a HEX request after this many ms
+#define REPLY_TIMEOUT 500
 
 #if 0
 #define DEBUG_LED_ON  P1 |=  0x08
@@ -108,19 +86,13 @@ static uint16 test_high_watermark = 0;
 #endif
 
 #if MPPT_MODE_HEX
-typedef struct
-{
-  uint8 len;
-  uint8 *data;
-} request_t;
-
-static const request_t requests[] =
+// the registers the app frame is built from, until BASIC asks for others
+static const uint16 default_registers[] =
 {
-  { 11, ":7D7ED008A\n" }, // solar current
-  { 11, ":7BBED00A6\n" }, // solar panel voltage
-  //  {11, ":7BCED00A5\n"}, // solar power
-  { 11, ":7D5ED008C\n" }, // battery voltage
-  { 11, ":70102004B\n" }  // status
+  0xEDD7, // charger current
+  0xEDBB, // solar panel voltage
+  0xEDD5, // battery voltage
+  0x0201  // device state
 };
 
 #ifdef MPPT_FORWARD_UNKNOWN
@@ -131,9 +103,6 @@ typedef struct
   unsigned long data;
 } app_buf_t;
 #endif
-
-static long request_time = 0;
-static uint8 request = 0;
 #endif // MPPT_MODE_HEX
 
 //static long scan_time = 0;
@@ -141,14 +110,10 @@ static uint8 request = 0;
 #if MPPT_MODE_HEX
 typedef enum
 {
-  MPPT_INIT,
   MPPT_IDLE,
-  MPPT_START,
-  MPPT_GET,
-  MPPT_ADR,
-  MPPT_DATA,
-  MPPT_CHECKSUM,
-  MPPT_END,
+  MPPT_COMMAND,
+  MPPT_HIGH,
+  MPPT_LOW
 } state_mppt_t;
 #endif
 
@@ -156,52 +121,152 @@ typedef enum
 typedef enum
 {
   MPPT_IDLE,
+  MPPT_LABEL,
+  MPPT_DATA,
   MPPT_CHECKSUM,
-  MPPT_HEX_RECORD,
-  MPPT_LABEL_0,
-  MPPT_LABEL_1,
-  MPPT_LABEL_2,
-  MPPT_LABEL_3,
-  MPPT_LABEL_4,
-  MPPT_LABEL_5,
-  MPPT_LABEL_6,
-  MPPT_LABEL_7,
-  MPPT_LABEL_END,
-  MPPT_TAB,
-  MPPT_DATA_0,
-  MPPT_DATA_1,
-  MPPT_DATA_2,
-  MPPT_DATA_3,
-  MPPT_DATA_4,
-  MPPT_DATA_5,
-  MPPT_DATA_END
+  MPPT_HEX_RECORD
 } state_mppt_t;
 #endif
 
 #if MPPT_MODE_HEX
-static state_mppt_t state;
-#endif
-//static uint8 mppt_sum;
+typedef struct
+{
+  uint16 id;
+  uint16 period;    // ms between requests, 0 when the device sends it by itself
+  uint16 divisor;
+  uint8 flags;
+  long time;        // of the last request
+  int32 value;
+} mppt_register_t;
 
-#if MPPT_MODE_HEX
-static unsigned long mppt_adr;
-static unsigned long mppt_data;
-static uint8 mppt_nibs;
-static uint8 mppt_checksum;
-#endif
+#define MPPT_REGISTER_PENDING 0x80
 
-#if MPPT_MODE_HEX
-// send a request to the mppt controller
+typedef struct
+{
+  state_mppt_t state;
+  uint8 command;
+  uint8 len;
+  uint8 buf[8];     // register, flags, up to 4 bytes of value and the checksum
+  uint8 count;
+  uint8 next;       // where the next round of requests starts
+  uint8 inflight;
+  long scan_time;
+  mppt_register_t regs[MPPT_REGISTERS];
+} mppt_hex_t;
+
+static mppt_hex_t hex[MPPT_DEVICES];
+
+static uint8 nib_val(uint8 c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return 0xFF;
+}
+
+// forget all registers, then add the default ones if asked
+void mppt_reset(uint8 port, uint8 defaults)
+{
+  osal_memset(&hex[MPPT_DEVICE(port)], 0, sizeof(mppt_hex_t));
+  if (defaults)
+  {
+    for (uint8 i = 0; i < sizeof(default_registers) / sizeof(default_registers[0]); i++)
+      mppt_register(port, default_registers[i], SCAN_INTERVAL, 1, 0);
+  }
+}
+
+// add a register, or change how an existing one is polled
+// returns 1 when the table is full
+uint8 mppt_register(uint8 port, uint16 id, uint16 period, uint16 divisor, uint8 flags)
+{
+  mppt_hex_t* h = &hex[MPPT_DEVICE(port)];
+  mppt_register_t* r = h->regs;
+  uint8 i;
+
+  for (i = h->count; i && r->id != id; i--, r++)
+    ;
+  if (!i)
+  {
+    if (h->count == MPPT_REGISTERS)
+      return 1;
+    h->count++;
+    r->id = id;
+    r->value = 0;
+    r->flags = 0;
+    r->time = OS_get_millis() - period;
+  }
+  r->period = period;
+  r->divisor = divisor;
+  r->flags = (r->flags & MPPT_REGISTER_PENDING) | flags;
+  return 0;
+}
+
+uint8 mppt_register_count(uint8 port)
+{
+  return hex[MPPT_DEVICE(port)].count;
+}
+
+int32 mppt_register_value(uint8 port, uint8 index)
+{
+  return hex[MPPT_DEVICE(port)].regs[index].value;
+}
+
+// send a get request for the register: ":7<id lo><id hi><flags><checksum>\n"
+static void request_register(uint8 port, uint16 id)
+{
+  static const uint8 digits[] = "0123456789ABCDEF";
+  uint8 bytes[4];
+  uint8 msg[11];
+
+  bytes[0] = LO_UINT16(id);
+  bytes[1] = HI_UINT16(id);
+  bytes[2] = 0;
+  bytes[3] = 0x55 - 0x07 - bytes[0] - bytes[1];
+  msg[0] = ':';
+  msg[1] = '7';
+  for (uint8 i = 0; i < 4; i++)
+  {
+    msg[2 + 2 * i] = digits[bytes[i] >> 4];
+    msg[3 + 2 * i] = digits[bytes[i] & 15];
+  }
+  msg[10] = '\n';
+  HalUARTWrite(port, msg, sizeof(msg));
+}
+
+// send requests for the registers that are due, keeping at most
+// MPPT_IN_FLIGHT of them waiting for a reply
 static void request_mppt(uint8 port)
 {
-  HalUARTWrite(port, requests[request].data, requests[request].len);
-  request++;
-  request = request >= REQUEST_COUNT ? 0 : request;
+  mppt_hex_t* h = &hex[MPPT_DEVICE(port)];
+  long now = OS_get_millis();
+  mppt_register_t* r;
+  uint8 i;
+
+  for (i = h->count, r = h->regs; i; i--, r++)
+  {
+    if ((r->flags & MPPT_REGISTER_PENDING) && now - r->time > REPLY_TIMEOUT)
+    {
+      r->flags &= ~MPPT_REGISTER_PENDING;
+      h->inflight--;
+    }
+  }
+  for (i = h->count; i && h->inflight < MPPT_IN_FLIGHT; i--)
+  {
+    r = &h->regs[h->next];
+    if (++h->next >= h->count)
+      h->next = 0;
+    if (r->period && !(r->flags & MPPT_REGISTER_PENDING) && now - r->time >= r->period)
+    {
+      request_register(port, r->id);
+      r->flags |= MPPT_REGISTER_PENDING;
+      r->time = now;
+      h->inflight++;
+    }
+  }
 }
 #endif
 
-#ifndef MPPT_TEST
-
 #if !MPPT_AS_VOT
 // send data to application
 static void send_app(uint8 port)
@@ -217,32 +282,6 @@ static void send_app(uint8 port)
 }
 #endif
 
-#else // MPPT_TEST
-
-typedef struct
-{
-  unsigned short onread;
-  unsigned short onwrite;
-  unsigned char sbuf[16];
-  uint8 sbuf_read_pos; // = 16;
-#ifdef PROCESS_SERIAL_DATA
-  unsigned char sflow;
-#endif  
-} os_serial_t;
-
-os_serial_t serial[OS_MAX_SERIAL];
-
-
-static void send_app(uint8 port, uint8 *buf, uint8 len)
-{
-  // dump data to console
-  for (uint8 i = 0; i < len; i++)
-    printf("%02x ", (unsigned int)buf[i]);
-  printf("\n");
-}
-
-#endif //MPPT_TEST
-
 #if MPPT_AS_VOT
 #define VOT_STATUS_MPP_FLAG 0x01
 #define VOT_STATUS_ACTIVE 0x8
@@ -321,118 +360,120 @@ static void send_as_vot(uint8 port)
 #endif
 
 #if MPPT_MODE_HEX
+// take a complete HEX message, a get reply or an asynchronous one
+static void reply_mppt(uint8 port, mppt_hex_t* h)
+{
+  uint8 sum = h->command;
+  uint8 i;
+
+  for (i = 0; i < h->len; i++)
+    sum += h->buf[i];
+  if (sum != 0x55 || h->len < 4 || (h->command != 0x7 && h->command != 0xA))
+    return;
+
+  uint16 id = BUILD_UINT16(h->buf[0], h->buf[1]);
+  uint8 size = h->len - 4;
+  unsigned long data = 0;
+  for (i = size; i--; )
+    data = data << 8 | h->buf[3 + i];
+
+  mppt_register_t* r = h->regs;
+  for (i = h->count; i && r->id != id; i--, r++)
+    ;
+  if (!i)
+  {
+#ifdef MPPT_FORWARD_UNKNOWN
+    app_buf_t tmp = { sizeof(tmp) - 1, id, data };
+    serial[port].sbuf_read_pos = 0;
+    OS_memcpy(serial[port].sbuf, &tmp, sizeof(tmp));
+#endif
+    return;
+  }
+  if (h->command == 0x7 && (r->flags & MPPT_REGISTER_PENDING))
+  {
+    r->flags &= ~MPPT_REGISTER_PENDING;
+    h->inflight--;
+  }
+  // non zero flags: the device has no value for us
+  if (h->buf[2] || !size)
+    return;
+
+  int32 value = data;
+  if ((r->flags & MPPT_REGISTER_SIGNED) && size < 4 && (data & (1UL << (8 * size - 1))))
+    value -= 1L << (8 * size);
+  r->value = value / (int32)r->divisor;
+
+  mppt_t* m = &mppt[MPPT_DEVICE(port)];
+  switch (id)
+  {
+  case 0xEDD7:  // charger current, 0.1A
+    m->main_current = (int16)data * 10;
+    break;
+  case 0xEDBB:  // solar panel voltage, 0.01V
+    m->sol_volt = data;
+    break;
+  case 0xEDD5:  // battery voltage, 0.01V
+    m->batt_volt = data;
+    break;
+  case 0x0201:  // device state
+    m->status = LO_UINT16(data);
+    break;
+  default:
+    break;
+  }
+}
+
 // receive data from MPPT controller
-static void receive_mppt(uint8 port)
+static void receive_hex(uint8 port)
 {
-  uint8 c;
-  for (; HalUARTRead(port, &c, 1); )
+  mppt_hex_t* h = &hex[MPPT_DEVICE(port)];
+  uint8 in_buf[16];
+  uint8 len;
+
+  while (len = (uint8)HalUARTRead(port, in_buf, sizeof(in_buf)) )
   {
-    switch (state)
+    uint8 *ptr = in_buf;
+    while (len--)
     {
-    case MPPT_IDLE:
+      uint8 c = *ptr++;
+      uint8 nib = nib_val(c);
       if (c == ':')
-        state = MPPT_START;
-      break;
-    case MPPT_START:
-#ifndef MPPT_FORWARD_ASYNC
-      if (c == '7')
-#else
-        // check for Get or Asyn messages
-        if (c == '7' || c == 'A')
-#endif
-        {
-          state = MPPT_ADR;
-          mppt_sum = NIB_VAL(c);
-          mppt_adr = 0;
-          mppt_nibs = 0;
-        }
-        else
-        {
-          state = MPPT_IDLE;
-        }
-      break;
-    case MPPT_ADR:
       {
-        mppt_adr = mppt_adr << 4 | NIB_VAL(c);
-        if (++mppt_nibs == 6)
-        {
-          if (((uint8)mppt_adr & 0xff) == 0)
-          {
-            state = MPPT_DATA;
-            mppt_adr >>= 8;
-            mppt_data = 0;
-            mppt_nibs = 0;
-            mppt_checksum = 0;
-          }
-          else
-          {
-            state = MPPT_IDLE;
-          }
-        }
+        h->state = MPPT_COMMAND;
+        h->len = 0;
+        continue;
       }
-      break;
-    case MPPT_DATA:
-      if (c != '\n')
+      switch (h->state)
       {
-        if (++mppt_nibs <= 8)
+      case MPPT_COMMAND:
+        h->command = nib;
+        h->state = nib == 0xFF ? MPPT_IDLE : MPPT_HIGH;
+        break;
+      case MPPT_HIGH:
+        if (c == '\n')
         {
-          mppt_data = mppt_data << 4 | NIB_VAL(c);
+          h->state = MPPT_IDLE;
+          reply_mppt(port, h);
         }
+        else if (nib == 0xFF || h->len == sizeof(h->buf))
+          h->state = MPPT_IDLE;
         else
         {
-          mppt_checksum = mppt_checksum << 4 | NIB_VAL(c);
+          h->buf[h->len] = nib << 4;
+          h->state = MPPT_LOW;
         }
-      }
-      else
-      {
-        // now we got all ...
-        state = MPPT_END;
-        // when less nibs arrived we extract the checksum byte
-        if (mppt_nibs <= 8)
-        {
-          mppt_checksum = (uint8)mppt_data;
-          mppt_data >>= 8;
-        }
-      }
-      break;
-    default:
-      state = MPPT_IDLE;
-    }
-    if (state == MPPT_END)
-    {
-      state = MPPT_IDLE;
-      mppt_sum += (uint8)((uint16)mppt_adr >> 8)
-        + (uint8)mppt_adr
-          + (uint8)(mppt_data >> 24)
-            + (uint8)(mppt_data >> 16)
-              + (uint8)(mppt_data >> 8)
-                + (uint8)mppt_data
-                  + mppt_checksum;
-      if (mppt_sum == 0x55)
-      {
-        switch ((uint16)mppt_adr)
+        break;
+      case MPPT_LOW:
+        if (nib == 0xFF)
+          h->state = MPPT_IDLE;
+        else
         {
-        case 0xd7ed:  // solar current
-          pmppt->sol_current = SWAP_UINT16(mppt_data) / 100;
-          break;
-        case 0xbbed:  // solar panel voltage
-          pmppt->sol_volt = SWAP_UINT16(mppt_data)/10;
-          break;
-        case 0xd5ed:  // battery voltage
-          pmppt->batt_volt = SWAP_UINT16(mppt_data)/10;
-          break;
-        case 0x0102:  // status
-          pmppt->status = LO_UINT16(mppt_data);
-          break;
-        default:
-#ifdef MPPT_FORWARD_UNKNOWN
-          {
-            app_buf_t tmp = { sizeof(tmp) - 1, (uint16)mppt_adr, mppt_data };
-            send_app(port, (void*)&tmp, sizeof(tmp));
-          }
-#endif
-          break;
+          h->buf[h->len++] |= nib;
+          h->state = MPPT_HIGH;
         }
+        break;
+      default:
+        break;
       }
     }
   }
@@ -440,244 +481,268 @@ static void receive_mppt(uint8 port)
 #endif // MPPT_MODE_HEX
 
 #if MPPT_MODE_TEXT
+// what becomes of a field value
 typedef enum
 {
-  LABEL_NONE,
-  LABEL_V,
-  LABEL_I, 
-  LABEL_VPV,
-  LABEL_CS,
-  LABEL_IL
-} label_t;
+  FIELD_NONE,       // unknown label, value skipped
+  FIELD_OTHER,      // known VE.Direct label the app frame has no room for
+  FIELD_V,
+  FIELD_VPV,
+  FIELD_I,
+  FIELD_IL,
+  FIELD_CS,
+  FIELD_CHECKSUM
+} field_t;
+
+typedef struct
+{
+  uint16 hash;
+  uint8 field;
+} mppt_label_t;
+
+// Labels are hashed while they arrive, h = rotate_left(h, 9) ^ c, so nothing
+// is buffered. The table holds every label of the VE.Direct text protocol
+// (MPPT, BMV, Phoenix inverter and charger) at a collision free slot:
+// slot = ((h >> 6) ^ label_displace[h & 31]) & 63
+#define LABEL_SLOT(h) ((uint8)(((h) >> 6) ^ label_displace[(uint8)(h) & 31]) & 63)
+
+static const uint8 label_displace[32] =
+{
+  50,  0,  0,  0, 41,  2,  6,  0, 13, 16,  0, 52, 17,  5,  1,  1,
+  33, 35,  0,  3, 30, 21,  6, 13, 38, 39, 17, 58,  0, 12,  3,  8
+};
+
+static const mppt_label_t labels[64] =
+{
+  { 0x9032, FIELD_OTHER    }, // H2
+  { 0x6317, FIELD_OTHER    }, // H17
+  { 0xA116, FIELD_OTHER    }, // PPV
+  { 0x9033, FIELD_OTHER    }, // H3
+  { 0x631F, FIELD_OTHER    }, // AC_OUT_V
+  { 0xA10E, FIELD_VPV      }, // VPV
+  { 0x9036, FIELD_OTHER    }, // H6
+  { 0x0056, FIELD_V        }, // V
+  { 0x9232, FIELD_OTHER    }, // I2
+  { 0x8252, FIELD_OTHER    }, // AR
+  { 0x6316, FIELD_OTHER    }, // H16
+  { 0x9233, FIELD_OTHER    }, // I3
+  { 0x6312, FIELD_OTHER    }, // H12
+  { 0x9037, FIELD_OTHER    }, // H7
+  { 0x8392, FIELD_OTHER    }, // DC_IN_P
+  { 0x6313, FIELD_OTHER    }, // H13
+  { 0x8394, FIELD_OTHER    }, // DC_IN_V
+  { 0x0049, FIELD_I        }, // I
+  { 0x6314, FIELD_OTHER    }, // H14
+  { 0xA546, FIELD_OTHER    }, // ERR
+  { 0x6512, FIELD_OTHER    }, // H22
+  { 0x9035, FIELD_OTHER    }, // H5
+  { 0x81FA, FIELD_OTHER    }, // Alarm
+  { 0x6513, FIELD_OTHER    }, // H23
+  { 0x924C, FIELD_IL       }, // IL
+  { 0x6315, FIELD_OTHER    }, // H15
+  { 0x8653, FIELD_CS       }, // CS
+  { 0x8645, FIELD_OTHER    }, // CE
+  { 0xE37A, FIELD_OTHER    }, // LOAD
+  { 0x631A, FIELD_OTHER    }, // AC_OUT_S
+  { 0x9034, FIELD_OTHER    }, // H4
+  { 0x0054, FIELD_OTHER    }, // T
+  { 0x0050, FIELD_OTHER    }, // P
+  { 0x3D35, FIELD_OTHER    }, // SER#
+  { 0xC916, FIELD_OTHER    }, // MPPT
+  { 0x9031, FIELD_OTHER    }, // H1
+  { 0x884D, FIELD_OTHER    }, // DM
+  { 0x9304, FIELD_OTHER    }, // PID
+  { 0x9038, FIELD_OTHER    }, // H8
+  { 0x9039, FIELD_OTHER    }, // H9
+  { 0xC91D, FIELD_OTHER    }, // HSDS
+  { 0xA917, FIELD_OTHER    }, // TTG
+  { 0x6318, FIELD_OTHER    }, // H18
+  { 0x6319, FIELD_OTHER    }, // H19
+  { 0x9F7A, FIELD_OTHER    }, // MON
+  { 0x6310, FIELD_OTHER    }, // H10
+  { 0x9B5E, FIELD_OTHER    }, // BMV
+  { 0x6311, FIELD_OTHER    }, // H11
+  { 0xAC32, FIELD_OTHER    }, // V2
+  { 0xAF5D, FIELD_OTHER    }, // FWE
+  { 0xAC53, FIELD_OTHER    }, // VS
+  { 0xAC33, FIELD_OTHER    }, // V3
+  { 0xAC4D, FIELD_OTHER    }, // VM
+  { 0x6510, FIELD_OTHER    }, // H20
+  { 0x8FBF, FIELD_CHECKSUM }, // Checksum
+  { 0x6511, FIELD_OTHER    }, // H21
+  { 0x1D48, FIELD_OTHER    }, // WARN
+  { 0x9E52, FIELD_OTHER    }, // OR
+  { 0x838B, FIELD_OTHER    }, // DC_IN_I
+  { 0xEEEA, FIELD_OTHER    }, // Relay
+  { 0x8C57, FIELD_OTHER    }, // FW
+  { 0x9F0F, FIELD_OTHER    }, // SOC
+  { 0x6300, FIELD_OTHER    }, // AC_OUT_I
+  { 0xE17B, FIELD_OTHER    }  // MODE
+};
 
-//  static label_t label;
 
-typedef struct 
+typedef struct
 {
-  label_t label;
+  state_mppt_t state;
+  state_mppt_t resume;  // where a HEX record interrupted the frame
+  uint8 cksum;
+  uint8 field;
+  uint8 negative;
+  uint16 hash;
   int32 data;
-  int8 sign;
-  state_mppt_t state; // = MPPT_IDLE;
-  uint8 cksum;  
-} mppt_device_t;
+  mppt_t pending;   // fields of the frame in progress, valid after the checksum
+} mppt_text_t;
 
+static mppt_text_t text[MPPT_DEVICES];
 
-static void receive_text(uint8 port, uint8 len)
+static void parse_text(uint8 port, mppt_text_t* t, const uint8* ptr, uint16 len)
 {
-  static const uint8 sequence[] = { 'c','k','s','u','m' };
-  uint8 in_buf[16];
-#if MPPT_DEVICES > 1
-  static mppt_device_t mppt_devices[MPPT_DEVICES] = {
-    {LABEL_NONE,0,0,MPPT_IDLE},
-    {LABEL_NONE,0,0,MPPT_IDLE}
-  };
-  mppt_device_t text = mppt_devices[port]; 
-#else
-  static mppt_device_t text = {LABEL_NONE,0,0,MPPT_IDLE};
-#endif
-  
-  while (len = (uint8)HalUARTRead(port, in_buf, sizeof(in_buf)) )
+  while (len--)
   {
-    uint8 *ptr = in_buf;
-    while (len--)
+    uint8 c = *ptr++;
+    if (c == ':' && t->state != MPPT_CHECKSUM && t->state != MPPT_HEX_RECORD)
     {
-      uint8 c = *ptr++;
-      if ( (c == ':') && (text.state != MPPT_CHECKSUM) )
+      DEBUG_LED_ON;
+      t->resume = t->state;
+      t->state = MPPT_HEX_RECORD;
+    }
+    if (t->state == MPPT_HEX_RECORD)
+    {
+      // not part of the text frame, which goes on where it was
+      if (c == '\n' || c == '\r')
       {
-        DEBUG_LED_ON;
-        text.state = MPPT_HEX_RECORD;
+        t->state = t->resume;
+        DEBUG_LED_OFF;
       }
-      if (text.state != MPPT_HEX_RECORD)
+      continue;
+    }
+    t->cksum += c;
+    switch (t->state)
+    {
+    case MPPT_IDLE:
+      if (c == '\n')
       {
-        text.cksum += c;
+        t->state = MPPT_LABEL;
+        t->hash = 0;
       }
-      switch (text.state)
+      break;
+    case MPPT_LABEL:
+      if (c == '\t')
       {
-      case MPPT_HEX_RECORD:
-        switch (c)
+        const mppt_label_t* l = &labels[LABEL_SLOT(t->hash)];
+        t->field = l->hash == t->hash ? l->field : FIELD_NONE;
+        if (t->field == FIELD_CHECKSUM)
         {
-        case '\n':
-        case '\r':
-          text.state = MPPT_IDLE;
-          text.cksum = 0;
-          DEBUG_LED_OFF;
+          t->state = MPPT_CHECKSUM;
         }
-        break;
-      case MPPT_IDLE:
-        DEBUG_LED_OFF;
-        if (c == '\n')
-          text.state = MPPT_LABEL_0;
-        break;
-      case MPPT_LABEL_0:
-        text.state = MPPT_LABEL_1;
-        switch (c)
+        else
         {
-        case 'V':
-          text.label = LABEL_V;
-          break;
-        case 'C':
-          text.label = LABEL_CS;
-          //        state = MPPT_LABEL_1;
-          break;
-        case 'I':
-          //        state = MPPT_LABEL_1;
-          text.label = LABEL_I;
-          text.sign = 1;
-          break;
-        default:
-          text.state = MPPT_IDLE;
+          t->state = MPPT_DATA;
+          t->data = 0;
+          t->negative = 0;
         }
-        break;
-      case MPPT_LABEL_1:
-        switch (c)
+      }
+      else if (c < ' ')
+      {
+        t->state = MPPT_IDLE;
+      }
+      else
+      {
+        t->hash = (t->hash << 9 | t->hash >> 7) ^ c;
+      }
+      break;
+    case MPPT_DATA:
+      if (c == '\r')
+      {
+        mppt_t* m = &t->pending;
+        int32 v = t->negative ? -t->data : t->data;
+        switch (t->field)
         {
-        case '\t':
-          if ((text.label == LABEL_V) || (text.label == LABEL_I))
-          {
-            text.state = MPPT_DATA_0;
-            text.data = 0;
-          }
-          else
-          {
-            text.state = MPPT_IDLE;
-          }
+        case FIELD_V:
+          m->batt_volt = v / 10;
           break;
-        case 'L':
-          text.state = MPPT_TAB;
-          text.label = LABEL_IL;
+        case FIELD_VPV:
+          m->sol_volt = v / 10;
           break;
-        case 'S':
-          text.state = MPPT_TAB;
-          //        label = LABEL_CS;
+        case FIELD_I:
+          m->main_current = v / 10;
           break;
-        case 'P':  // VPV?
-        case 'h':  // checksum?
-          text.state = MPPT_LABEL_2;
-          break;
-        default:
-          text.state = MPPT_IDLE;
-        }
-        break;
-      case MPPT_LABEL_2:
-        switch (c)
-        {
-        case 'V':
-          text.state = MPPT_TAB;
-          text.label = LABEL_VPV;
+        case FIELD_IL:
+          m->load_current = v / 10;
           break;
-        case 'e':
-          text.state = MPPT_LABEL_3;
+        case FIELD_CS:
+          m->status = LO_UINT16(v);
           break;
         default:
-          text.state = MPPT_IDLE;
-        }
-        break;
-      case MPPT_LABEL_3:
-      case MPPT_LABEL_4:
-      case MPPT_LABEL_5:
-      case MPPT_LABEL_6:
-      case MPPT_LABEL_7:
-        if (c == sequence[text.state - MPPT_LABEL_3])
-          text.state += 1;
-        else
-          text.state = MPPT_IDLE;
-        break;
-      case MPPT_LABEL_END:
-        if (c == '\t') {
-          text.state = MPPT_CHECKSUM;
-          DEBUG_LED_ON;
-        }
-        else
-          text.state = MPPT_IDLE;
-        break;
-      case MPPT_CHECKSUM:
-        text.state = MPPT_IDLE;
-        if (text.cksum == 0)
-        {
-          // valid frame received
-          // copy valid data if there is space
-          if (serial[port].sbuf_read_pos == 16)
-          {
-            TEST_WATERMARK_REPORT;
-            // only copy data, don't stall RX for too long
-            SEND_MPPT(port);
-          }
-        }
-        text.cksum = 0;
-        break;
-      case MPPT_TAB:
-        if (c == '\t')
-        {
-          text.state = MPPT_DATA_0;
-          text.data = 0;
-        }
-        else
-          text.state = MPPT_IDLE;
-        break;
-      case MPPT_DATA_0:
-        if (c == '-')
-        {
-          text.sign = -1;
           break;
         }
-        // fallthrough
-      case MPPT_DATA_1:
-      case MPPT_DATA_2:
-      case MPPT_DATA_3:
-      case MPPT_DATA_4:
-      case MPPT_DATA_5:
+        t->state = MPPT_IDLE;
+      }
+      else if (t->field > FIELD_OTHER)
+      {
+        // only the fields we keep are converted
         if (c >= '0' && c <= '9')
         {
-          text.data = text.data * 10 + c - '0';
-          text.state += 1;
-          break;
+          t->data = t->data * 10 + c - '0';
         }
-        // fall through
-      case MPPT_DATA_END:
-        if (c == '\r')
+        else if (c == '-')
         {
-#if MPPT_DEVICES > 1
-          mppt_t *m = &mppt[port];
-#else
-          mppt_t *m = &mppt[0];
-#endif          
-          DEBUG_LED_ON;
-          switch (text.label)
-          { 
-          case LABEL_V:
-            m->batt_volt = text.data / 10;
-            break;
-          case LABEL_I:
-            m->main_current = text.sign * text.data / 10;
-            break;
-          case LABEL_IL:
-            m->load_current = text.sign * text.data / 10;
-            break;
-          case LABEL_VPV:
-            m->sol_volt = text.data / 10;
-            break;
-          case LABEL_CS:
-            m->status = LO_UINT16(text.data);
-            break;
-          default:
-            // empty
-            break;
-          }
+          t->negative = 1;
         }
-        text.state = MPPT_IDLE;
-        break;
-      default:
-        text.state = MPPT_IDLE;
       }
+      break;
+    case MPPT_CHECKSUM:
+      t->state = MPPT_IDLE;
+      if (t->cksum == 0)
+      {
+        // valid frame received, take over all of its fields at once
+        mppt[MPPT_DEVICE(port)] = t->pending;
+        // copy valid data if there is space
+        if (serial[port].sbuf_read_pos == 16)
+        {
+          TEST_WATERMARK_REPORT;
+          SEND_MPPT(port);
+        }
+      }
+      else
+      {
+        // drop what the broken frame delivered
+        t->pending = mppt[MPPT_DEVICE(port)];
+      }
+      DEBUG_LED_OFF;
+      t->cksum = 0;
+      break;
+    default:
+      t->state = MPPT_IDLE;
+      break;
     }
-  }  
-#if MPPT_DEVICES > 1
-  mppt_devices[port] = text;
+  }
+}
+
+// receive data from MPPT controller
+static void receive_text(uint8 port)
+{
+  mppt_text_t* t = &text[MPPT_DEVICE(port)];
+  uint8 in_buf[16];
+  uint16 len;
+
+#if HAL_UART_ISR
+  // ISR driven ports are parsed straight from the HAL receive buffer
+  uint8* ptr;
+  while (len = Hal_UART_RxSpan(port, &ptr))
+  {
+    parse_text(port, t, ptr, len);
+    Hal_UART_RxConsume(port, len);
+  }
 #endif
+  // the DMA buffer interleaves data with status bytes, copy it out in chunks
+  while (len = HalUARTRead(port, in_buf, sizeof(in_buf)))
+  {
+    parse_text(port, t, in_buf, len);
+  }
 }
 #endif // MPPT_MODE_TEXT
 
-#ifndef MPPT_TEST
 // manage the Victron MPPT controller
 // should be called in regular intervals to drive the data pump
 void process_mppt(uint8 port, uint8 len)
@@ -699,98 +764,12 @@ void process_mppt(uint8 port, uint8 len)
   else
   {
     long now = OS_get_millis();
-    if (now - scan_time > SCAN_INTERVAL)
+    if (now - hex[MPPT_DEVICE(port)].scan_time > SCAN_INTERVAL)
     {
       SEND_MPPT(port);
-      scan_time = now;
-    }
-    if (now - request_time > REQUEST_INTERVAL)
-    {
-      request_mppt(port);
-      request_time = now;
+      hex[MPPT_DEVICE(port)].scan_time = now;
     }
+    request_mppt(port);
   }
 #endif
 }
-
-#else // MPPT_TEST
-
-static uint16 read_counter = 0;
-
-// --- test frame ---
-//     PID 0xA040
-//     FW  111
-//     SER#  HQ1337Z6DQA
-//     V 26810
-//     I 10200
-//     VPV 30510
-//     PPV 282
-//     CS  3
-//     ERR 0
-//     H19 3461
-//     H20 117
-//     H21 1113
-//     H22 568
-//     H23 1374
-//     Checksum  ?
-// --- end test frame ---
-//3010 WRITE #SERIAL,13,10,80,73,68,9,48,120,65,48,52,65,13,10,70,87,9,49,49,54,13,10,83,69,82,35,9,72,81,49,55,53,48,89,70,78,53,82,13,10,86,9,50,55,54,57,48,13,10,73,9,52,52,48,48,13,10,86,80,86,9,51,49,51,48,48,13,10,80,80,86,9,49,50,53,
-//3020 WRITE #SERIAL,13,10,67,83,9,51,13,10,69,82,82,9,48,13,10,72,49,57,9,54,55,52,49,13,10,72,50,48,9,53,53,13,10,72,50,49,9,49,54,54,13,10,72,50,50,9,49,48,54,13,10,72,50,51,9,51,49,56,13,10,72,83,68,83,9,56,52,13,10,67,104,101,99,107,115,117,109,9,106,
-
-static uint8 test_frame[] = {
-  13,10,80,73,68, 9,48,120,65,48,52,65,13,10,70,87,
-  9,49,49,54,13,10,83, 69,82,35, 9,72,81,49,55,53,
-  48,89,70,78,53,82,13, 10,86, 9,50,55,54,57,48,13,
-  10,73, 9,52,52,48,48, 13,10,86,80,86, 9,51,49,51,
-  48,48,13,10,80,80,86,  9,49,50,53,13,10,67,83, 9,
-  51,13,10,69,82,82, 9, 48,13,10,72,49,57, 9,54,55,
-  52,49,13,10,72,50,48,  9,53,53,13,10,72,50,49, 9,
-  49,54,54,13,10,72,50, 50, 9,49,48,54,13,10,72,50,
-  51, 9,51,49,56,13,10, 72,83,68,83, 9,56,52,13,10,
-  67,104,101,99,107,115,117,109,9,106,
-  // frame with async data
-  58,65,53,48,49,48,48,48,48,48,48,50,48,48,48,48,
-  48,48,48,48,48,48,48,48,48,48,51,50,48,53,49,68,
-  48,53,48,48,48,48,48,48,48,48,48,48,57,55,48,48,
-  48,48,48,48,48,48,48,48,49,52,48,48,48,48,48,48,
-  48,70,48,48,66,57,48,55,49,49,48,48,48,53,10,13,
-  10,80,73,68,9,48,120,65,48,53,51,13,10,70,87,9,
-  49,52,50,13,10,83,69,82,35,9,72,81,49,57,48,53,
-  50,51,77,72,65,13,10,86,9,49,51,51,48,48,13,10,
-  73,9,49,52,57,48,13,10,86,80,86,9,49,56,54,48,
-  48,13,10,80,80,86,9,50,49,13,10,67,83,9,51,13,
-  10,77,80,80,84,9,50,13,10,69,82,82,9,48,13,10,
-  76,79,65,68,9,79,78,13,10,73,76,9,48,13,10,72,
-  49,57,9,49,51,50,13,10,72,50,48,9,50,13,10,72,
-  50,49,9,50,48,13,10,72,50,50,9,49,50,13,10,72,
-  50,51,9,56,50,13,10,72,83,68,83,9,49,55,13,10,
-  67,104,101,99,107,115,117,109,9,171,13,10,80,73,68,9
-};
-
-uint16 test_read(void* ptr, uint16 len)
-{
-  uint16 max = read_counter + len > sizeof(test_frame) ? sizeof(test_frame) - read_counter : len;
-  printf("reading %d\n", read_counter);
-  if (max)
-    memcpy(ptr, test_frame + read_counter, max);
-  read_counter += max;
-  return max;
-}
-
-int main(void)
-{
-  printf("Starting to parse data...\n");
-  for (read_counter = 0; read_counter < sizeof(test_frame); )
-  {
-    RECEIVE_MPPT(0);
-  }
-  SEND_MPPT(0);
-  printf("v:   %d mV\n", mppt.batt_volt * 10);
-  printf("vpv: %d mV\n", mppt.sol_volt * 10);
-  printf("i:   %d mA\n", mppt.sol_current * 100);
-  printf("cs:  %02x\n", mppt.status);
-  return 0;
-}
-
-#endif // MPPT_TEST
-
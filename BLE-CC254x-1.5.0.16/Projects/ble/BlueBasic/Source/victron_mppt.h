@@ -29,7 +29,6 @@ extern "C"
  * MACROS
  */
 
-//#define MPPT_FORWARD_ASYNC
 //#define MPPT_FORWARD_UNKNOWN
 
 #ifndef MPPT_AS_VOT
@@ -52,12 +51,31 @@ extern "C"
 #define MPPT_MODE_TEXT 1
 #endif
 #endif   
+
+#if MPPT_MODE_HEX
+// registers kept per port
+#ifndef MPPT_REGISTERS
+#define MPPT_REGISTERS 8
+#endif
+// requests waiting for a reply per port
+#ifndef MPPT_IN_FLIGHT
+#define MPPT_IN_FLIGHT 2
+#endif
+// sign extend values shorter than 32 bits
+#define MPPT_REGISTER_SIGNED 0x01
+#endif
    
 /*********************************************************************
  * FUNCTIONS
  */
 
 extern void process_mppt(uint8 port, uint8 len);  
+#if MPPT_MODE_HEX
+extern void mppt_reset(uint8 port, uint8 defaults);
+extern uint8 mppt_register(uint8 port, uint16 id, uint16 period, uint16 divisor, uint8 flags);
+extern uint8 mppt_register_count(uint8 port);
+extern int32 mppt_register_value(uint8 port, uint8 index);
+#endif
   
 /*********************************************************************
 *********************************************************************/
@@ -7,6 +7,7 @@
 //
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <signal.h>
 #include <time.h>
@@ -34,6 +35,175 @@ static unsigned char* bend;
 
 extern unsigned char __store[];
 
+// Notifications are printed, a few per simulated connection event
+#define TX_BUFFERS  4
+
+static char notify_pacing;
+static unsigned char tx_buffers;
+
+// Advertising reports are replayed from the capture named by BLUEBASIC_ADV once scanning starts.
+// Each line is: <millis> <addrtype> <rssi> <eventtype> <address hex, MSB first> [<data hex>]
+static char discovering;
+static char replaying;
+static uint32_t replay_millis;
+
+static void replay_adverts(void)
+{
+  const char* name = getenv("BLUEBASIC_ADV");
+  FILE* fp = name ? fopen(name, "r") : NULL;
+  char line[256];
+
+  if (!fp)
+  {
+    discovering = 0;
+    return;
+  }
+  replaying = 1;
+  while (discovering && fgets(line, sizeof(line), fp))
+  {
+    unsigned int millis, addrtype, eventtype;
+    int rssi;
+    char addr[13];
+    char hex[128] = "";
+    unsigned char address[8] = { 0 };
+    unsigned char data[31];
+    unsigned char len;
+
+    if (line[0] == '#' || sscanf(line, "%u %u %d %u %12s %127s", &millis, &addrtype, &rssi, &eventtype, addr, hex) < 5)
+    {
+      continue;
+    }
+    for (len = 0; len < B_ADDR_LEN; len++)
+    {
+      sscanf(addr + 2 * len, "%2hhx", &address[B_ADDR_LEN - 1 - len]);
+    }
+    for (len = 0; len < sizeof(data) && sscanf(hex + 2 * len, "%2hhx", &data[len]) == 1; len++)
+      ;
+    replay_millis = millis;
+    interpreter_devicefound(addrtype, address, rssi, eventtype, len, data);
+  }
+  // The end of the capture ends the scan
+  if (discovering)
+  {
+    interpreter_discoverycomplete();
+  }
+  replaying = 0;
+  discovering = 0;
+  fclose(fp);
+}
+
+// ADC results are replayed from the capture named by BLUEBASIC_ADC once ANALOG TIMER or ANALOG SCAN starts.
+// Each line is one round of conversions, the left justified results as the ADC gives them:
+// <AIN0> [<AIN1> .. <AIN7> [<AIN0-1> .. <AIN6-7>]]. Channels not given read 0.
+#define ADC_CHANNELS 12
+
+os_sampling_t sampling;
+volatile signed char OS_adc_scan_block = -1;
+
+static char adc_replay;
+static char adc_replaying;
+static char adc_sampled;
+static short adc_values[ADC_CHANNELS];
+static short* scan_buffer;
+static unsigned short scan_len;
+static unsigned char scan_channels;
+
+short OS_adc_sample(unsigned char channel)
+{
+  adc_sampled = 1;
+  return channel < ADC_CHANNELS ? adc_values[channel] : 0;
+}
+
+void OS_adc_scan_start(unsigned char adccon2, unsigned short period, short* buffer, unsigned short len)
+{
+  scan_buffer = buffer;
+  scan_len = len;
+  scan_channels = (adccon2 & 0x0F) + 1;
+  OS_adc_scan_block = -1;
+  adc_replay = 1;
+}
+
+void OS_adc_scan_stop(void)
+{
+  scan_buffer = NULL;
+  OS_adc_scan_block = -1;
+}
+
+static void replay_samples(void)
+{
+  const char* name = getenv("BLUEBASIC_ADC");
+  FILE* fp = name ? fopen(name, "r") : NULL;
+  char line[256];
+  unsigned short pos = 0;
+  unsigned char half = 0;
+
+  adc_replay = 0;
+  if (!fp)
+  {
+    return;
+  }
+  adc_replaying = 1;
+  while (fgets(line, sizeof(line), fp))
+  {
+    char* ptr = line;
+    unsigned char ch;
+    int n;
+
+    if (line[0] == '#')
+    {
+      continue;
+    }
+    memset(adc_values, 0, sizeof(adc_values));
+    for (ch = 0; ch < ADC_CHANNELS && sscanf(ptr, "%hd%n", &adc_values[ch], &n) == 1; ch++, ptr += n)
+      ;
+    if (scan_buffer)
+    {
+      // The DMA fills one half while the interpreter looks at the other
+      for (ch = 0; ch < scan_channels; ch++)
+      {
+        scan_buffer[(half ? scan_len : 0) + pos++] = adc_values[ch];
+      }
+      if (pos == scan_len)
+      {
+        pos = 0;
+        OS_adc_scan_block = half;
+        half ^= 1;
+        interpreter_adc_scan();
+      }
+    }
+    // The strobe phase of ANALOG TIMER takes no sample, so run until one is taken
+    for (adc_sampled = 0; !adc_sampled && sampling.active && (sampling.map || sampling.power); )
+    {
+      interpreter_sampling();
+    }
+  }
+  adc_replaying = 0;
+  fclose(fp);
+}
+
+// The advertising rotation runs on simulated time, a second of it each time the prompt is reached,
+// so the payloads put on air and the turns counted are the same on every run.
+#define ROTATE_REPLAY_MS 1000
+
+extern unsigned char ble_adrotate_timer;
+
+static char rotate_replay;
+static char rotate_replaying;
+static unsigned long rotate_dwell;
+
+static void replay_rotation(void)
+{
+  unsigned long elapsed;
+
+  rotate_replay = 0;
+  rotate_replaying = 1;
+  for (elapsed = rotate_dwell; elapsed < ROTATE_REPLAY_MS && ble_adrotate_timer < OS_MAX_TIMER; elapsed += rotate_dwell)
+  {
+    interpreter_advert_rotate();
+  }
+  rotate_replaying = 0;
+}
+
 void OS_prompt_buffer(unsigned char* start, unsigned char* end)
 {
   bstart = start;
@@ -43,7 +213,56 @@ void OS_prompt_buffer(unsigned char* start, unsigned char* end)
 char OS_prompt_available(void)
 {
   char quote = 0;
-  unsigned char* ptr = bstart;
+  unsigned char* ptr;
+
+  if (discovering)
+  {
+    replay_adverts();
+  }
+  if (adc_replay)
+  {
+    replay_samples();
+  }
+  if (rotate_replay)
+  {
+    replay_rotation();
+  }
+  for (;;)
+  {
+    while (notify_pacing)
+    {
+      // Connection event
+      tx_buffers = TX_BUFFERS;
+      interpreter_notify();
+    }
+    // A finished stream's GOSUB runs from here, and may start another
+    if (!interpreter_stream_complete())
+    {
+      break;
+    }
+    interpreter_stream_run();
+  }
+  // A program upload is typed as hex, one frame per line, and written in 20 byte chunks
+  while (interpreter_load(NULL, 0))
+  {
+    char line[1024];
+    unsigned char data[20];
+    unsigned char len;
+    char* hex = line;
+
+    if (!fgets(line, sizeof(line), stdin))
+    {
+      return 0;
+    }
+    do
+    {
+      for (len = 0; len < sizeof(data) && sscanf(hex, "%2hhx", &data[len]) == 1; len++, hex += 2)
+        ;
+      interpreter_load(data, len);
+    } while (len == sizeof(data));
+    interpreter_load_run();
+  }
+  ptr = bstart;
 
   for (;;)
   {
@@ -146,6 +365,19 @@ char OS_timer_start(unsigned char id, unsigned long timeout, unsigned char repea
   {
     return 0;
   }
+  if (lineno == 0 && id == sampling.timer && sampling.active && (sampling.map || sampling.power))
+  {
+    // Sampling is driven by the replay, which needn't see it rescheduled
+    adc_replay |= !adc_replaying;
+    return 1;
+  }
+  if (lineno == 0 && id == ble_adrotate_timer)
+  {
+    // As is the advertising rotation
+    rotate_dwell = timeout;
+    rotate_replay |= !rotate_replaying;
+    return 1;
+  }
   printf("setting timer %d: timeout=%ld, repeat=%d, lineno=%d\n", id, timeout, repeat, lineno);
   timers[id].lineno = lineno;
   timers[id].periode = id == DELAY_TIMER ? 0 : (int32_t) timeout;
@@ -175,16 +407,72 @@ unsigned char GATTServApp_DeregisterService(unsigned short handle, void* attr)
   return SUCCESS;
 }
 
+static void print_notification(unsigned char* value, unsigned char len)
+{
+  printf("NOTIFY");
+  for (unsigned char i = 0; i < len; i++)
+  {
+    printf(" %02X", value[i]);
+  }
+  printf("\n");
+}
+
+// The simulator has one client connected, which subscribes to every notification
 unsigned char GATTServApp_InitCharCfg(unsigned short handle, gattCharCfg_t* charcfgtbl)
 {
+  charcfgtbl[0].connHandle = 0;
+  charcfgtbl[0].value = GATT_CLIENT_CFG_NOTIFY;
+  return SUCCESS;
+}
+
+uint16 ATT_GetMTU(uint16 connHandle)
+{
+  return 23;
+}
+
+void* GATT_bm_alloc(uint16 connHandle, uint8 opcode, uint16 size, uint16* pSizeAlloc)
+{
+  return malloc(size);
+}
+
+void GATT_bm_free(gattMsg_t* pMsg, uint8 opcode)
+{
+  free(pMsg->pValue);
+}
+
+bStatus_t GATT_Notification(uint16 connHandle, attHandleValueNoti_t* pNoti, uint8 authenticated)
+{
+  if (!tx_buffers)
+  {
+    return 0x11; // MSG_BUFFER_NOT_AVAIL
+  }
+  tx_buffers--;
+  print_notification(pNoti->pValue, pNoti->len);
+  free(pNoti->pValue);
   return SUCCESS;
 }
 
+void OS_notify_pace(unsigned char enable)
+{
+  notify_pacing = enable;
+}
+
 unsigned char GATTServApp_ProcessCharCfg( gattCharCfg_t *charCfgTbl, uint8 *pValue,
                                                 uint8 authenticated, gattAttribute_t *attrTbl,
                                                 uint16 numAttrs, uint8 taskId,
                                                 pfnGATTReadAttrCB_t pfnReadAttrCB )
 {
+  unsigned char value[20];
+  unsigned char len;
+
+  for (uint16 i = 0; i < numAttrs; i++)
+  {
+    if (attrTbl[i].pValue == pValue && (charCfgTbl[0].value & GATT_CLIENT_CFG_NOTIFY) &&
+        pfnReadAttrCB(charCfgTbl[0].connHandle, &attrTbl[i], value, &len, 0, sizeof(value), 0) == SUCCESS)
+    {
+      print_notification(value, len);
+    }
+  }
   return SUCCESS;
 }
 
@@ -193,14 +481,31 @@ unsigned char GATTServApp_ProcessCCCWriteReq(unsigned short handle, gattAttribut
   return SUCCESS;
 }
 
+// The advertising and scan response data are kept, so they can be read back
+static unsigned char gap_adverts[2][31];
+
 unsigned char GAPRole_SetParameter( uint16 param, uint8 len, void *pValue )
 {
+  if ((param == _GAPROLE(BLE_ADVERT_DATA) || param == _GAPROLE(BLE_SCAN_RSP_DATA)) && len <= sizeof(gap_adverts[0]))
+  {
+    memcpy(gap_adverts[param == _GAPROLE(BLE_SCAN_RSP_DATA)], pValue, len);
+    printf(param == _GAPROLE(BLE_SCAN_RSP_DATA) ? "SCANRSP" : "ADVERT");
+    for (unsigned char i = 0; i < len; i++)
+    {
+      printf(" %02X", ((unsigned char*)pValue)[i]);
+    }
+    printf("\n");
+  }
   return SUCCESS;
 }
 
 unsigned char GAPRole_GetParameter( uint16 param, void *pValue )
 {
-  if (pValue)
+  if (param == _GAPROLE(BLE_ADVERT_DATA) || param == _GAPROLE(BLE_SCAN_RSP_DATA))
+  {
+    memcpy(pValue, gap_adverts[param == _GAPROLE(BLE_SCAN_RSP_DATA)], sizeof(gap_adverts[0]));
+  }
+  else if (pValue)
   {
     *(unsigned short*)pValue = 0;
   }
@@ -242,11 +547,13 @@ unsigned char HCI_EXT_SetRxGainCmd(unsigned char gain)
 
 unsigned char GAPObserverRole_StartDiscovery(unsigned char mode, unsigned char active, unsigned char whitelist)
 {
+  discovering = 1;
   return SUCCESS;
 }
 
 unsigned char GAPObserverRole_CancelDiscovery(void)
 {
+  discovering = 0;
   return SUCCESS;
 }
 
@@ -297,6 +604,25 @@ void OS_flashstore_erase(unsigned long page)
   fclose(fp);
 }
 
+#ifdef FEATURE_FILESTORE
+// A blank FRAM reads as zeros, which the filestore won't recognise
+static unsigned char __fram[FILESTORE_LEN];
+
+void OS_filestore_init(void)
+{
+}
+
+void OS_filestore_read(unsigned long addr, unsigned char* buf, unsigned char len)
+{
+  memcpy(buf, &__fram[addr], len);
+}
+
+void OS_filestore_write(unsigned long addr, const unsigned char* buf, unsigned char len)
+{
+  memcpy(&__fram[addr], buf, len);
+}
+#endif
+
 unsigned char OS_serial_open(unsigned char port, unsigned long baud, unsigned char parity, unsigned char bits, unsigned char stop, unsigned char flow, unsigned short onread, unsigned short onwrite)
 {
   return 0;
@@ -329,6 +655,9 @@ int16 OS_get_temperature(uint8 wait) {
 uint32_t OS_get_millis(void) {
   static uint32_t start_millis = 0xffffffff;
   struct timespec t;
+  if (replaying) {
+    return replay_millis;
+  }
   clock_gettime(CLOCK_MONOTONIC, &t);
   uint32_t millis = (uint32_t)(t.tv_sec * 1000 + t.tv_nsec / 1000 / 1000);
   if (start_millis == 0xffffffff) {
@@ -0,0 +1,539 @@
+//
+//  mppttest.c
+//  BlueBasic
+//
+//  Host test and benchmark for the VE.Direct parser in victron_mppt.c.
+//  The driver is compiled into this file with MPPT_TEST, once for each
+//  protocol mode (see mppttest.sh), and fed recorded captures through a
+//  fake UART that hands the bytes over in random chunks: port 0 is read
+//  by copy like a DMA port, port 1 in place like an ISR port.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <time.h>
+#include "victron_mppt.c"
+
+#define RX_MAX 32             // HAL_UART_ISR_RX_MAX of the 2MPPT builds
+#define MAX_PUBLISHED 16
+
+os_serial_t serial[OS_MAX_SERIAL];
+
+static long millis;
+static uint32 seed = 1;
+
+static const uint8* rx_data;  // what the device sends
+static uint32 rx_len;
+static uint32 rx_pos;         // bytes arrived so far
+static uint32 rx_read;        // bytes arrived and read
+static uint8 ring[RX_MAX];
+static uint8 ring_head;
+static uint8 ring_tail;
+
+static mppt_t published[MAX_PUBLISHED];
+static uint16 published_count;
+static uint16 requests;
+
+static int failures;
+
+long OS_get_millis(void)
+{
+  return millis;
+}
+
+uint16 HalUARTRead(uint8 port, uint8* buf, uint16 len)
+{
+  uint16 cnt = 0;
+
+  if (port == 0)
+  {
+    while (rx_read < rx_pos && cnt < len)
+    {
+      buf[cnt++] = rx_data[rx_read++];
+    }
+  }
+  else
+  {
+    while (ring_head != ring_tail && cnt < len)
+    {
+      buf[cnt++] = ring[ring_head];
+      ring_head = (ring_head + 1) % RX_MAX;
+    }
+  }
+  return cnt;
+}
+
+uint16 Hal_UART_RxSpan(uint8 port, uint8** buf)
+{
+  if (port == 0)
+  {
+    return 0;
+  }
+  *buf = ring + ring_head;
+  return ring_tail >= ring_head ? ring_tail - ring_head : RX_MAX - ring_head;
+}
+
+void Hal_UART_RxConsume(uint8 port, uint16 len)
+{
+  ring_head = (ring_head + len) % RX_MAX;
+}
+
+static uint8 hex_digit(uint8 c)
+{
+  return c <= '9' ? c - '0' : c - 'A' + 10;
+}
+
+// every HEX request must add up to 0x55
+uint16 HalUARTWrite(uint8 port, uint8* buf, uint16 len)
+{
+  uint8 sum = 0;
+  uint16 i;
+
+  if (len < 4 || buf[0] != ':' || buf[len - 1] != '\n')
+  {
+    failures++;
+    printf("** malformed request '%.*s'\n", len, buf);
+    return len;
+  }
+  sum = hex_digit(buf[1]);
+  for (i = 2; i + 1 < len - 1; i += 2)
+  {
+    sum += hex_digit(buf[i]) << 4 | hex_digit(buf[i + 1]);
+  }
+  if (sum != 0x55)
+  {
+    failures++;
+    printf("** bad request checksum '%.*s'\n", len - 1, buf);
+  }
+  requests++;
+  return len;
+}
+
+static uint32 random_next(void)
+{
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed;
+}
+
+static void reset(uint8 port)
+{
+  uint8 i;
+
+  for (i = 0; i < OS_MAX_SERIAL; i++)
+  {
+    osal_memset(&serial[i], 0, sizeof(serial[i]));
+    serial[i].sbuf_read_pos = 16;
+  }
+  osal_memset(mppt, 0, sizeof(mppt));
+#if MPPT_MODE_TEXT
+  osal_memset(text, 0, sizeof(text));
+#else
+  mppt_reset(port, 0);
+#endif
+  published_count = 0;
+  requests = 0;
+}
+
+// let the bytes arrive in chunks of 1..maxchunk and drive the parser
+// like os.c does; whatever reaches the app is collected in published[]
+static void feed(uint8 port, const uint8* data, uint32 len, uint8 maxchunk)
+{
+  rx_data = data;
+  rx_len = len;
+  rx_pos = rx_read = 0;
+  ring_head = ring_tail = 0;
+
+  for (;;)
+  {
+    uint8 chunk = 1 + random_next() % maxchunk;
+    uint16 avail;
+
+    while (chunk-- && rx_pos < rx_len)
+    {
+      if (port == 0)
+      {
+        rx_pos++;
+      }
+      else if ((ring_tail + 1) % RX_MAX != ring_head)
+      {
+        ring[ring_tail] = rx_data[rx_pos++];
+        ring_tail = (ring_tail + 1) % RX_MAX;
+      }
+      else
+      {
+        break;
+      }
+    }
+    avail = port == 0 ? rx_pos - rx_read : (ring_tail + RX_MAX - ring_head) % RX_MAX;
+    if (!avail && rx_pos == rx_len)
+    {
+      break;
+    }
+    millis++;
+    process_mppt(port, avail);
+    if (serial[port].sbuf_read_pos == 0)
+    {
+      if (published_count < MAX_PUBLISHED)
+      {
+        OS_memcpy(&published[published_count], serial[port].sbuf, sizeof(mppt_t));
+      }
+      published_count++;
+      serial[port].sbuf_read_pos = 16;
+    }
+  }
+}
+
+static void check(const char* name, uint8 port, int ok)
+{
+  if (!ok)
+  {
+    failures++;
+  }
+  printf("** %s #%d: %s\n", name, port, ok ? "SUCCESS" : "FAILURE");
+}
+
+static int check_mppt(const mppt_t* m, uint16 batt, uint16 sol, int16 main, int16 load, uint8 status)
+{
+  if (m->batt_volt == batt && m->sol_volt == sol && m->main_current == main &&
+      m->load_current == load && m->status == status)
+  {
+    return 1;
+  }
+  printf("   got V %u VPV %u I %d IL %d CS %u\n", m->batt_volt, m->sol_volt,
+         m->main_current, m->load_current, m->status);
+  return 0;
+}
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void benchmark(const char* name, uint8 port, const uint8* data, uint32 len)
+{
+  double start = now();
+  double elapsed;
+
+  feed(port, data, len, RX_MAX - 1);
+  elapsed = now() - start;
+  printf("   %s #%d: %u bytes in %.3f s, %.0f bytes/s\n", name, port,
+         len, elapsed, len / elapsed);
+}
+
+#if MPPT_MODE_TEXT
+
+// Two recorded MPPT frames with an asynchronous HEX record in between,
+// followed by the start of a third frame
+static const uint8 capture[] =
+{
+  13,10,80,73,68, 9,48,120,65,48,52,65,13,10,70,87,
+  9,49,49,54,13,10,83, 69,82,35, 9,72,81,49,55,53,
+  48,89,70,78,53,82,13, 10,86, 9,50,55,54,57,48,13,
+  10,73, 9,52,52,48,48, 13,10,86,80,86, 9,51,49,51,
+  48,48,13,10,80,80,86,  9,49,50,53,13,10,67,83, 9,
+  51,13,10,69,82,82, 9, 48,13,10,72,49,57, 9,54,55,
+  52,49,13,10,72,50,48,  9,53,53,13,10,72,50,49, 9,
+  49,54,54,13,10,72,50, 50, 9,49,48,54,13,10,72,50,
+  51, 9,51,49,56,13,10, 72,83,68,83, 9,56,52,13,10,
+  67,104,101,99,107,115,117,109,9,106,
+  58,65,53,48,49,48,48,48,48,48,48,50,48,48,48,48,
+  48,48,48,48,48,48,48,48,48,48,51,50,48,53,49,68,
+  48,53,48,48,48,48,48,48,48,48,48,48,57,55,48,48,
+  48,48,48,48,48,48,48,48,49,52,48,48,48,48,48,48,
+  48,70,48,48,66,57,48,55,49,49,48,48,48,53,10,13,
+  10,80,73,68,9,48,120,65,48,53,51,13,10,70,87,9,
+  49,52,50,13,10,83,69,82,35,9,72,81,49,57,48,53,
+  50,51,77,72,65,13,10,86,9,49,51,51,48,48,13,10,
+  73,9,49,52,57,48,13,10,86,80,86,9,49,56,54,48,
+  48,13,10,80,80,86,9,50,49,13,10,67,83,9,51,13,
+  10,77,80,80,84,9,50,13,10,69,82,82,9,48,13,10,
+  76,79,65,68,9,79,78,13,10,73,76,9,48,13,10,72,
+  49,57,9,49,51,50,13,10,72,50,48,9,50,13,10,72,
+  50,49,9,50,48,13,10,72,50,50,9,49,50,13,10,72,
+  50,51,9,56,50,13,10,72,83,68,83,9,49,55,13,10,
+  67,104,101,99,107,115,117,109,9,171,13,10,80,73,68,9
+};
+
+// append a text frame made of the given "label\tvalue" fields and its checksum
+static uint16 text_frame(uint8* out, ...)
+{
+  const char* field;
+  uint16 len = 0;
+  uint8 sum = 0;
+  uint16 i;
+  va_list ap;
+
+  va_start(ap, out);
+  while ((field = va_arg(ap, const char*)))
+  {
+    len += sprintf((char*)out + len, "\r\n%s", field);
+  }
+  va_end(ap);
+  len += sprintf((char*)out + len, "\r\nChecksum\t");
+  for (i = 0; i < len; i++)
+  {
+    sum += out[i];
+  }
+  out[len++] = -sum;
+  return len;
+}
+
+static void test_text(uint8 port)
+{
+  uint8 buf[512];
+  uint16 len;
+  uint16 i;
+  uint8 s;
+
+  // recorded frames in every chunking
+  for (s = 1; s < RX_MAX; s++)
+  {
+    reset(port);
+    feed(port, capture, sizeof(capture), s);
+    if (published_count != 2 ||
+        !check_mppt(&published[0], 2769, 3130, 440, 0, 3) ||
+        !check_mppt(&published[1], 1330, 1860, 149, 0, 3))
+    {
+      break;
+    }
+  }
+  check("recorded capture", port, s == RX_MAX);
+
+  // a flipped bit in the first frame drops all of its fields
+  OS_memcpy(buf, capture, sizeof(capture));
+  buf[44] ^= 0x01;
+  reset(port);
+  feed(port, buf, sizeof(capture), 7);
+  check("corrupted frame", port, published_count == 1 &&
+        check_mppt(&published[0], 1330, 1860, 149, 0, 3));
+
+  // joining in the middle of a frame
+  reset(port);
+  feed(port, capture + 50, sizeof(capture) - 50, 5);
+  check("split frame", port, published_count == 1 &&
+        check_mppt(&published[0], 1330, 1860, 149, 0, 3));
+
+  // a HEX record between two frames
+  len = text_frame(buf, "PID\t0xA060", "V\t13250", "I\t2100", NULL);
+  len += sprintf((char*)buf + len, ":A8FED0038FF98\n");
+  len += text_frame(buf + len, "VPV\t35010", "CS\t5", NULL);
+  reset(port);
+  feed(port, buf, len, 3);
+  check("async between frames", port, published_count == 2 &&
+        check_mppt(&published[1], 1325, 3501, 210, 0, 5));
+
+  // and in the middle of a field, it is not part of the checksum
+  len = text_frame(buf, "V\t13250", "I\t2100", "VPV\t35010", "CS\t5", NULL);
+  i = strlen("\r\nV\t13250\r\nI\t2100");
+  memmove(buf + i + 15, buf + i, len - i);
+  OS_memcpy(buf + i, ":A8FED0038FF98\n", 15);
+  len += 15;
+  reset(port);
+  feed(port, buf, len, 4);
+  check("async inside frame", port, published_count == 1 &&
+        check_mppt(&published[0], 1325, 3501, 210, 0, 5));
+
+  // negative and long values, labels the app frame does not carry
+  len = text_frame(buf, "PID\t0xA053", "SER#\tHQ1905", "V\t12800", "I\t-1200", "VPV\t101230",
+                   "PPV\t-", "IL\t-350", "LOAD\tON", "XYZ\t77", "Relay\tOFF", "CS\t245", NULL);
+  reset(port);
+  feed(port, buf, len, 9);
+  check("field values", port, published_count == 1 &&
+        check_mppt(&published[0], 1280, 10123, -120, -35, 245));
+
+  // checksum bytes that look like line ends, tabs or HEX records
+  for (i = 0; i < 4; i++)
+  {
+    static const uint8 special[] = { '\r', '\n', '\t', ':' };
+    char field[8];
+    uint8 c;
+
+    for (c = 'A'; c <= 'z'; c++)
+    {
+      sprintf(field, "FW\t1%c", c);
+      len = text_frame(buf, field, "V\t12000", NULL);
+      if (buf[len - 1] == special[i])
+      {
+        break;
+      }
+    }
+    // and a second frame right behind it
+    len += text_frame(buf + len, "V\t12100", NULL);
+    reset(port);
+    feed(port, buf, len, 2);
+    if (published_count != 2 || published[1].batt_volt != 1210)
+    {
+      break;
+    }
+  }
+  check("special checksum", port, i == 4);
+
+  // fields missing from a frame keep their value, fields of a broken frame are dropped
+  len = text_frame(buf, "V\t12000", "I\t500", "VPV\t20000", "CS\t3", NULL);
+  i = len;
+  len += text_frame(buf + len, "V\t99999", "I\t9999", NULL);
+  buf[len - 1] ^= 0x40;
+  len += text_frame(buf + len, "I\t600", NULL);
+  reset(port);
+  feed(port, buf, len, 6);
+  check("partial frames", port, published_count == 2 &&
+        check_mppt(&published[0], 1200, 2000, 50, 0, 3) &&
+        check_mppt(&published[1], 1200, 2000, 60, 0, 3));
+}
+
+static void benchmark_text(uint8 port)
+{
+  static uint8 stream[sizeof(capture) * 2048];
+  uint32 i;
+
+  for (i = 0; i < sizeof(stream); i += sizeof(capture))
+  {
+    OS_memcpy(stream + i, capture, sizeof(capture));
+  }
+  reset(port);
+  benchmark("text", port, stream, sizeof(stream));
+  // the partial frame at the end of each capture breaks the first frame of the next
+  check("text stream", port, published_count == sizeof(stream) / sizeof(capture) + 1);
+}
+
+#else // MPPT_MODE_HEX
+
+// a HEX message: command, register, flags, value of the given size and the checksum
+static uint16 hex_message(uint8* out, uint8 command, uint16 id, uint8 flags, uint32 value, uint8 size)
+{
+  uint8 bytes[8];
+  uint8 len = 0;
+  uint8 sum = command;
+  uint16 pos;
+  uint8 i;
+
+  bytes[len++] = LO_UINT16(id);
+  bytes[len++] = HI_UINT16(id);
+  bytes[len++] = flags;
+  for (i = 0; i < size; i++)
+  {
+    bytes[len++] = value >> (8 * i);
+  }
+  for (i = 0; i < len; i++)
+  {
+    sum += bytes[i];
+  }
+  bytes[len++] = 0x55 - sum;
+  pos = sprintf((char*)out, ":%X", command);
+  for (i = 0; i < len; i++)
+  {
+    pos += sprintf((char*)out + pos, "%02X", bytes[i]);
+  }
+  out[pos++] = '\n';
+  return pos;
+}
+
+static void test_hex(uint8 port)
+{
+  uint8 buf[512];
+  uint16 len;
+  uint8 s;
+
+  // replies for the default registers, split every way
+  len = hex_message(buf, 0x7, 0xEDD7, 0, 125, 2);
+  len += hex_message(buf + len, 0x7, 0xEDBB, 0, 3650, 2);
+  len += hex_message(buf + len, 0x7, 0xEDD5, 0, 1320, 2);
+  len += hex_message(buf + len, 0x7, 0x0201, 0, 3, 1);
+  for (s = 1; s < RX_MAX; s++)
+  {
+    reset(port);
+    mppt_reset(port, 1);
+    millis += SCAN_INTERVAL;
+    process_mppt(port, 0);
+    feed(port, buf, len, s);
+    if (!check_mppt(&mppt[MPPT_DEVICE(port)], 1320, 3650, 1250, 0, 3) ||
+        mppt_register_value(port, 0) != 125 || requests == 0)
+    {
+      break;
+    }
+  }
+  check("register replies", port, s == RX_MAX);
+
+  // a bad checksum or an error flag leaves the value alone
+  reset(port);
+  mppt_register(port, 0xEDD5, 1000, 1, 0);
+  len = hex_message(buf, 0x7, 0xEDD5, 0, 1300, 2);
+  len += hex_message(buf + len, 0x7, 0xEDD5, 0, 1400, 2);
+  buf[len - 3] ^= 0x01;
+  len += hex_message(buf + len, 0x7, 0xEDD5, 0x01, 1500, 2);
+  feed(port, buf, len, 5);
+  check("corrupted reply", port, mppt_register_value(port, 0) == 1300);
+
+  // asynchronous signed values with a divisor, between text frame noise
+  reset(port);
+  mppt_register(port, 0xED8F, 0, 10, MPPT_REGISTER_SIGNED);
+  mppt_register(port, 0xEDD7, 0, 1, 0);
+  len = sprintf((char*)buf, "\r\nV\t12800\r\nI\t-1200\r\nChecksum\t");
+  buf[len++] = 0xC3;
+  len += hex_message(buf + len, 0xA, 0xED8F, 0, (uint16)-2000, 2);
+  len += sprintf((char*)buf + len, "\r\nPID\t0xA053\r\n");
+  len += hex_message(buf + len, 0xA, 0xEDD7, 0, 77, 2);
+  feed(port, buf, len, 11);
+  check("async values", port, mppt_register_value(port, 0) == -200 &&
+        mppt_register_value(port, 1) == 77 && mppt[MPPT_DEVICE(port)].main_current == 770);
+
+  // a message cut short by the next one is dropped
+  reset(port);
+  mppt_register(port, 0xEDBB, 0, 1, 0);
+  len = hex_message(buf, 0xA, 0xEDBB, 0, 1999, 2);
+  len = len - 5;
+  len += hex_message(buf + len, 0xA, 0xEDBB, 0, 2001, 2);
+  feed(port, buf, len, 3);
+  check("split message", port, mppt_register_value(port, 0) == 2001);
+}
+
+static void benchmark_hex(uint8 port)
+{
+  static uint8 stream[256 * 1024];
+  uint32 len = 0;
+
+  reset(port);
+  mppt_register(port, 0xEDD7, 0, 1, 0);
+  mppt_register(port, 0xEDBB, 0, 1, 0);
+  mppt_register(port, 0xEDD5, 0, 1, 0);
+  mppt_register(port, 0x0201, 0, 1, 0);
+  while (len + 64 < sizeof(stream))
+  {
+    len += hex_message(stream + len, 0xA, 0xEDD7, 0, len & 0x7FFF, 2);
+    len += hex_message(stream + len, 0xA, 0xEDBB, 0, 3650, 2);
+    len += hex_message(stream + len, 0xA, 0xEDD5, 0, 1320, 2);
+    len += hex_message(stream + len, 0xA, 0x0201, 0, 3, 1);
+  }
+  benchmark("hex", port, stream, len);
+  check("hex stream", port, mppt_register_value(port, 1) == 3650 && mppt_register_value(port, 3) == 3);
+}
+
+#endif // MPPT_MODE_HEX
+
+int main(void)
+{
+  uint8 port;
+
+  for (port = 0; port < OS_MAX_SERIAL; port++)
+  {
+#if MPPT_MODE_TEXT
+    test_text(port);
+#else
+    test_hex(port);
+#endif
+  }
+  for (port = 0; port < OS_MAX_SERIAL; port++)
+  {
+#if MPPT_MODE_TEXT
+    benchmark_text(port);
+#else
+    benchmark_hex(port);
+#endif
+  }
+  return failures != 0;
+}
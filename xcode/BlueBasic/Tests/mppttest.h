@@ -0,0 +1,55 @@
+//
+//  mppttest.h
+//  BlueBasic
+//
+//  Host replacement for os.h and hal_uart.h when victron_mppt.c is built
+//  with MPPT_TEST, see mppttest.c.
+//
+
+#ifndef MPPTTEST_H
+#define MPPTTEST_H
+
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+typedef uint8_t uint8;
+typedef int8_t int8;
+typedef uint16_t uint16;
+typedef int16_t int16;
+typedef uint32_t uint32;
+typedef int32_t int32;
+
+#define FALSE 0
+#define LO_UINT16(a) ((a) & 0xFF)
+#define HI_UINT16(a) (((a) >> 8) & 0xFF)
+#define BUILD_UINT16(lo, hi) ((uint16)(((hi) << 8) | (lo)))
+#define FIELD_SIZEOF(t, f) (sizeof(((t*)0)->f))
+#define osal_memset memset
+#define OS_memcpy memcpy
+
+// two ports like the 2MPPT builds: port 0 is read by copy, port 1 in place
+#define OS_MAX_SERIAL 2
+#define HAL_UART_ISR 2
+#define HAL_UART_PORT_1 1
+
+typedef struct
+{
+  unsigned short onread;
+  unsigned short onwrite;
+  unsigned char sbuf[16];
+  uint8 sbuf_read_pos;
+  unsigned char sflow;
+} os_serial_t;
+
+extern os_serial_t serial[OS_MAX_SERIAL];
+
+extern long OS_get_millis(void);
+extern uint16 HalUARTRead(uint8 port, uint8* buf, uint16 len);
+extern uint16 HalUARTWrite(uint8 port, uint8* buf, uint16 len);
+extern uint16 Hal_UART_RxSpan(uint8 port, uint8** buf);
+extern void Hal_UART_RxConsume(uint8 port, uint16 len);
+
+#include "victron_mppt.h"
+
+#endif // MPPTTEST_H
@@ -0,0 +1,20 @@
+#!/bin/sh
+
+#  mppttest.sh
+#  BlueBasic
+#
+#  Builds the VE.Direct driver in victron_mppt.c on the host, once for each
+#  protocol mode, checks it against mppttest.c and reports parse throughput.
+
+cd "$(dirname "$0")"
+SOURCE=../../../BLE-CC254x-1.5.0.16/Projects/ble/BlueBasic/Source
+CC=${CC:-cc}
+OUT=${TMPDIR:-/tmp}
+
+for mode in TEXT HEX
+do
+  $CC -std=gnu11 -O2 -Wall -Wno-parentheses -Wno-unused-function -DMPPT_TEST -DMPPT_MODE_$mode=1 \
+      -I. -I$SOURCE -o $OUT/mppttest_$mode mppttest.c || exit 1
+  echo "** VE.Direct $mode"
+  $OUT/mppttest_$mode || exit 1
+done
@@ -6,7 +6,9 @@
 #  Created by tim on 7/15/14.
 #  Copyright (c) 2014 tim. All rights reserved.
 
-BLUEBASIC="$HOME/Library/Developer/Xcode/DerivedData/BlueBasic-*/Build/Products/Debug/BlueBasic"
+# Run the tests again with BLUEBASIC set to a build with SIMULATE_FILESTORE=0, so files
+# are also tested in the internal flash store
+BLUEBASIC=${BLUEBASIC:-"$(echo $HOME/Library/Developer/Xcode/DerivedData/BlueBasic-*/Build/Products/Debug/BlueBasic)"}
 
 for test in $(cat tests)
 do
@@ -27,6 +29,8 @@ $line"
     done
     expected=${expected:1} # remove first newline
     rm -f /tmp/flashstore
+    if [ -f $test.adv ]; then export BLUEBASIC_ADV=$test.adv; else unset BLUEBASIC_ADV; fi
+    if [ -f $test.adc ]; then export BLUEBASIC_ADC=$test.adc; else unset BLUEBASIC_ADC; fi
     result=$(echo "${input:1}" | $BLUEBASIC | sed '1,3d') # remove startup header
     if [ "$result" = "$expected" ]
     then